@@ -79,6 +79,8 @@
 #include "macos_util.h"
 #include "rom_patches.h"
 #include "user_strings.h"
+#include "stats.h"
+#include "replay.h"
 
 #include "sheep_driver.h"
 
@@ -213,6 +215,7 @@ uint32 PVR;				// Theoretical PVR
 int64 CPUClockSpeed;	// Processor clock speed (Hz)
 int64 BusClockSpeed;	// Bus clock speed (Hz)
 int64 TimebaseSpeed;	// Timebase clock speed (Hz)
+bool HugePagesEnabled = false;	// Flag: back Mac memory and translation cache with huge pages
 system_info SysInfo;	// System information
 uint8 *RAMBaseHost;		// Base address of Mac RAM (host address space)
 uint8 *ROMBaseHost;		// Base address of Mac ROM (host address space)
@@ -1230,8 +1233,8 @@ status_t SheepShaver::tick_func(void *arg)
 		current += 16625;
 		snooze_until(current, B_SYSTEM_TIMEBASE);
 
-		// Pseudo Mac 1Hz interrupt, update local time
-		if (++tick_counter > 60) {
+		// Pseudo Mac 1Hz interrupt, update local time (done by emulator thread in event record/replay mode)
+		if (++tick_counter > 60 && ReplayMode == REPLAY_OFF) {
 			tick_counter = 0;
 			WriteMacInt32(0x20c, TimerDateTime());
 		}
@@ -1297,6 +1300,11 @@ volatile uint32 InterruptFlags = 0;
 
 void SetInterruptFlag(uint32 flag)
 {
+	InterruptStatsRaise(flag);
+	if (ReplayMode != REPLAY_OFF) {
+		ReplaySetInterruptFlag(flag);
+		return;
+	}
 	atomic_or((int32 *)&InterruptFlags, flag);
 }
 
@@ -111,6 +111,9 @@
 #include "user_strings.h"
 #include "vm_alloc.h"
 #include "sigsegv.h"
+#include "stats.h"
+#include "replay.h"
+#include "snapshot.h"
 #include "sigregs.h"
 #include "rpc.h"
 
@@ -188,6 +191,7 @@ uint32 PVR;				// Theoretical PVR
 int64 CPUClockSpeed;	// Processor clock speed (Hz)
 int64 BusClockSpeed;	// Bus clock speed (Hz)
 int64 TimebaseSpeed;	// Timebase clock speed (Hz)
+bool HugePagesEnabled = false;	// Flag: back Mac memory and translation cache with huge pages
 uint8 *RAMBaseHost;		// Base address of Mac RAM (host address space)
 uint8 *ROMBaseHost;		// Base address of Mac ROM (host address space)
 
@@ -201,12 +205,32 @@ X11_LOCK_TYPE x_display_lock = X11_LOCK_INIT; // X11 display lock
 #endif
 #endif
 
+// Forking clones needs the safe point of the CPU emulator and the X11 video driver
+#if EMULATED_PPC && !defined(USE_SDL_VIDEO)
+#define ENABLE_CLONE 1
+#endif
+
+// Huge page modes
+enum {
+	HUGE_PAGES_OFF,
+	HUGE_PAGES_THP,							// madvise(MADV_HUGEPAGE), kernel may split pages
+	HUGE_PAGES_HUGETLB						// MAP_HUGETLB for Mac RAM, THP for the rest
+};
+const uint32 HUGE_PAGE_SIZE = 0x200000;
+
 static int zero_fd = 0;						// FD of /dev/zero
 static bool lm_area_mapped = false;			// Flag: Low Memory area mmap()ped
 static bool rom_area_mapped = false;		// Flag: Mac ROM mmap()ped
 static bool ram_area_mapped = false;		// Flag: Mac RAM mmap()ped
 static bool dr_cache_area_mapped = false;	// Flag: Mac DR Cache mmap()ped
 static bool dr_emulator_area_mapped = false;// Flag: Mac DR Emulator mmap()ped
+static int huge_pages_mode = HUGE_PAGES_OFF;// Huge page backing for Mac RAM/ROM ("hugepages" prefs item)
+static bool ram_hugetlb = false;			// Flag: Mac RAM mapped with MAP_HUGETLB
+static bool density_mode = false;			// Flag: share memory with other instances ("density" prefs item)
+#if ENABLE_CLONE
+static int32 clone_count = 0;				// Number of clones to fork off ("clone" prefs item)
+static int clone_index = 0;					// 0 in the original instance, n in the n-th clone
+#endif
 static KernelData *kernel_data;				// Pointer to Kernel Data
 static EmulatorData *emulator_data;
 
@@ -248,6 +272,9 @@ uintptr SheepMem::data;						// Top of SheepShaver data (stack like storage)
 // Prototypes
 static bool kernel_data_init(void);
 static bool shm_map_address(int kernel_area, uint32 addr);
+#if ENABLE_CLONE
+static void clone_init(void);
+#endif
 static void Quit(void);
 static void *emul_func(void *arg);
 static void *nvram_func(void *arg);
@@ -355,6 +382,107 @@ static inline int vm_mac_release(uint32 addr, uint32 size)
 }
 
 
+/*
+ *  Huge page backing for Mac RAM and ROM
+ *
+ *  Transparent huge pages are split by the kernel when a 4 KB range is
+ *  protected, so they don't interfere with VOSF or other write protection.
+ *  MAP_HUGETLB pages can't be split and are only used for Mac RAM, which
+ *  is never protected in smaller pieces.
+ */
+
+static void huge_pages_init(void)
+{
+	huge_pages_mode = HUGE_PAGES_OFF;
+	const char *mode = PrefsFindString("hugepages");
+	if (mode == NULL || strcmp(mode, "off") == 0)
+		return;
+	if (strcmp(mode, "thp") == 0)
+		huge_pages_mode = HUGE_PAGES_THP;
+	else if (strcmp(mode, "hugetlb") == 0)
+		huge_pages_mode = HUGE_PAGES_HUGETLB;
+	else
+		fprintf(stderr, "WARNING: Unknown huge page mode '%s', using normal pages\n", mode);
+	HugePagesEnabled = huge_pages_mode != HUGE_PAGES_OFF;
+}
+
+// Replace the mapping of an aligned range with MAP_HUGETLB pages
+static bool vm_mac_hugetlb(uint8 *host, uint32 size)
+{
+#ifdef MAP_HUGETLB
+	if (((uintptr)host & (HUGE_PAGE_SIZE - 1)) || (size & (HUGE_PAGE_SIZE - 1)))
+		return false;
+	void *p = mmap(host, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED) {
+		vm_acquire_fixed(host, size);	// Make sure the range stays mapped
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool vm_mac_advise_huge(uint8 *host, uint32 size)
+{
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+	return madvise(host, size, MADV_HUGEPAGE) == 0;
+#else
+	return false;
+#endif
+}
+
+static void vm_mac_huge_pages(const char *name, uint8 *host, uint32 size, bool hugetlb)
+{
+	if (hugetlb) {
+		if (vm_mac_hugetlb(host, size)) {
+			printf("%s: %d MB on 2 MB pages (hugetlb)\n", name, size >> 20);
+			if (host == RAMBaseHost)
+				ram_hugetlb = true;
+			return;
+		}
+		fprintf(stderr, "WARNING: %s: MAP_HUGETLB failed, trying transparent huge pages\n", name);
+	}
+	if (vm_mac_advise_huge(host, size))
+		printf("%s: %d KB, transparent huge pages requested\n", name, size >> 10);
+	else
+		fprintf(stderr, "WARNING: %s: huge pages not available, using normal pages\n", name);
+}
+
+// Sum up huge page usage of a host address range from /proc/self/smaps
+static uint64 huge_pages_in_range(uintptr start, uintptr end)
+{
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (f == NULL)
+		return 0;
+	uint64 total = 0;
+	bool in_range = false;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long vma_start, vma_end, kb;
+		if (sscanf(line, "%lx-%lx ", &vma_start, &vma_end) == 2)
+			in_range = vma_start < end && vma_end > start;
+		else if (in_range && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 || sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1))
+			total += (uint64)kb * 1024;
+	}
+	fclose(f);
+	return total;
+}
+
+static void huge_pages_stats_print(FILE *f)
+{
+	if (huge_pages_mode == HUGE_PAGES_OFF) {
+		fprintf(f, "  disabled\n");
+		return;
+	}
+	uint64 ram = huge_pages_in_range((uintptr)RAMBaseHost, (uintptr)RAMBaseHost + RAMSize);
+	uint64 rom = huge_pages_in_range((uintptr)ROMBaseHost, (uintptr)ROMBaseHost + ROM_AREA_SIZE);
+	fprintf(f, "  Mac RAM: %llu of %u MB on huge pages%s\n", (unsigned long long)(ram >> 20), RAMSize >> 20, ram_hugetlb ? " (hugetlb)" : "");
+	fprintf(f, "  Mac ROM: %llu of %u KB on huge pages\n", (unsigned long long)(rom >> 10), ROM_AREA_SIZE >> 10);
+	fprintf(f, "  Total: %llu MB\n", (unsigned long long)(huge_pages_in_range(0, ~(uintptr)0) >> 20));
+}
+
+
 /*
  *  Main program
  */
@@ -364,10 +492,18 @@ static void usage(const char *prg_name)
 	printf("Usage: %s [OPTION...]\n", prg_name);
 	printf("\nUnix options:\n");
 	printf("  --display STRING\n    X display to use\n");
+	printf("  --boot-benchmark FILE\n    boot headless unless a screen is given, write boot phase timings as JSON to FILE and quit when Mac OS is up\n");
 	PrefsPrintUsage();
 	exit(0);
 }
 
+// Headless video driver selected ("screen headless/<w>/<h>")?
+static bool headless_screen(void)
+{
+	const char *str = PrefsFindString("screen");
+	return str && strncmp(str, "headless", 8) == 0;
+}
+
 static bool valid_vmdir(const char *path)
 {
 	const int suffix_len = sizeof(".sheepvm") - 1;
@@ -578,6 +714,137 @@ static void get_system_info(void)
 	D(bug("PVR: %08x (assumed)\n", PVR));
 }
 
+/*
+ *  Density mode, for running many instances on one host
+ *
+ *  The decoded ROM is kept in a file named after the ROM image contents
+ *  and mapped privately, so all instances share the page cache copy
+ *  except for the pages that get patched. The file is executed as ROM
+ *  code, so it lives in a directory only accessible by the user, and it
+ *  is only used if it is a regular file of the user with mode 0600.
+ *  Mac RAM and ROM are marked for KSM merging, and RAM pages cleared by
+ *  the guest are released (see ZeroPageAdd()).
+ */
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+const int SHARED_ROM_FORMAT = 1;			// Increase when the output of DecodeROM() changes
+
+static uint64 rom_image_hash(const uint8 *data, uint32 size)
+{
+	// FNV-1a
+	uint64 h = UVAL64(0xcbf29ce484222325);
+	for (uint32 i = 0; i < size; i++)
+		h = (h ^ data[i]) * UVAL64(0x100000001b3);
+	return h;
+}
+
+// Create directory unless it exists, check that it is only accessible by the user
+static bool private_dir(const char *path)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return false;
+	struct stat st;
+	return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+static bool map_shared_rom(const uint8 *data, uint32 size)
+{
+	// Never use a world-writable directory like /tmp
+	char dir[1024];
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir && *runtime_dir)
+		snprintf(dir, sizeof(dir), "%s/sheepshaver", runtime_dir);
+	else
+		snprintf(dir, sizeof(dir), "/dev/shm/sheepshaver-%d", (int)getuid());
+	if (!private_dir(dir)) {
+		fprintf(stderr, "WARNING: %s is not a private directory, not sharing ROM image\n", dir);
+		return false;
+	}
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/rom-v%d-%016llx", dir, SHARED_ROM_FORMAT, (unsigned long long)rom_image_hash(data, size));
+
+	int fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		// First instance, decode ROM and publish it atomically
+		if (!DecodeROM((uint8 *)data, size))
+			return false;
+		char tmp_path[1024];
+		snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+		int tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+		if (tmp_fd < 0)
+			return false;
+		bool ok = fchmod(tmp_fd, 0600) == 0 && write(tmp_fd, ROMBaseHost, ROM_SIZE) == ROM_SIZE;
+		close(tmp_fd);
+		if (!ok || rename(tmp_path, path) < 0) {
+			unlink(tmp_path);
+			return false;
+		}
+		fd = open(path, O_RDONLY | O_NOFOLLOW);
+		if (fd < 0)
+			return false;
+	}
+
+	struct stat st;
+	void *p = MAP_FAILED;
+	int prot = PROT_READ | PROT_WRITE;
+#if !EMULATED_PPC
+	prot |= PROT_EXEC;
+#endif
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 0777) == 0600 && st.st_size == ROM_SIZE)
+		p = mmap(ROMBaseHost, ROM_SIZE, prot, MAP_PRIVATE | MAP_FIXED, fd, 0);
+	else
+		fprintf(stderr, "WARNING: %s has wrong owner, mode or size, not using it\n", path);
+	close(fd);
+	if (p == MAP_FAILED) {
+		// ROM area may have been unmapped, restore it
+		vm_acquire_fixed(ROMBaseHost, ROM_SIZE);
+		vm_protect(ROMBaseHost, ROM_SIZE, prot);
+		return false;
+	}
+	D(bug("Mapped shared ROM image %s\n", path));
+	return true;
+}
+
+static void density_advise_mergeable(const char *name, uint8 *host, uint32 size)
+{
+#if defined(HAVE_MADVISE) && defined(MADV_MERGEABLE)
+	if (madvise(host, size, MADV_MERGEABLE) == 0)
+		return;
+#endif
+	fprintf(stderr, "WARNING: %s: cannot enable KSM page merging\n", name);
+}
+
+// Print a "key: value" line of a /proc file
+static void print_proc_value(FILE *out, const char *file, const char *key)
+{
+	FILE *f = fopen(file, "r");
+	if (f == NULL)
+		return;
+	char line[256];
+	size_t len = strlen(key);
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, len) == 0 && line[len] == ':') {
+			fprintf(out, "  %s", line);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+static void density_stats_print(FILE *f)
+{
+	print_proc_value(f, "/proc/self/status", "VmRSS");
+	print_proc_value(f, "/proc/self/status", "RssAnon");
+	print_proc_value(f, "/proc/self/status", "RssFile");
+	print_proc_value(f, "/proc/self/status", "RssShmem");
+	print_proc_value(f, "/proc/self/ksm_stat", "ksm_merging_pages");
+	print_proc_value(f, "/proc/self/ksm_stat", "ksm_process_profit");
+	fprintf(f, "  Zeroed pages released: %llu\n", (unsigned long long)ZeroPagesReleased);
+}
+
 static bool load_mac_rom(void)
 {
 	uint32 rom_size, actual;
@@ -597,9 +864,11 @@ static bool load_mac_rom(void)
 	rom_tmp = new uint8[ROM_SIZE];
 	actual = read(rom_fd, (void *)rom_tmp, ROM_SIZE);
 	close(rom_fd);
+	BootPhase("rom_load");
 	
 	// Decode Mac ROM
-	if (!DecodeROM(rom_tmp, actual)) {
+	bool rom_decoded = density_mode && map_shared_rom(rom_tmp, actual);
+	if (!rom_decoded && !DecodeROM(rom_tmp, actual)) {
 		if (rom_size != 4*1024*1024) {
 			ErrorAlert(GetString(STR_ROM_SIZE_ERR));
 			return false;
@@ -609,6 +878,7 @@ static bool load_mac_rom(void)
 		}
 	}
 	delete[] rom_tmp;
+	BootPhase("rom_decode");
 	return true;
 }
 
@@ -728,6 +998,9 @@ int main(int argc, char **argv)
 #endif
 #endif
 
+	// Start boot phase timing
+	BootPhaseStart();
+
 	// Parse command line arguments
 	for (int i=1; i<argc; i++) {
 		if (strcmp(argv[i], "--help") == 0) {
@@ -738,6 +1011,12 @@ int main(int argc, char **argv)
 			if (i < argc)
 				x_display_name = strdup(argv[i]);
 #endif
+		} else if (strcmp(argv[i], "--boot-benchmark") == 0) {
+			argv[i++] = NULL;
+			if (i < argc) {
+				BootBenchmarkFile = argv[i];
+				argv[i] = NULL;
+			}
 		} else if (strcmp(argv[i], "--gui-connection") == 0) {
 			argv[i++] = NULL;
 			if (i < argc) {
@@ -797,6 +1076,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	// Boot benchmark runs unattended, without a display unless a screen was given
+	if (BootBenchmarkFile) {
+		PrefsReplaceBool("nogui", true);
+#ifndef USE_SDL_VIDEO
+		if (PrefsFindString("screen") == NULL)
+			PrefsReplaceString("screen", "headless/640/480");
+#endif
+	}
+	BootPhase("prefs");
+
 #ifdef USE_SDL
 	// Initialize SDL system
 	if (!init_sdl())
@@ -804,19 +1093,21 @@ int main(int argc, char **argv)
 #endif
 
 #ifndef USE_SDL_VIDEO
-	// Open display
-	x_display = XOpenDisplay(x_display_name);
-	if (x_display == NULL) {
-		char str[256];
-		sprintf(str, GetString(STR_NO_XSERVER_ERR), XDisplayName(x_display_name));
-		ErrorAlert(str);
-		goto quit;
-	}
+	// Open display, the headless video driver doesn't need one
+	if (!headless_screen()) {
+		x_display = XOpenDisplay(x_display_name);
+		if (x_display == NULL) {
+			char str[256];
+			sprintf(str, GetString(STR_NO_XSERVER_ERR), XDisplayName(x_display_name));
+			ErrorAlert(str);
+			goto quit;
+		}
 
 #if defined(ENABLE_XF86_DGA) && !defined(ENABLE_MON)
-	// Fork out, so we can return from fullscreen mode when things get ugly
-	XF86DGAForkApp(DefaultScreen(x_display));
+		// Fork out, so we can return from fullscreen mode when things get ugly
+		XF86DGAForkApp(DefaultScreen(x_display));
 #endif
+	}
 #endif
 
 #ifdef ENABLE_MON
@@ -836,6 +1127,7 @@ int main(int argc, char **argv)
 
 	// Init system routines
 	SysInit();
+	BootPhase("host_init");
 
 	// Show preferences editor
 	if (!PrefsFindBool("nogui"))
@@ -895,6 +1187,7 @@ int main(int argc, char **argv)
 	}
 	
 	// Create area for Mac RAM
+	huge_pages_init();
 	RAMSize = PrefsFindInt32("ramsize");
 	if (RAMSize < 8*1024*1024) {
 		WarningAlert(GetString(STR_SMALL_RAM_WARN));
@@ -923,16 +1216,28 @@ int main(int argc, char **argv)
 #if REAL_ADDRESSING
 		// Allocate RAM at any address. Since ROM must be higher than RAM, allocate the RAM
 		// and ROM areas contiguously, plus a little extra to allow for ROM address alignment.
-		RAMBaseHost = vm_mac_acquire(RAMSize + ROM_AREA_SIZE + ROM_ALIGNMENT);
+		// With huge pages, also allow for aligning RAM to a 2 MB boundary.
+		uint32 huge_align = huge_pages_mode != HUGE_PAGES_OFF ? HUGE_PAGE_SIZE : 0;
+		uint32 ram_rom_size = RAMSize + ROM_AREA_SIZE + ROM_ALIGNMENT + huge_align;
+		RAMBaseHost = vm_mac_acquire(ram_rom_size);
 		if (RAMBaseHost == VM_MAP_FAILED) {
 			sprintf(str, GetString(STR_RAM_ROM_MMAP_ERR), strerror(errno));
 			ErrorAlert(str);
 			goto quit;
 		}
+		uint8 *ram_rom_end = RAMBaseHost + ram_rom_size;
+		if (huge_align) {
+			uint8 *aligned = (uint8 *)(((uintptr)RAMBaseHost + huge_align - 1) & -(uintptr)huge_align);
+			if (aligned > RAMBaseHost)
+				vm_release(RAMBaseHost, aligned - RAMBaseHost);
+			RAMBaseHost = aligned;
+		}
 		RAMBase = Host2MacAddr(RAMBaseHost);
 		ROMBase = (RAMBase + RAMSize + ROM_ALIGNMENT -1) & -ROM_ALIGNMENT;
 		ROMBaseHost = Mac2HostAddr(ROMBase);
 		ram_rom_areas_contiguous = true;
+		if (huge_align && ROMBaseHost + ROM_AREA_SIZE < ram_rom_end)	// Release unused tail
+			vm_release(ROMBaseHost + ROM_AREA_SIZE, ram_rom_end - (ROMBaseHost + ROM_AREA_SIZE));
 #else
 		if (vm_mac_acquire_fixed(RAM_BASE, RAMSize) < 0) {
 			sprintf(str, GetString(STR_RAM_MMAP_ERR), strerror(errno));
@@ -943,6 +1248,8 @@ int main(int argc, char **argv)
 		RAMBaseHost = Mac2HostAddr(RAMBase);
 #endif
 	}
+	if (huge_pages_mode != HUGE_PAGES_OFF)
+		vm_mac_huge_pages("Mac RAM", RAMBaseHost, RAMSize, huge_pages_mode == HUGE_PAGES_HUGETLB);
 #if !EMULATED_PPC
 	if (vm_protect(RAMBaseHost, RAMSize, VM_PAGE_READ | VM_PAGE_WRITE | VM_PAGE_EXECUTE) < 0) {
 		sprintf(str, GetString(STR_RAM_MMAP_ERR), strerror(errno));
@@ -977,6 +1284,10 @@ int main(int argc, char **argv)
 #endif
 	rom_area_mapped = true;
 	D(bug("ROM area at %p (%08x)\n", ROMBaseHost, ROMBase));
+	if (huge_pages_mode != HUGE_PAGES_OFF) {
+		vm_mac_huge_pages("Mac ROM", ROMBaseHost, ROM_AREA_SIZE, false);
+		StatsRegister("huge pages", huge_pages_stats_print);
+	}
 
 	if (RAMBase > ROMBase) {
 		ErrorAlert(GetString(STR_RAM_HIGHER_THAN_ROM_ERR));
@@ -984,20 +1295,54 @@ int main(int argc, char **argv)
 	}
 
 	// Load Mac ROM
+	BootPhase("memory");
+	density_mode = PrefsFindBool("density");
 	if (!load_mac_rom())
 		goto quit;
+#ifdef HAVE_MADVISE
+	ZeroPageReclaim = density_mode;
+#endif
+
+#if ENABLE_CLONE
+	// Fork clones once Mac OS is up
+	clone_init();
+#endif
+
+	// Mac memory saved in snapshots, ROM is rebuilt by load_mac_rom() and PatchROM().
+	// Must be registered before InitAll() loads a snapshot
+	if (lm_area_mapped)
+		SnapshotAddArea(0, 0x3000, false);
+	SnapshotAddArea(KERNEL_DATA_BASE, KERNEL_AREA_SIZE, false);
+	SnapshotAddArea(DR_EMULATOR_BASE, DR_EMULATOR_SIZE, false);
+	SnapshotAddArea(DR_CACHE_BASE, DR_CACHE_SIZE, false);
+	SnapshotAddArea(RAMBase, RAMSize, true);
 
 	// Initialize everything
 	if (!InitAll(vmdir))
 		goto quit;
 	D(bug("Initialization complete\n"));
 
+	// Mac RAM restored from a snapshot is a private file mapping. There,
+	// MADV_DONTNEED brings back the file contents instead of zeroes, and KSM
+	// only merges anonymous pages. Instances restored from the same
+	// snapshot share the untouched pages through the page cache instead.
+	if (SnapshotRestored)
+		ZeroPageReclaim = false;
+
 	// Clear caches (as we loaded and patched code) and write protect ROM
 #if !EMULATED_PPC
 	flush_icache_range(ROMBase, ROMBase + ROM_AREA_SIZE);
 #endif
 	vm_protect(ROMBaseHost, ROM_AREA_SIZE, VM_PAGE_READ | VM_PAGE_EXECUTE);
 
+	// Let the kernel merge identical pages with other instances
+	if (density_mode) {
+		if (!SnapshotRestored)
+			density_advise_mergeable("Mac RAM", RAMBaseHost, RAMSize);
+		density_advise_mergeable("Mac ROM", ROMBaseHost, ROM_AREA_SIZE);
+		StatsRegister("memory", density_stats_print);
+	}
+
 	// Start 60Hz thread
 	tick_thread_cancel = false;
 	tick_thread_active = (pthread_create(&tick_thread, NULL, tick_func, NULL) == 0);
@@ -1194,6 +1539,157 @@ static bool shm_map_address(int kernel_area, uint32 addr)
 }
 
 
+/*
+ *  Fork copies of the running instance ("clone" prefs item)
+ *
+ *  Mac RAM, ROM and the translation cache are private mappings and are
+ *  shared with the clones copy-on-write. Everything the clones must not
+ *  share with the original is replaced in the clone.
+ */
+
+#if ENABLE_CLONE
+// Give the clone its own copy of the Kernel Data segment, SysV shared memory stays shared across fork()
+static bool kernel_data_clone(void)
+{
+	uint32 kernel_area_size = (KERNEL_AREA_SIZE + SHMLBA - 1) & -SHMLBA;
+	uint8 *kernel_area = Mac2HostAddr(KERNEL_DATA_BASE & -SHMLBA);
+	uint8 *copy = new uint8[kernel_area_size];
+	memcpy(copy, kernel_area, kernel_area_size);
+	shmdt(Mac2HostAddr(KERNEL_DATA_BASE & -SHMLBA));
+	shmdt(Mac2HostAddr(KERNEL_DATA2_BASE & -SHMLBA));
+	bool ok = kernel_data_init();
+	if (ok)
+		memcpy(kernel_area, copy, kernel_area_size);
+	delete[] copy;
+	return ok;
+}
+
+// Give the clone its own file offsets, open file descriptions stay shared across fork()
+static void clone_reopen_files(void)
+{
+#if defined(__linux__) && defined(HAVE_DIRENT_H)
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		return;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		int fd = atoi(de->d_name);
+		struct stat st;
+		if (fd == dirfd(dir) || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		char path[64];
+		sprintf(path, "/proc/self/fd/%d", fd);
+		int new_fd = open(path, fcntl(fd, F_GETFL) & (O_ACCMODE | O_APPEND));
+		if (new_fd < 0) {
+			D(bug("Clone: cannot reopen fd %d\n", fd));
+			continue;
+		}
+		lseek(new_fd, lseek(fd, 0, SEEK_CUR), SEEK_SET);
+		int fd_flags = fcntl(fd, F_GETFD);
+		dup2(new_fd, fd);
+		fcntl(fd, F_SETFD, fd_flags);
+		close(new_fd);
+	}
+	closedir(dir);
+#endif
+}
+
+// Called by the CPU emulator at a safe point once Mac OS is up
+static void clone_instances(void)
+{
+	int32 count = clone_count;
+	clone_count = 0;
+	if (count <= 0 || ReplayMode != REPLAY_OFF)
+		return;
+
+	// fork() only keeps the calling thread, stop the others so that no locks are held
+	if (!VideoCloneBegin()) {
+		fprintf(stderr, "WARNING: Cannot clone in full screen mode\n");
+		return;
+	}
+	TimerCloneBegin();
+	if (tick_thread_active) {
+		tick_thread_cancel = true;
+		pthread_join(tick_thread, NULL);
+	}
+	if (nvram_thread_active) {
+		nvram_thread_cancel = true;
+		pthread_join(nvram_thread, NULL);
+	}
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 1; i <= count; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "WARNING: Cannot fork clone %d: %s\n", i, strerror(errno));
+			break;
+		}
+		if (pid == 0) {
+			clone_index = i;
+			break;
+		}
+		printf("Started clone %d (pid %d)\n", i, pid);
+	}
+
+	if (clone_index) {
+		// The GUI only talks to the original instance, and the NVRAM
+		// file belongs to it too
+		gui_connection = NULL;
+		XPRAMSaveEnabled = false;
+		clone_reopen_files();
+		if (!kernel_data_clone() || !VideoCloneEnd(true)) {
+			fprintf(stderr, "Clone %d: cannot set up host resources\n", clone_index);
+			_exit(1);
+		}
+	} else
+		VideoCloneEnd(false);
+
+	// Restart threads
+	TimerCloneEnd();
+	if (tick_thread_active) {
+		tick_thread_cancel = false;
+		tick_thread_active = (pthread_create(&tick_thread, NULL, tick_func, NULL) == 0);
+	}
+	if (nvram_thread_active) {
+		nvram_thread_cancel = false;
+		nvram_thread_active = (pthread_create(&nvram_thread, NULL, nvram_func, NULL) == 0);
+	}
+}
+
+static void clone_init(void)
+{
+	clone_count = PrefsFindInt32("clone");
+	if (clone_count <= 0)
+		return;
+
+	// Host devices that can't be shared or duplicated
+	const char *reason = NULL;
+	const char *str = PrefsFindString("ether");
+	if (str && *str)
+		reason = "networking";
+	else if (!PrefsFindBool("nosound"))
+		reason = "sound";
+	for (int i = 0; reason == NULL && (str = PrefsFindString("disk", i)) != NULL; i++) {
+		if (*str != '*')
+			reason = "writable disks";
+	}
+	for (int i = 0; reason == NULL && (str = PrefsFindString("floppy", i)) != NULL; i++) {
+		if (*str != '*')
+			reason = "writable disks";
+	}
+	if (reason) {
+		fprintf(stderr, "WARNING: Cannot clone with %s enabled, ignored\n", reason);
+		clone_count = 0;
+		return;
+	}
+	SnapshotSetBootHook(clone_instances);
+}
+#endif
+
+
 /*
  *  Jump into Mac ROM, start 680x0 emulator
  */
@@ -1221,6 +1717,7 @@ static void *emul_func(void *arg)
 
 	// Jump to ROM boot routine
 	D(bug("Jumping to ROM\n"));
+	BootPhase("threads");
 #if EMULATED_PPC
 	jump_to_rom(ROMBase + 0x310000);
 #else
@@ -1326,7 +1823,7 @@ void MakeExecutable(int dummy, uint32 start, uint32 length)
 
 static void nvram_watchdog(void)
 {
-	if (memcmp(last_xpram, XPRAM, XPRAM_SIZE)) {
+	if (XPRAMSaveEnabled && memcmp(last_xpram, XPRAM, XPRAM_SIZE)) {
 		memcpy(last_xpram, XPRAM, XPRAM_SIZE);
 		SaveXPRAM();
 	}
@@ -1409,8 +1906,8 @@ static void *tick_func(void *arg)
 		}
 #endif
 
-		// Pseudo Mac 1Hz interrupt, update local time
-		if (++tick_counter > 60) {
+		// Pseudo Mac 1Hz interrupt, update local time (done by emulator thread in event record/replay mode)
+		if (++tick_counter > 60 && ReplayMode == REPLAY_OFF) {
 			tick_counter = 0;
 			WriteMacInt32(0x20c, TimerDateTime());
 		}
@@ -1563,6 +2060,11 @@ volatile uint32 InterruptFlags = 0;
 
 void SetInterruptFlag(uint32 flag)
 {
+	InterruptStatsRaise(flag);
+	if (ReplayMode != REPLAY_OFF) {
+		ReplaySetInterruptFlag(flag);
+		return;
+	}
 	atomic_or((int *)&InterruptFlags, flag);
 }
 
@@ -1734,8 +2236,11 @@ static void sigsegv_handler(int sig, siginfo_t *sip, void *scp)
 	si.pc = (sigsegv_address_t)r->pc();
 #endif
 	extern bool Screen_fault_handler(sigsegv_info_t *sip);
-	if (Screen_fault_handler(&si))
+	if (Screen_fault_handler(&si)) {
+		if (video_damage_hook)
+			video_damage_hook();
 		return;
+	}
 #endif
 
 	// Fault in Mac ROM or RAM or DR Cache?
@@ -2166,6 +2671,10 @@ bool SheepMem::Init(void)
 	if (vm_protect(Mac2HostAddr(zero_page), page_size, VM_PAGE_READ) < 0)
 		return false;
 
+	// Everything but the zero page goes into snapshots
+	SnapshotAddArea(base, zero_page - base, false);
+	SnapshotAddArea(zero_page + page_size, base + size - (zero_page + page_size), false);
+
 #if EMULATED_PPC
 	// Allocate alternate stack for PowerPC interrupt routine
 	sig_stack = base + size;
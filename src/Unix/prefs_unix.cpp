@@ -41,6 +41,11 @@ prefs_desc platform_prefs_items[] = {
 	{"ignoresegv", TYPE_BOOLEAN, false,    "ignore illegal memory accesses"},
 #endif
 	{"idlewait", TYPE_BOOLEAN, false,      "sleep when idle"},
+	{"density", TYPE_BOOLEAN, false,       "share ROM and identical pages with other instances, release zeroed pages"},
+	{"hugepages", TYPE_STRING, false,      "back Mac RAM/ROM and translation cache with huge pages (off/thp/hugetlb)"},
+	{"clone", TYPE_INT32, false,           "number of copies to fork off once Mac OS has started"},
+	{"blitthreads", TYPE_INT32, false,     "number of threads converting window contents (0 = half the CPUs)"},
+	{"fbexport", TYPE_STRING, false,       "export frame buffer in shared memory, path of the socket handing it out"},
 	{NULL, TYPE_END, false, NULL} // End of list
 };
 
@@ -114,8 +114,10 @@
 #define PPC_PROFILE_COMPILE_TIME 0
 #define PPC_PROFILE_GENERIC_CALLS 0
 #define PPC_PROFILE_REGS_USE 0
+#ifndef KPX_MAX_CPUS
 #define KPX_MAX_CPUS 1
-#if ENABLE_DYNGEN
+#endif
+#if ENABLE_DYNGEN && !defined(PPC_ENABLE_JIT)
 #define PPC_ENABLE_JIT 1
 #endif
 #if defined(__i386__) || defined(__x86_64__)
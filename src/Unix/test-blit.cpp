@@ -0,0 +1,139 @@
+/*
+ *  test-blit.cpp - Check and time vectorized frame buffer conversion
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "sysdeps.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "video_blit_simd.h"
+
+// Normally in video_blit.cpp
+uint32 ExpandMap[256];
+
+struct blit_format {
+	const char *name;
+	int mac_depth;
+	int bits_per_pixel;
+	uint32 rmask, gmask, bmask;
+};
+
+static const blit_format formats[] = {
+	{"1 bit -> 16 bit", 1, 16, 0xf800, 0x07e0, 0x001f},
+	{"1 bit -> 32 bit", 1, 32, 0xff0000, 0x00ff00, 0x0000ff},
+	{"2 bit -> 16 bit", 2, 16, 0xf800, 0x07e0, 0x001f},
+	{"2 bit -> 32 bit", 2, 32, 0xff0000, 0x00ff00, 0x0000ff},
+	{"4 bit -> 16 bit", 4, 16, 0xf800, 0x07e0, 0x001f},
+	{"4 bit -> 32 bit", 4, 32, 0xff0000, 0x00ff00, 0x0000ff},
+	{"RGB555 -> RGB555", 16, 16, 0x7c00, 0x03e0, 0x001f},
+	{"RGB555 -> RGB565", 16, 16, 0xf800, 0x07e0, 0x001f},
+	{"xRGB -> xRGB8888", 32, 32, 0xff0000, 0x00ff00, 0x0000ff},
+};
+const int NUM_FORMATS = sizeof(formats) / sizeof(formats[0]);
+
+const int MAX_LENGTH = 10240;				// Bytes per line of a 2560 pixel wide 32-bit mode
+const int MAX_EXPANSION = 32;				// 1 bit -> 32 bit
+const int GUARD = 64;						// Bytes after the converted pixels that must stay untouched
+
+static uint8 src[MAX_LENGTH + 16];
+static uint8 dst_ref[MAX_LENGTH * MAX_EXPANSION + GUARD];
+static uint8 dst_simd[MAX_LENGTH * MAX_EXPANSION + GUARD];
+
+static uint64 get_ticks_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Compare kernel with the scalar version for all short lengths and source alignments
+static bool check_format(const blit_format &f, blit_kernel_func ref, blit_kernel_func simd)
+{
+	const int out_size = f.mac_depth < 8 ? f.bits_per_pixel / f.mac_depth : 1;	// Bytes per source byte
+	const int step = f.mac_depth <= 8 ? 1 : f.mac_depth / 8;
+	for (int length = 0; length <= 256 + step; length += step) {
+		for (int offset = 0; offset < 16; offset++) {
+			int out_bytes = length * out_size;
+			memset(dst_ref, 0xa5, out_bytes + GUARD);
+			memset(dst_simd, 0xa5, out_bytes + GUARD);
+			ref(dst_ref, src + offset, length);
+			simd(dst_simd, src + offset, length);
+			if (memcmp(dst_ref, dst_simd, out_bytes + GUARD)) {
+				printf("%s: mismatch at length %d, offset %d\n", f.name, length, offset);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Convert a 1440 line frame repeatedly, return frames per second
+static double time_kernel(const blit_format &f, blit_kernel_func func)
+{
+	const int length = 2560 * f.mac_depth / 8;
+	const int frames = 20;
+	uint64 start = get_ticks_usec();
+	for (int frame = 0; frame < frames; frame++) {
+		for (int y = 0; y < 1440; y++)
+			func(dst_simd, src, length);
+	}
+	uint64 elapsed = get_ticks_usec() - start;
+	return elapsed ? frames * 1.0e6 / elapsed : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	bool bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+
+	srand(1);
+	for (int i = 0; i < 256; i++)
+		ExpandMap[i] = (rand() << 16) ^ rand();
+	for (int i = 0; i < MAX_LENGTH + 16; i++)
+		src[i] = rand();
+
+	int errors = 0, tested = 0;
+	for (int i = 0; i < NUM_FORMATS; i++) {
+		const blit_format &f = formats[i];
+		blit_kernel_func ref = FindBlitKernel(f.mac_depth, f.bits_per_pixel, f.rmask, f.gmask, f.bmask, true, false);
+		blit_kernel_func simd = FindBlitKernel(f.mac_depth, f.bits_per_pixel, f.rmask, f.gmask, f.bmask, true, true);
+		if (ref == NULL) {
+			printf("%s: no scalar kernel\n", f.name);
+			errors++;
+			continue;
+		}
+		if (simd == NULL) {
+			printf("%s: no vectorized kernel on this host, skipped\n", f.name);
+			continue;
+		}
+		tested++;
+		if (!check_format(f, ref, simd))
+			errors++;
+		else if (bench) {
+			double ref_fps = time_kernel(f, ref);
+			double simd_fps = time_kernel(f, simd);
+			printf("%-18s scalar %8.1f fps, vectorized %8.1f fps (%.1fx)\n", f.name, ref_fps, simd_fps, ref_fps ? simd_fps / ref_fps : 0);
+		}
+	}
+
+	printf("%d formats checked, %d errors\n", tested, errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,237 @@
+/*
+ *  test-snapshot.cpp - Check saving and restoring machine state snapshots
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  Usage:
+ *    test-snapshot      save a snapshot of two memory areas and some host
+ *                       state, then restore it the way main_unix.cpp does
+ */
+
+#include "sysdeps.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "cpu_emulation.h"
+#include "xpram.h"
+#include "ether.h"
+#include "snapshot.h"
+
+// Mac memory layout, the RAM area is mapped from the file on restore
+const uint32 TEST_BASE = 0x50000000;
+const uint32 TEST_SIZE = 0x400000;
+const uint32 LOW_MEM_SIZE = 0x3000;
+const uint32 TEST_RAM_BASE = TEST_BASE + 0x100000;
+const uint32 TEST_RAM_SIZE = 0x200000;
+
+// Normally in main_*.cpp and other modules
+uint32 RAMBase, RAMSize, ROMBase;
+uint8 XPRAM[XPRAM_SIZE];
+bool ether_driver_opened = false;
+
+static const char *prefs_load = NULL, *prefs_save = NULL;
+
+const char *PrefsFindString(const char *name, int index)
+{
+	if (strcmp(name, "snapshotload") == 0)
+		return prefs_load;
+	if (strcmp(name, "snapshotsave") == 0)
+		return prefs_save;
+	return NULL;
+}
+
+void ErrorAlert(const char *text)
+{
+	printf("ErrorAlert: %s\n", text);
+}
+
+// Stands in for the timer, whose prepare hook fails with too many tasks
+static uint32 timer_state;
+static bool timer_prepare_ok = true;
+
+static bool timer_prepare(void)
+{
+	return timer_prepare_ok;
+}
+
+void TimerSnapshotRegister(void)
+{
+	SnapshotAddState("timer", &timer_state, sizeof(timer_state), SNAPSHOT_STATE, timer_prepare);
+}
+
+void VideoSnapshotRegister(void) {}
+void MacOSUtilSnapshotRegister(void) {}
+void NameRegistrySnapshotRegister(void) {}
+void SerialSnapshotRegister(void) {}
+
+
+/*
+ *  Tests
+ */
+
+static int errors = 0;
+
+#define CHECK(COND, WHAT) do {						\
+	if (!(COND)) {									\
+		printf("FAIL: %s\n", WHAT);					\
+		errors++;									\
+	}												\
+} while (0)
+
+static void fill(uint8 *p, uint32 size, uint32 seed)
+{
+	for (uint32 i = 0; i < size; i++)
+		p[i] = (uint8)((i * 7 + seed) ^ (i >> 12));
+}
+
+static bool filled(const uint8 *p, uint32 size, uint32 seed)
+{
+	for (uint32 i = 0; i < size; i++) {
+		if (p[i] != (uint8)((i * 7 + seed) ^ (i >> 12)))
+			return false;
+	}
+	return true;
+}
+
+static bool file_exists(const char *path)
+{
+	return access(path, F_OK) == 0;
+}
+
+// Request a snapshot as after booting
+static void request_save(const char *path)
+{
+	prefs_load = NULL;
+	prefs_save = path;
+	SnapshotInit();
+	SnapshotBootDone();
+}
+
+// Request a snapshot and reach the safe point at the top level
+static void save(const char *path)
+{
+	request_save(path);
+	if (SnapshotPending)
+		SnapshotSafePoint(0);
+}
+
+static bool restore(const char *path)
+{
+	prefs_load = path;
+	prefs_save = NULL;
+	return SnapshotInit();
+}
+
+static void scramble(void)
+{
+	memset(Mac2HostAddr(TEST_BASE), 0xa5, LOW_MEM_SIZE);
+	memset(Mac2HostAddr(TEST_RAM_BASE), 0xa5, TEST_RAM_SIZE);
+	memset(XPRAM, 0, XPRAM_SIZE);
+	memset(&SnapshotCPU, 0, sizeof(SnapshotCPU));
+	timer_state = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8 *host = Mac2HostAddr(TEST_BASE);
+	if (mmap(host, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != host) {
+		printf("Cannot map test memory at %p\n", host);
+		return 1;
+	}
+	RAMBase = TEST_RAM_BASE;
+	RAMSize = TEST_RAM_SIZE;
+	ROMBase = TEST_BASE + TEST_SIZE;
+
+	char path[64], path2[64];
+	snprintf(path, sizeof(path), "/tmp/test-snapshot-%d", (int)getpid());
+	snprintf(path2, sizeof(path2), "/tmp/test-snapshot-%d.2", (int)getpid());
+
+	// Areas are registered before SnapshotInit(), as in main_unix.cpp
+	SnapshotAddArea(TEST_BASE, LOW_MEM_SIZE, false);
+	SnapshotAddArea(TEST_RAM_BASE, TEST_RAM_SIZE, true);
+
+	fill(Mac2HostAddr(TEST_BASE), LOW_MEM_SIZE, 1);
+	fill(Mac2HostAddr(TEST_RAM_BASE), TEST_RAM_SIZE, 2);
+	fill(XPRAM, XPRAM_SIZE, 3);
+	SnapshotCPU.pc = 0x12345678;
+	SnapshotCPU.gpr[1] = 0x87654321;
+	timer_state = 0xcafebabe;
+
+	printf("Testing save\n");
+	save(path);
+	CHECK(file_exists(path), "snapshot not written");
+
+	printf("Testing save requested inside a nested execute()\n");
+	request_save(path2);
+	SnapshotSafePoint(1);
+	CHECK(!file_exists(path2), "snapshot written inside a nested execute()");
+	CHECK(SnapshotPending, "snapshot request dropped inside a nested execute()");
+	SnapshotSafePoint(0);
+	CHECK(!SnapshotPending && file_exists(path2), "snapshot not written at the top level");
+	unlink(path2);
+
+	printf("Testing refused saves\n");
+	ether_driver_opened = true;
+	save(path2);
+	CHECK(!file_exists(path2), "snapshot written with Ethernet driver open");
+	ether_driver_opened = false;
+	SnapshotOpenDrivers = SNAPSHOT_DRIVER_DISK;
+	save(path2);
+	CHECK(!file_exists(path2), "snapshot written with disk driver open");
+	SnapshotOpenDrivers = SNAPSHOT_DRIVER_SONY | SNAPSHOT_DRIVER_CDROM;
+	save(path2);
+	CHECK(!file_exists(path2), "snapshot written with floppy and CD-ROM drivers open");
+	SnapshotOpenDrivers = 0;
+	timer_prepare_ok = false;
+	save(path2);
+	CHECK(!file_exists(path2), "snapshot written although a prepare hook failed");
+	timer_prepare_ok = true;
+	unlink(path2);
+
+	printf("Testing restore with different configuration\n");
+	scramble();
+	RAMSize = TEST_RAM_SIZE / 2;
+	CHECK(!restore(path), "snapshot with different RAM size restored");
+	CHECK(!SnapshotRestored, "SnapshotRestored set after failed restore");
+	CHECK(*Mac2HostAddr(TEST_RAM_BASE) == 0xa5, "memory touched by failed restore");
+	RAMSize = TEST_RAM_SIZE;
+
+	printf("Testing restore\n");
+	CHECK(restore(path), "restore failed");
+	CHECK(SnapshotRestored, "SnapshotRestored not set");
+	CHECK(filled(Mac2HostAddr(TEST_BASE), LOW_MEM_SIZE, 1), "low memory area differs");
+	CHECK(filled(Mac2HostAddr(TEST_RAM_BASE), TEST_RAM_SIZE, 2), "RAM area differs");
+	CHECK(filled(XPRAM, XPRAM_SIZE, 3), "XPRAM differs");
+	CHECK(SnapshotCPU.pc == 0x12345678 && SnapshotCPU.gpr[1] == 0x87654321, "CPU state differs");
+	CHECK(timer_state == 0xcafebabe, "timer state differs");
+
+	// The RAM area is a private mapping, writes must not reach the file
+	fill(Mac2HostAddr(TEST_RAM_BASE), TEST_RAM_SIZE, 4);
+	scramble();
+	CHECK(restore(path) && filled(Mac2HostAddr(TEST_RAM_BASE), TEST_RAM_SIZE, 2), "RAM writes after restore reached the file");
+
+	unlink(path);
+	printf("%d errors\n", errors);
+	return errors ? 1 : 0;
+}
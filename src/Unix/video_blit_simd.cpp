@@ -0,0 +1,288 @@
+/*
+ *  video_blit_simd.cpp - Vectorized frame buffer conversion
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  NOTES:
+ *    These kernels replace the generic Screen_blit routines for the common
+ *    conversions on TrueColor visuals with the host byte order:
+ *
+ *    - 1/2/4-bit Mac modes to 16/32-bit pixels: the pixel indices are
+ *      unpacked into bytes and looked up with pshufb in byte planes of the
+ *      first 16 ExpandMap entries.
+ *    - 16-bit Mac mode (big-endian RGB555) to RGB555 and RGB565.
+ *    - 32-bit Mac mode (big-endian xRGB) to xRGB8888.
+ *
+ *    8-bit modes need a 256 entry table, which doesn't fit in a register.
+ *    They are left to the scalar blitter, which already does a single
+ *    table load per pixel.
+ *
+ *    The SSSE3 code is compiled with a target attribute and only chosen if
+ *    the CPU supports it, so the rest of the program doesn't need SSSE3.
+ */
+
+#include "sysdeps.h"
+
+#include <string.h>
+
+#if EMULATED_PPC && (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+#define USE_SIMD_BLITTERS 1
+#include <tmmintrin.h>
+#include "utils/utils-cpuinfo.hpp"
+#endif
+
+#include "video_blit_simd.h"
+
+
+// Palette expansion map, from video_blit.cpp
+extern uint32 ExpandMap[256];
+
+
+/*
+ *  Scalar reference kernels
+ */
+
+template <class T>
+static void expand_1(uint8 *dest, const uint8 *p, uint32 length)
+{
+	T *q = (T *)dest;
+	for (uint32 i=0; i<length; i++) {
+		uint8 c = *p++;
+		for (int b=7; b>=0; b--)
+			*q++ = ExpandMap[(c >> b) & 1];
+	}
+}
+
+template <class T>
+static void expand_2(uint8 *dest, const uint8 *p, uint32 length)
+{
+	T *q = (T *)dest;
+	for (uint32 i=0; i<length; i++) {
+		uint8 c = *p++;
+		*q++ = ExpandMap[c >> 6];
+		*q++ = ExpandMap[(c >> 4) & 3];
+		*q++ = ExpandMap[(c >> 2) & 3];
+		*q++ = ExpandMap[c & 3];
+	}
+}
+
+template <class T>
+static void expand_4(uint8 *dest, const uint8 *p, uint32 length)
+{
+	T *q = (T *)dest;
+	for (uint32 i=0; i<length; i++) {
+		uint8 c = *p++;
+		*q++ = ExpandMap[c >> 4];
+		*q++ = ExpandMap[c & 0x0f];
+	}
+}
+
+static void convert_555_to_555(uint8 *dest, const uint8 *p, uint32 length)
+{
+	uint16 *q = (uint16 *)dest;
+	for (uint32 i=0; i<length/2; i++, p+=2)
+		*q++ = (p[0] << 8) | p[1];
+}
+
+static void convert_555_to_565(uint8 *dest, const uint8 *p, uint32 length)
+{
+	uint16 *q = (uint16 *)dest;
+	for (uint32 i=0; i<length/2; i++, p+=2) {
+		uint16 c = (p[0] << 8) | p[1];
+		*q++ = ((c & 0x7fe0) << 1) | (c & 0x1f);
+	}
+}
+
+static void convert_8888_to_8888(uint8 *dest, const uint8 *p, uint32 length)
+{
+	uint32 *q = (uint32 *)dest;
+	for (uint32 i=0; i<length/4; i++, p+=4)
+		*q++ = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+/*
+ *  SSSE3 kernels
+ */
+
+#ifdef USE_SIMD_BLITTERS
+#define SSSE3 __attribute__((target("ssse3")))
+
+// Split the first 16 ExpandMap entries into byte planes for pshufb
+template <int BPP>
+SSSE3 static inline void load_planes(__m128i *planes)
+{
+	uint8 t[BPP][16];
+	for (int i=0; i<16; i++) {
+		for (int b=0; b<BPP; b++)
+			t[b][i] = ExpandMap[i] >> (8 * b);
+	}
+	for (int b=0; b<BPP; b++)
+		planes[b] = _mm_loadu_si128((const __m128i *)t[b]);
+}
+
+// Look up 16 pixel indices and store the pixels
+template <int BPP>
+SSSE3 static inline void store_pixels(uint8 *q, __m128i idx, const __m128i *planes)
+{
+	__m128i b0 = _mm_shuffle_epi8(planes[0], idx);
+	__m128i b1 = _mm_shuffle_epi8(planes[1], idx);
+	if (BPP == 2) {
+		_mm_storeu_si128((__m128i *)q, _mm_unpacklo_epi8(b0, b1));
+		_mm_storeu_si128((__m128i *)(q + 16), _mm_unpackhi_epi8(b0, b1));
+	} else {
+		__m128i b2 = _mm_shuffle_epi8(planes[2], idx);
+		__m128i b3 = _mm_shuffle_epi8(planes[3], idx);
+		__m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+		__m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+		_mm_storeu_si128((__m128i *)q, _mm_unpacklo_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i *)(q + 16), _mm_unpackhi_epi16(lo01, lo23));
+		_mm_storeu_si128((__m128i *)(q + 32), _mm_unpacklo_epi16(hi01, hi23));
+		_mm_storeu_si128((__m128i *)(q + 48), _mm_unpackhi_epi16(hi01, hi23));
+	}
+}
+
+template <class T>
+SSSE3 static void expand_1_ssse3(uint8 *dest, const uint8 *p, uint32 length)
+{
+	const int BPP = sizeof(T);
+	__m128i planes[BPP];
+	load_planes<BPP>(planes);
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+	const __m128i bits = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+	const __m128i one = _mm_set1_epi8(1);
+	uint32 i = 0;
+	for (; i + 2 <= length; i += 2) {
+		__m128i v = _mm_cvtsi32_si128(p[i] | (p[i + 1] << 8));
+		__m128i idx = _mm_min_epu8(_mm_and_si128(_mm_shuffle_epi8(v, spread), bits), one);
+		store_pixels<BPP>(dest + i * 8 * BPP, idx, planes);
+	}
+	expand_1<T>(dest + i * 8 * BPP, p + i, length - i);
+}
+
+template <class T>
+SSSE3 static void expand_2_ssse3(uint8 *dest, const uint8 *p, uint32 length)
+{
+	const int BPP = sizeof(T);
+	__m128i planes[BPP];
+	load_planes<BPP>(planes);
+	const __m128i mask = _mm_set1_epi8(3);
+	uint32 i = 0;
+	for (; i + 4 <= length; i += 4) {
+		uint32 c;
+		memcpy(&c, p + i, 4);
+		__m128i v = _mm_cvtsi32_si128(c);
+		__m128i ab = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 6), mask), _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+		__m128i cd = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 2), mask), _mm_and_si128(v, mask));
+		store_pixels<BPP>(dest + i * 4 * BPP, _mm_unpacklo_epi16(ab, cd), planes);
+	}
+	expand_2<T>(dest + i * 4 * BPP, p + i, length - i);
+}
+
+template <class T>
+SSSE3 static void expand_4_ssse3(uint8 *dest, const uint8 *p, uint32 length)
+{
+	const int BPP = sizeof(T);
+	__m128i planes[BPP];
+	load_planes<BPP>(planes);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	uint32 i = 0;
+	for (; i + 8 <= length; i += 8) {
+		__m128i v = _mm_loadl_epi64((const __m128i *)(p + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i lo = _mm_and_si128(v, mask);
+		store_pixels<BPP>(dest + i * 2 * BPP, _mm_unpacklo_epi8(hi, lo), planes);
+	}
+	expand_4<T>(dest + i * 2 * BPP, p + i, length - i);
+}
+
+SSSE3 static void convert_555_to_555_ssse3(uint8 *dest, const uint8 *p, uint32 length)
+{
+	const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	uint32 i = 0;
+	for (; i + 16 <= length; i += 16)
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i)), swap));
+	convert_555_to_555(dest + i, p + i, length - i);
+}
+
+SSSE3 static void convert_555_to_565_ssse3(uint8 *dest, const uint8 *p, uint32 length)
+{
+	const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	const __m128i rg = _mm_set1_epi16(0x7fe0);
+	const __m128i b = _mm_set1_epi16(0x001f);
+	uint32 i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i)), swap);
+		c = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(c, rg), 1), _mm_and_si128(c, b));
+		_mm_storeu_si128((__m128i *)(dest + i), c);
+	}
+	convert_555_to_565(dest + i, p + i, length - i);
+}
+
+SSSE3 static void convert_8888_to_8888_ssse3(uint8 *dest, const uint8 *p, uint32 length)
+{
+	const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	uint32 i = 0;
+	for (; i + 16 <= length; i += 16)
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i)), swap));
+	convert_8888_to_8888(dest + i, p + i, length - i);
+}
+#endif
+
+
+/*
+ *  Select kernel
+ */
+
+blit_kernel_func FindBlitKernel(int mac_depth, int host_bits_per_pixel, uint32 rmask, uint32 gmask, uint32 bmask,
+	bool native_byte_order, bool vectorized)
+{
+	if (!native_byte_order)
+		return NULL;
+	const bool is_555 = host_bits_per_pixel == 16 && rmask == 0x7c00 && gmask == 0x03e0 && bmask == 0x001f;
+	const bool is_565 = host_bits_per_pixel == 16 && rmask == 0xf800 && gmask == 0x07e0 && bmask == 0x001f;
+	const bool is_8888 = host_bits_per_pixel == 32 && rmask == 0xff0000 && gmask == 0x00ff00 && bmask == 0x0000ff;
+	const bool wide = host_bits_per_pixel == 32;
+	if (host_bits_per_pixel != 16 && host_bits_per_pixel != 32)
+		return NULL;
+
+	if (!vectorized) {
+		switch (mac_depth) {
+		case 1: return wide ? expand_1<uint32> : expand_1<uint16>;
+		case 2: return wide ? expand_2<uint32> : expand_2<uint16>;
+		case 4: return wide ? expand_4<uint32> : expand_4<uint16>;
+		case 16: return is_555 ? convert_555_to_555 : is_565 ? convert_555_to_565 : NULL;
+		case 32: return is_8888 ? convert_8888_to_8888 : NULL;
+		}
+		return NULL;
+	}
+
+#ifdef USE_SIMD_BLITTERS
+	if (cpuinfo_check_ssse3()) {
+		switch (mac_depth) {
+		case 1: return wide ? expand_1_ssse3<uint32> : expand_1_ssse3<uint16>;
+		case 2: return wide ? expand_2_ssse3<uint32> : expand_2_ssse3<uint16>;
+		case 4: return wide ? expand_4_ssse3<uint32> : expand_4_ssse3<uint16>;
+		case 16: return is_555 ? convert_555_to_555_ssse3 : is_565 ? convert_555_to_565_ssse3 : NULL;
+		case 32: return is_8888 ? convert_8888_to_8888_ssse3 : NULL;
+		}
+	}
+#endif
+	return NULL;
+}
@@ -0,0 +1,33 @@
+/*
+ *  video_blit_simd.h - Vectorized frame buffer conversion
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef VIDEO_BLIT_SIMD_H
+#define VIDEO_BLIT_SIMD_H
+
+// Convert length bytes of Mac frame buffer data, same interface as Screen_blit
+typedef void (*blit_kernel_func)(uint8 *dest, const uint8 *source, uint32 length);
+
+// Find kernel converting Mac depth (1..32) to the host pixel format, NULL if there is none.
+// Indexed modes are expanded through ExpandMap. If vectorized is false, the scalar
+// reference implementation is returned.
+extern blit_kernel_func FindBlitKernel(int mac_depth, int host_bits_per_pixel, uint32 rmask, uint32 gmask, uint32 bmask,
+	bool native_byte_order, bool vectorized);
+
+#endif
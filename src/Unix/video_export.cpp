@@ -0,0 +1,457 @@
+/*
+ *  video_export.cpp - Export of the Mac frame buffer in shared memory
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  NOTES:
+ *    The video driver allocates the Mac frame buffer with vm_acquire() as
+ *    usual and then maps the export segment over it, so Mac OS draws right
+ *    into the shared pages and nothing is copied. The segment is a memfd,
+ *    which has no name other processes could open, so it is handed out
+ *    together with the eventfd over a Unix socket that only our user can
+ *    connect to. Clients get a read-only descriptor of the segment, and
+ *    its size is sealed so they can rely on their mapping staying valid.
+ *    It is therefore sized for the largest video mode right away.
+ *
+ *    A forked clone inherits the parent's shared mapping. It moves its
+ *    frame buffer to a new segment before drawing, with the socket path
+ *    of the parent plus ".<pid>".
+ */
+
+#include "sysdeps.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#define ENABLE_FB_EXPORT 1
+#endif
+
+#include "video_export.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+#ifdef ENABLE_FB_EXPORT
+
+// Export segment, eventfd and socket
+static int segment_fd = -1;
+static int client_fd = -1;					// Read-only descriptor of the segment, handed to clients
+static int event_fd = -1;
+static int listen_fd = -1;
+static uint32 segment_size = 0;				// Fixed when the segment is created
+static fb_export_header *header = NULL;
+static char base_path[sizeof(((sockaddr_un *)0)->sun_path)];	// From the prefs
+static char socket_path[sizeof(((sockaddr_un *)0)->sun_path)];	// In use by this process
+
+// Rectangles collected for the next frame
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static fb_export_rect pending[FB_EXPORT_MAX_DIRTY];
+static int num_pending = 0;
+static bool pending_overflow = false;
+
+
+/*
+ *  Create and remove segment
+ */
+
+// Bind socket, replacing a stale one of ours but nothing else
+static bool bind_socket(const char *path)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+			errno = EEXIST;
+			return false;
+		}
+		unlink(path);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		return false;
+	if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+		return false;
+	strcpy(socket_path, path);
+
+	// Nobody can connect before listen()
+	if (chmod(path, 0600) < 0 || listen(listen_fd, 8) < 0)
+		return false;
+	fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+	fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+static bool open_segment(const char *path, uint32 buffer_size)
+{
+	segment_fd = memfd_create("sheepshaver-fb", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (segment_fd < 0)
+		return false;
+	segment_size = FB_EXPORT_HEADER_SIZE + ((buffer_size + FB_EXPORT_HEADER_SIZE - 1) & ~(FB_EXPORT_HEADER_SIZE - 1));
+	if (ftruncate(segment_fd, segment_size) < 0 || fcntl(segment_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+		return false;
+	void *p = mmap(NULL, sizeof(fb_export_header), PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+	header = (fb_export_header *)p;
+	header->magic = FB_EXPORT_MAGIC;
+	header->version = FB_EXPORT_VERSION;
+	header->header_size = FB_EXPORT_HEADER_SIZE;
+	header->buffer_size = segment_size - FB_EXPORT_HEADER_SIZE;
+	header->pid = getpid();
+
+	// Clients must not be able to write, reopen the memfd read-only
+	char fd_path[64];
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", segment_fd);
+	client_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+	if (client_fd < 0)
+		return false;
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0)
+		return false;
+
+	return bind_socket(path);
+}
+
+static void close_segment(bool remove_socket)
+{
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (remove_socket && socket_path[0])
+		unlink(socket_path);
+	socket_path[0] = 0;
+	if (client_fd >= 0) {
+		close(client_fd);
+		client_fd = -1;
+	}
+	if (event_fd >= 0) {
+		close(event_fd);
+		event_fd = -1;
+	}
+	if (header) {
+		munmap(header, sizeof(fb_export_header));
+		header = NULL;
+	}
+	if (segment_fd >= 0) {
+		close(segment_fd);
+		segment_fd = -1;
+	}
+	num_pending = 0;
+	pending_overflow = false;
+}
+
+// Seqlock around header changes, called with export_lock held
+static inline void begin_update(void)
+{
+	header->sequence++;
+	__sync_synchronize();
+}
+
+static inline void end_update(void)
+{
+	__sync_synchronize();
+	header->sequence++;
+}
+
+
+/*
+ *  Initialization
+ */
+
+bool FBExportInit(const char *path, uint32 max_buffer_size)
+{
+	if (strlen(path) >= sizeof(base_path) || !open_segment(path, max_buffer_size)) {
+		fprintf(stderr, "WARNING: Cannot export frame buffer at '%s' (%s)\n", path, strerror(errno));
+		close_segment(socket_path[0] != 0);
+		return false;
+	}
+	strcpy(base_path, path);
+	D(bug("Frame buffer exported at '%s'\n", path));
+	return true;
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+void FBExportExit(void)
+{
+	close_segment(true);
+}
+
+
+/*
+ *  Place frame buffer in segment
+ */
+
+bool FBExportMap(uint8 *buffer, uint32 size)
+{
+	if (header == NULL || size > segment_size - FB_EXPORT_HEADER_SIZE)
+		return false;
+	if (mmap(buffer, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, segment_fd, FB_EXPORT_HEADER_SIZE) == MAP_FAILED)
+		return false;
+	memset(buffer, 0, size);	// Like fresh vm_acquire() memory
+	return true;
+}
+
+bool FBExportCloneChild(uint8 *buffer, uint32 size)
+{
+	if (header == NULL)
+		return false;
+
+	// Everything we inherited belongs to the parent
+	fb_export_header saved;
+	memcpy(&saved, header, sizeof(saved));
+	const uint32 buffer_size = segment_size - FB_EXPORT_HEADER_SIZE;
+	uint8 *contents = (uint8 *)malloc(size);
+	if (contents == NULL)
+		return false;
+	memcpy(contents, buffer, size);
+	close_segment(false);
+
+	char path[sizeof(socket_path)];
+	bool ok = snprintf(path, sizeof(path), "%s.%d", base_path, getpid()) < int(sizeof(path))
+		&& open_segment(path, buffer_size) && FBExportMap(buffer, size);
+	if (ok) {
+		pthread_mutex_lock(&export_lock);
+		begin_update();
+		header->frame = saved.frame;
+		header->width = saved.width;
+		header->height = saved.height;
+		header->row_bytes = saved.row_bytes;
+		header->depth = saved.depth;
+		header->apple_mode = saved.apple_mode;
+		header->num_dirty = 0;
+		memcpy(header->palette, saved.palette, sizeof(header->palette));
+		end_update();
+		pthread_mutex_unlock(&export_lock);
+		printf("Clone frame buffer exported at '%s'\n", path);
+	} else {
+		// Don't draw into the parent's frame buffer in any case
+		fprintf(stderr, "WARNING: Cannot export frame buffer of clone (%s)\n", strerror(errno));
+		close_segment(socket_path[0] != 0);
+		mmap(buffer, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	}
+	memcpy(buffer, contents, size);
+	free(contents);
+	return ok;
+}
+
+
+/*
+ *  Publish frames
+ */
+
+// Called with export_lock held
+static void publish_frame(bool whole_screen)
+{
+	begin_update();
+	if (whole_screen || pending_overflow)
+		header->num_dirty = 0;
+	else {
+		memcpy(header->dirty, pending, num_pending * sizeof(fb_export_rect));
+		header->num_dirty = num_pending;
+	}
+	header->frame++;
+	end_update();
+	num_pending = 0;
+	pending_overflow = false;
+
+	uint64 one = 1;
+	ssize_t actual = write(event_fd, &one, sizeof(one));
+	(void)actual;			// Counter overflow, nobody reads the eventfd
+}
+
+void FBExportSetMode(int width, int height, int row_bytes, int depth, int apple_mode)
+{
+	if (header == NULL)
+		return;
+	pthread_mutex_lock(&export_lock);
+	begin_update();
+	header->width = width;
+	header->height = height;
+	header->row_bytes = row_bytes;
+	header->depth = depth;
+	header->apple_mode = apple_mode;
+	end_update();
+	publish_frame(true);
+	pthread_mutex_unlock(&export_lock);
+}
+
+void FBExportSetPalette(const rgb_color *pal)
+{
+	if (header == NULL)
+		return;
+	pthread_mutex_lock(&export_lock);
+	begin_update();
+	memcpy(header->palette, pal, sizeof(header->palette));
+	end_update();
+	publish_frame(true);
+	pthread_mutex_unlock(&export_lock);
+}
+
+void FBExportAddDirty(int x, int y, int w, int h)
+{
+	if (header == NULL || w <= 0 || h <= 0)
+		return;
+	pthread_mutex_lock(&export_lock);
+	if (num_pending == FB_EXPORT_MAX_DIRTY)
+		pending_overflow = true;
+	else {
+		fb_export_rect &r = pending[num_pending++];
+		r.x = x;
+		r.y = y;
+		r.w = w;
+		r.h = h;
+	}
+	pthread_mutex_unlock(&export_lock);
+}
+
+void FBExportFrame(bool whole_screen)
+{
+	if (header == NULL)
+		return;
+	pthread_mutex_lock(&export_lock);
+	publish_frame(whole_screen);
+	pthread_mutex_unlock(&export_lock);
+	FBExportPoll();
+}
+
+
+/*
+ *  Hand out segment and eventfd to clients
+ */
+
+static void send_fds(int fd)
+{
+	char byte = 'F';
+	iovec iov;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	union {
+		cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = {client_fd, event_fd};
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+		D(bug("Frame buffer export: sendmsg() failed (%s)\n", strerror(errno)));
+}
+
+int FBExportListenFD(void)
+{
+	return listen_fd;
+}
+
+void FBExportPoll(void)
+{
+	if (listen_fd < 0)
+		return;
+	int fd;
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		D(bug("Frame buffer export: new client\n"));
+		send_fds(fd);
+		close(fd);
+	}
+}
+
+#else
+
+bool FBExportInit(const char *path, uint32 max_buffer_size)
+{
+	fprintf(stderr, "WARNING: Frame buffer export is not supported on this system\n");
+	return false;
+}
+
+void FBExportExit(void)
+{
+}
+
+bool FBExportMap(uint8 *buffer, uint32 size)
+{
+	return false;
+}
+
+bool FBExportCloneChild(uint8 *buffer, uint32 size)
+{
+	return false;
+}
+
+void FBExportSetMode(int width, int height, int row_bytes, int depth, int apple_mode)
+{
+}
+
+void FBExportSetPalette(const rgb_color *pal)
+{
+}
+
+void FBExportAddDirty(int x, int y, int w, int h)
+{
+}
+
+void FBExportFrame(bool whole_screen)
+{
+}
+
+int FBExportListenFD(void)
+{
+	return -1;
+}
+
+void FBExportPoll(void)
+{
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ *  video_export.h - Export of the Mac frame buffer in shared memory
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef VIDEO_EXPORT_H
+#define VIDEO_EXPORT_H
+
+/*
+ *  Layout of the shared memory segment, all values in host byte order.
+ *  The header is at offset 0 and the Mac frame buffer, which is what
+ *  Mac OS draws into, at FB_EXPORT_HEADER_SIZE.
+ *
+ *  The header is updated like a seqlock: sequence is odd while it is
+ *  being changed, readers retry if it was odd or changed while they
+ *  read. The frame buffer itself is live and not locked.
+ */
+
+const uint32 FB_EXPORT_MAGIC = 0x53534642;		// "SSFB"
+const uint32 FB_EXPORT_VERSION = 1;
+const uint32 FB_EXPORT_HEADER_SIZE = 0x10000;	// Frame buffer offset, allows mmap() with 64 KB pages
+const int FB_EXPORT_MAX_DIRTY = 64;
+
+struct fb_export_rect {
+	uint16 x, y, w, h;			// In pixels
+};
+
+struct fb_export_header {
+	uint32 magic;				// FB_EXPORT_MAGIC
+	uint32 version;				// FB_EXPORT_VERSION
+	uint32 header_size;			// Offset of the frame buffer in the segment
+	uint32 buffer_size;			// Size of the frame buffer area, never changes
+	volatile uint32 sequence;	// Odd while the header is being updated
+	uint32 pid;					// Process the frame buffer belongs to
+	uint64 frame;				// Number of frames published so far
+	uint32 width, height;		// Current video mode
+	uint32 row_bytes;
+	uint32 depth;				// Bits per pixel (1, 2, 4, 8, 16 or 32)
+	uint32 apple_mode;
+	uint32 num_dirty;			// Rectangles changed in the last frame, 0 = whole screen
+	fb_export_rect dirty[FB_EXPORT_MAX_DIRTY];
+	rgb_color palette[256];		// Colors of the indexed modes
+};
+
+/*
+ *  Clients connect to the Unix socket given in the "fbexport" prefs item.
+ *  They receive one byte and, as SCM_RIGHTS, a read-only file descriptor
+ *  of the segment (a memfd sealed against resizing) and an eventfd that
+ *  is signalled after every frame.
+ */
+
+// Create segment for frame buffers of up to max_buffer_size bytes
+extern bool FBExportInit(const char *path, uint32 max_buffer_size);
+extern void FBExportExit(void);
+
+// Map the segment over a frame buffer allocated with vm_acquire()
+extern bool FBExportMap(uint8 *buffer, uint32 size);
+
+// After fork(), move the frame buffer to a segment of our own
+extern bool FBExportCloneChild(uint8 *buffer, uint32 size);
+
+extern void FBExportSetMode(int width, int height, int row_bytes, int depth, int apple_mode);
+extern void FBExportSetPalette(const rgb_color *pal);
+extern void FBExportAddDirty(int x, int y, int w, int h);
+extern void FBExportFrame(bool whole_screen);	// Publish frame and signal eventfd
+extern int FBExportListenFD(void);				// Socket to wait on for new clients, or -1
+extern void FBExportPoll(void);					// Hand out the segment to new clients
+
+#endif
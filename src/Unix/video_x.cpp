@@ -36,10 +36,19 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <semaphore.h>
 
 #include <algorithm>
+#include <atomic>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
 
 #ifdef ENABLE_FBDEV_DGA
 # include <linux/fb.h>
@@ -58,6 +67,18 @@
 # include <sys/mman.h>
 #endif
 
+#ifdef HAVE_LINUX_USERFAULTFD_H
+# include <linux/userfaultfd.h>
+# include <linux/fs.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+// Frame buffer tracking with asynchronous userfaultfd write protection (Linux 6.7)
+#if defined(ENABLE_VOSF) && defined(HAVE_LINUX_USERFAULTFD_H) && defined(UFFD_FEATURE_WP_ASYNC) && defined(PAGEMAP_SCAN)
+# define ENABLE_UFFD_TRACKING 1
+#endif
+
 #include "main.h"
 #include "adb.h"
 #include "prefs.h"
@@ -66,6 +87,9 @@
 #include "video.h"
 #include "video_defs.h"
 #include "video_blit.h"
+#include "video_blit_simd.h"
+#include "video_export.h"
+#include "stats.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -81,6 +105,8 @@ static const bool hw_mac_cursor_accl = true;	// Flag: Enable MacOS to X11 copy o
 
 // Global variables
 static int32 frame_skip;
+static bool headless = false;				// Flag: no X display, Mac frame buffer only
+static int32 frame_export_counter = 0;		// Exports every frame_skip'th frame in headless mode
 static int16 mouse_wheel_mode;
 static int16 mouse_wheel_lines;
 static bool redraw_thread_active = false;	// Flag: Redraw thread installed
@@ -147,9 +173,28 @@ static Cursor mac_cursor;
 static GC cursor_gc, cursor_mask_gc;
 static bool cursor_changed = false;			// Flag: Cursor changed, window_func must update cursor
 static bool have_shm = false;				// Flag: SHM present and usable
+static int shm_completion_type;				// Event type of XShmCompletionEvent
 static uint8 *the_buffer = NULL;			// Pointer to Mac frame buffer
 static uint8 *the_buffer_copy = NULL;		// Copy of Mac frame buffer
 static uint32 the_buffer_size;				// Size of allocated the_buffer
+static bool export_frame_buffer = false;	// Flag: the_buffer lives in the export segment ("fbexport")
+
+// Tiles compared by update_display(), 64x16 pixels at 32 bit
+const int TILE_BYTES = 256;
+const int TILE_ROWS = 16;
+static uint32 *tile_stamps = NULL;			// Refresh count at which NQD last drew into each tile
+static int tile_columns, tile_lines;		// Size of tile_stamps grid
+static volatile uint32 refresh_count = 0;	// Incremented by update_display()
+
+// Redraw thread wakeup, the thread sleeps until something is written to the pipe
+static int wake_pipe[2] = {-1, -1};
+static std::atomic<bool> wake_pending(false);	// Flag: byte in wake_pipe not consumed yet
+
+// Display refresh statistics
+static uint64 redraw_start_time;
+static uint64 redraw_wakeups = 0;			// Number of times the redraw thread woke up
+static uint64 redraw_refreshes = 0;			// Number of display refreshes
+static uint64 redraw_changes = 0;			// Number of refreshes that found changes
 
 // Variables for DGA mode
 static bool is_fbdev_dga_mode = false;		// Flag: Use FBDev DGA mode?
@@ -488,6 +533,54 @@ static int error_handler(Display *d, XErrorEvent *e)
 		return old_error_handler(d, e);
 }
 
+// Stop exporting, the frame buffer is not in the export segment
+static void export_off(const char *reason)
+{
+	if (!export_frame_buffer)
+		return;
+	fprintf(stderr, "WARNING: %s, frame buffer export disabled\n", reason);
+	FBExportExit();
+	export_frame_buffer = false;
+}
+
+// Allocate Mac frame buffer, in the export segment if there is one
+static uint8 *acquire_frame_buffer(uint32 size)
+{
+	uint8 *buffer = (uint8 *)vm_acquire(size);
+	if (buffer != VM_MAP_FAILED && export_frame_buffer && !FBExportMap(buffer, size))
+		export_off("Cannot place frame buffer in export segment");
+	return buffer;
+}
+
+// Create and attach SHM image ("height + 2" for safety), returns NULL on failure
+static XImage *create_shm_image(XShmSegmentInfo &info, int width, int height)
+{
+	int aligned_height = (height + 15) & ~15;
+	XImage *image = XShmCreateImage(x_display, vis, depth == 1 ? 1 : xdepth, depth == 1 ? XYBitmap : ZPixmap, 0, &info, width, height);
+	if (image == NULL)
+		return NULL;
+	info.shmid = shmget(IPC_PRIVATE, (aligned_height + 2) * image->bytes_per_line, IPC_CREAT | 0777);
+	D(bug(" shm image created\n"));
+	info.shmaddr = image->data = (char *)shmat(info.shmid, 0, 0);
+	info.readOnly = False;
+
+	// Try to attach SHM image, catching errors
+	shm_error = false;
+	old_error_handler = XSetErrorHandler(error_handler);
+	XShmAttach(x_display, &info);
+	XSync(x_display, false);
+	XSetErrorHandler(old_error_handler);
+	if (shm_error) {
+		shmdt(info.shmaddr);
+		XDestroyImage(image);
+		info.shmid = -1;
+		return NULL;
+	}
+	shmctl(info.shmid, IPC_RMID, 0);
+	D(bug(" shm image attached\n"));
+	return image;
+}
+
 // Open window
 static bool open_window(int width, int height)
 {
@@ -539,30 +632,12 @@ static bool open_window(int width, int height)
 	// Try to create and attach SHM image
 	have_shm = false;
 	if (local_X11 && !need_msb_image && XShmQueryExtension(x_display)) {
-
-		// Create SHM image ("height + 2" for safety)
-		img = XShmCreateImage(x_display, vis, depth == 1 ? 1 : xdepth, depth == 1 ? XYBitmap : ZPixmap, 0, &shminfo, width, height);
-		shminfo.shmid = shmget(IPC_PRIVATE, (aligned_height + 2) * img->bytes_per_line, IPC_CREAT | 0777);
-		D(bug(" shm image created\n"));
-		the_buffer_copy = (uint8 *)shmat(shminfo.shmid, 0, 0);
-		shminfo.shmaddr = img->data = (char *)the_buffer_copy;
-		shminfo.readOnly = False;
-
-		// Try to attach SHM image, catching errors
-		shm_error = false;
-		old_error_handler = XSetErrorHandler(error_handler);
-		XShmAttach(x_display, &shminfo);
-		XSync(x_display, false);
-		XSetErrorHandler(old_error_handler);
-		if (shm_error) {
-			shmdt(shminfo.shmaddr);
-			XDestroyImage(img);
-			shminfo.shmid = -1;
-		} else {
+		img = create_shm_image(shminfo, width, height);
+		if (img) {
 			have_shm = true;
-			shmctl(shminfo.shmid, IPC_RMID, 0);
+			the_buffer_copy = (uint8 *)img->data;
+			shm_completion_type = XShmGetEventBase(x_display) + ShmCompletion;
 		}
-		D(bug(" shm image attached\n"));
 	}
 
 	// Create normal X image if SHM doesn't work ("height + 2" for safety)
@@ -584,16 +659,25 @@ static bool open_window(int width, int height)
 	// Allocate memory for frame buffer (SIZE is extended to page-boundary)
 	the_host_buffer = the_buffer_copy;
 	the_buffer_size = page_extend((aligned_height + 2) * img->bytes_per_line);
-	the_buffer = (uint8 *)vm_acquire(the_buffer_size);
+	the_buffer = acquire_frame_buffer(the_buffer_size);
 	the_buffer_copy = (uint8 *)malloc(the_buffer_size);
 	D(bug("the_buffer = %p, the_buffer_copy = %p, the_host_buffer = %p\n", the_buffer, the_buffer_copy, the_host_buffer));
 #else
-	// Allocate memory for frame buffer
+	// Allocate memory for frame buffer, export_init() made sure it isn't exported
 	the_buffer = (uint8 *)malloc((aligned_height + 2) * img->bytes_per_line);
 	D(bug("the_buffer = %p, the_buffer_copy = %p\n", the_buffer, the_buffer_copy));
 #endif
 	screen_base = Host2MacAddr(the_buffer);
 
+	// Tiles drawn by NQD, see video_set_dirty_area()
+	if (!use_vosf) {
+		int line_bytes = depth == 1 ? width >> 3 : width * (VModes[cur_mode].viRowBytes / width);
+		tile_columns = (line_bytes + TILE_BYTES - 1) / TILE_BYTES;
+		tile_lines = (height + TILE_ROWS - 1) / TILE_ROWS;
+		tile_stamps = new uint32[tile_columns * tile_lines];
+		memset(tile_stamps, 0, tile_columns * tile_lines * sizeof(uint32));
+	}
+
 	// Create GC
 	the_gc = XCreateGC(x_display, the_win, 0, 0);
 	XSetState(x_display, the_gc, black_pixel, white_pixel, GXcopy, AllPlanes);
@@ -632,6 +716,11 @@ static bool open_window(int width, int height)
 #endif
 #ifdef ENABLE_VOSF
 	Screen_blitter_init(visualFormat, native_byte_order, depth);
+
+	// Use a vectorized kernel if there is one for this conversion
+	blit_kernel_func kernel = FindBlitKernel(depth, img->bits_per_pixel, visualFormat.Rmask, visualFormat.Gmask, visualFormat.Bmask, native_byte_order, true);
+	if (kernel)
+		Screen_blit = kernel;
 #endif
 
 	// Set bytes per row
@@ -639,6 +728,344 @@ static bool open_window(int width, int height)
 	return true;
 }
 
+
+/*
+ *  Frame buffer tracking with userfaultfd
+ *
+ *  VOSF write-protects the frame buffer with mprotect() and takes a SIGSEGV
+ *  on the first write to each page after every refresh. With asynchronous
+ *  userfaultfd write protection, the kernel resolves these faults itself and
+ *  marks the pages as written. The redraw thread collects them and protects
+ *  them again with one PAGEMAP_SCAN ioctl, so the emulator thread never
+ *  traps on screen writes. Without kernel support, VOSF is used as before.
+ *
+ *  The changed lines are converted by a small pool of threads. With SHM,
+ *  there are two window images: lines are converted into one of them while
+ *  the X server may still be reading the other, and an XShmCompletionEvent
+ *  for each band sent tells when an image can be written again. The VOSF
+ *  refresh (update_display_window_vosf() and update_display_dga_vosf()) is
+ *  still single-threaded and single-buffered.
+ */
+
+#ifdef ENABLE_UFFD_TRACKING
+static int uffd_fd = -1;					// userfaultfd write-protecting the_buffer, -1 = use VOSF
+static int pagemap_fd = -1;					// /proc/self/pagemap for PAGEMAP_SCAN
+static bool uffd_redraw_all = false;		// Flag: redraw the whole window, not only written lines
+
+static XImage *back_img = NULL;				// Second SHM image for double-buffering
+static XShmSegmentInfo back_shminfo;
+static int cur_img = 0;						// Image to convert into next (0 = img, 1 = back_img)
+static int puts_pending[2];					// XShmPutImage() calls of image not completed yet
+
+// Per line: DIRTY_NOW = changed since the last refresh, DIRTY_BEFORE = changed
+// in the refresh before and missing from the image that is converted into next
+const uint8 DIRTY_NOW = 1;
+const uint8 DIRTY_BEFORE = 2;
+static uint8 *dirty_lines = NULL;
+
+// Conversion threads, part 0 of each job is done by the redraw thread
+const int MAX_BLIT_THREADS = 8;
+const int BLIT_THREAD_MIN_BYTES = 64 * 1024;	// Smaller jobs are converted by the redraw thread alone
+static bool blit_threads_started = false;
+static int num_blit_threads = 0;			// Threads besides the redraw thread
+static pthread_t blit_threads[MAX_BLIT_THREADS];
+static sem_t blit_start[MAX_BLIT_THREADS];
+static sem_t blit_done;
+static volatile bool blit_threads_quit = false;
+
+static struct {
+	uint8 *dst;								// Image data
+	int dst_bytes_per_row;
+	uint8 mask;								// Convert lines with these dirty_lines bits
+	int count;								// Number of lines to convert
+	int parts;								// Number of threads working on it
+} blit_job;
+
+// Convert part of the lines described by blit_job
+static void blit_lines(int part)
+{
+	const int src_bytes_per_row = VModes[cur_mode].viRowBytes;
+	const int height = VModes[cur_mode].viYsize;
+	const int first = blit_job.count * part / blit_job.parts;
+	const int last = blit_job.count * (part + 1) / blit_job.parts;
+	int n = 0;
+	for (int y=0; y<height && n<last; y++) {
+		if (dirty_lines[y] & blit_job.mask) {
+			if (n >= first)
+				Screen_blit(blit_job.dst + y * blit_job.dst_bytes_per_row, the_buffer + y * src_bytes_per_row, src_bytes_per_row);
+			n++;
+		}
+	}
+}
+
+static void *blit_func(void *arg)
+{
+	const int part = (intptr)arg;
+	for (;;) {
+		sem_wait(&blit_start[part - 1]);
+		if (blit_threads_quit)
+			break;
+		blit_lines(part);
+		sem_post(&blit_done);
+	}
+	return NULL;
+}
+
+// Start conversion threads, "blitthreads" counts the redraw thread (0 = half the CPUs)
+static void blit_threads_start(void)
+{
+	blit_threads_started = true;
+	int threads = PrefsFindInt32("blitthreads");
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (threads > MAX_BLIT_THREADS + 1)
+		threads = MAX_BLIT_THREADS + 1;
+
+	blit_threads_quit = false;
+	sem_init(&blit_done, 0, 0);
+	for (num_blit_threads = 0; num_blit_threads < threads - 1; num_blit_threads++) {
+		sem_init(&blit_start[num_blit_threads], 0, 0);
+		if (pthread_create(&blit_threads[num_blit_threads], NULL, blit_func, (void *)(intptr)(num_blit_threads + 1)) != 0) {
+			sem_destroy(&blit_start[num_blit_threads]);
+			break;
+		}
+	}
+	D(bug("%d frame buffer conversion threads\n", num_blit_threads + 1));
+}
+
+// Stop conversion threads, must not be called while the redraw thread is converting
+static void blit_threads_stop(void)
+{
+	if (!blit_threads_started)
+		return;
+	blit_threads_quit = true;
+	for (int i=0; i<num_blit_threads; i++)
+		sem_post(&blit_start[i]);
+	for (int i=0; i<num_blit_threads; i++) {
+		pthread_join(blit_threads[i], NULL);
+		sem_destroy(&blit_start[i]);
+	}
+	sem_destroy(&blit_done);
+	num_blit_threads = 0;
+	blit_threads_started = false;
+}
+
+// Convert lines with any of the mask bits set into image data
+static void blit_dirty_lines(uint8 *dst, int dst_bytes_per_row, uint8 mask)
+{
+	const int height = VModes[cur_mode].viYsize;
+	int count = 0;
+	for (int y=0; y<height; y++) {
+		if (dirty_lines[y] & mask)
+			count++;
+	}
+	if (count == 0)
+		return;
+
+	if (!blit_threads_started)
+		blit_threads_start();
+	blit_job.dst = dst;
+	blit_job.dst_bytes_per_row = dst_bytes_per_row;
+	blit_job.mask = mask;
+	blit_job.count = count;
+	blit_job.parts = 1;
+	if (count * VModes[cur_mode].viRowBytes >= BLIT_THREAD_MIN_BYTES)
+		blit_job.parts += num_blit_threads;
+	for (int i=1; i<blit_job.parts; i++)
+		sem_post(&blit_start[i - 1]);
+	blit_lines(0);
+	for (int i=1; i<blit_job.parts; i++)
+		sem_wait(&blit_done);
+}
+
+// Handle XShmCompletionEvent
+static void shm_put_done(XEvent *event)
+{
+	ShmSeg seg = ((XShmCompletionEvent *)event)->shmseg;
+	if (seg == shminfo.shmseg && puts_pending[0] > 0)
+		puts_pending[0]--;
+	else if (back_img && seg == back_shminfo.shmseg && puts_pending[1] > 0)
+		puts_pending[1]--;
+}
+
+static Bool is_shm_completion(Display *d, XEvent *event, XPointer arg)
+{
+	return event->type == shm_completion_type;
+}
+
+// Wait until the X server has read image i
+static void wait_put_done(int i)
+{
+	while (puts_pending[i] > 0) {
+		XEvent event;
+		XIfEvent(x_display, &event, is_shm_completion, NULL);
+		shm_put_done(&event);
+	}
+}
+
+// Drop second SHM image, the X server is only told if the connection is ours
+static void free_back_image(bool detach)
+{
+	if (back_img == NULL)
+		return;
+	if (detach)
+		XShmDetach(x_display, &back_shminfo);
+	XDestroyImage(back_img);
+	shmdt(back_shminfo.shmaddr);
+	back_img = NULL;
+}
+
+static void uffd_tracking_exit(void)
+{
+	if (uffd_fd >= 0) {
+		close(uffd_fd);
+		uffd_fd = -1;
+	}
+	if (pagemap_fd >= 0) {
+		close(pagemap_fd);
+		pagemap_fd = -1;
+	}
+	free_back_image(true);
+	delete[] dirty_lines;
+	dirty_lines = NULL;
+}
+
+static bool uffd_tracking_init(void)
+{
+	uffd_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (uffd_fd < 0 || pagemap_fd < 0) {
+		D(bug("userfaultfd tracking not available (%s)\n", strerror(errno)));
+		uffd_tracking_exit();
+		return false;
+	}
+
+	struct uffdio_api api;
+	memset(&api, 0, sizeof(api));
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED;
+	if (export_frame_buffer)
+		api.features |= UFFD_FEATURE_WP_HUGETLBFS_SHMEM;	// Frame buffer is a shared memfd mapping
+	struct uffdio_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.range.start = (uintptr)the_buffer;
+	reg.range.len = the_buffer_size;
+	reg.mode = UFFDIO_REGISTER_MODE_WP;
+	struct uffdio_writeprotect wp;
+	memset(&wp, 0, sizeof(wp));
+	wp.range = reg.range;
+	wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+	if (ioctl(uffd_fd, UFFDIO_API, &api) < 0 || ioctl(uffd_fd, UFFDIO_REGISTER, &reg) < 0 || ioctl(uffd_fd, UFFDIO_WRITEPROTECT, &wp) < 0) {
+		D(bug("userfaultfd tracking not available (%s)\n", strerror(errno)));
+		uffd_tracking_exit();
+		return false;
+	}
+
+	// Drop the VOSF protection, the kernel keeps write-protected pages read-only
+	vm_protect(the_buffer, the_buffer_size, VM_PAGE_READ | VM_PAGE_WRITE);
+	D(bug("Using userfaultfd for frame buffer tracking\n"));
+
+	// Single-buffered if there's no SHM
+	dirty_lines = new uint8[VModes[cur_mode].viYsize];
+	memset(dirty_lines, 0, VModes[cur_mode].viYsize);
+	if (have_shm)
+		back_img = create_shm_image(back_shminfo, VModes[cur_mode].viXsize, VModes[cur_mode].viYsize);
+	cur_img = 0;
+	puts_pending[0] = puts_pending[1] = 0;
+	uffd_redraw_all = true;
+	return true;
+}
+
+// Redraw written parts of the window, called with the VOSF lock held.
+// Returns true if anything changed.
+static bool update_display_window_uffd(void)
+{
+	const int bytes_per_row = VModes[cur_mode].viRowBytes;
+	const int height = VModes[cur_mode].viYsize;
+	bool redraw_all = uffd_redraw_all;
+	uffd_redraw_all = false;
+
+	XEvent event;
+	while (XCheckTypedEvent(x_display, shm_completion_type, &event))
+		shm_put_done(&event);
+
+	// Collect written pages and write-protect them again in one go, writes
+	// after this are seen by the next scan
+	const int MAX_REGIONS = 32;
+	page_region regions[MAX_REGIONS];
+	pm_scan_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.size = sizeof(arg);
+	arg.flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC;
+	arg.start = (uintptr)the_buffer;
+	arg.end = (uintptr)the_buffer + the_buffer_size;
+	arg.vec = (uintptr)regions;
+	arg.vec_len = MAX_REGIONS;
+	arg.category_mask = PAGE_IS_WRITTEN;
+	arg.return_mask = PAGE_IS_WRITTEN;
+
+	bool changed = false;
+	while (arg.start < arg.end) {
+		int n = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg);
+		if (n < 0) {
+			redraw_all = true;
+			break;
+		}
+		for (int i=0; i<n; i++) {
+			int top = (regions[i].start - (uintptr)the_buffer) / bytes_per_row;
+			int bottom = (regions[i].end - (uintptr)the_buffer + bytes_per_row - 1) / bytes_per_row;
+			if (bottom > height)
+				bottom = height;
+			for (int y=top; y<bottom; y++)
+				dirty_lines[y] |= DIRTY_NOW;
+			if (top < bottom)
+				changed = true;
+		}
+		arg.start = arg.walk_end;
+	}
+	if (redraw_all) {
+		for (int y=0; y<height; y++)
+			dirty_lines[y] |= DIRTY_NOW;
+		changed = true;
+	}
+	if (!changed)
+		return false;
+
+	// Convert into the image the X server is done with, catching up with the
+	// lines that went into the other image last time
+	XImage *image = cur_img ? back_img : img;
+	wait_put_done(cur_img);
+	blit_dirty_lines((uint8 *)image->data, image->bytes_per_line, back_img ? DIRTY_NOW | DIRTY_BEFORE : DIRTY_NOW);
+
+	// Send bands of changed lines
+	const int width = VModes[cur_mode].viXsize;
+	for (int y=0; y<height; ) {
+		if (!(dirty_lines[y] & DIRTY_NOW)) {
+			y++;
+			continue;
+		}
+		int y1 = y;
+		while (y < height && (dirty_lines[y] & DIRTY_NOW))
+			y++;
+		if (export_frame_buffer)
+			FBExportAddDirty(0, y1, width, y - y1);
+		if (have_shm) {
+			XShmPutImage(x_display, the_win, the_gc, image, 0, y1, 0, y1, width, y - y1, True);
+			puts_pending[cur_img]++;
+		} else
+			XPutImage(x_display, the_win, the_gc, image, 0, y1, 0, y1, width, y - y1);
+	}
+	XFlush(x_display);
+
+	for (int y=0; y<height; y++)
+		dirty_lines[y] = (dirty_lines[y] & DIRTY_NOW) ? DIRTY_BEFORE : 0;
+	if (back_img)
+		cur_img ^= 1;
+	return true;
+}
+#endif
+
+
 // Open FBDev DGA display
 static bool open_fbdev_dga(int width, int height)
 {
@@ -771,7 +1198,7 @@ static bool open_fbdev_dga(int width, int height)
 	the_host_buffer = the_buffer;
 	the_buffer_size = page_extend((height + 2) * bytes_per_row);
 	the_buffer_copy = (uint8 *)malloc(the_buffer_size);
-	the_buffer = (uint8 *)vm_acquire(the_buffer_size);
+	the_buffer = acquire_frame_buffer(the_buffer_size);
 	D(bug("the_buffer = %p, the_buffer_copy = %p, the_host_buffer = %p\n", the_buffer, the_buffer_copy, the_host_buffer));
 #endif
 
@@ -862,13 +1289,15 @@ static bool open_xf86_dga(int width, int height)
 	  the_host_buffer = the_buffer;
 	  the_buffer_size = page_extend((height + 2) * bytes_per_row);
 	  the_buffer_copy = (uint8 *)malloc(the_buffer_size);
-	  the_buffer = (uint8 *)vm_acquire(the_buffer_size);
+	  the_buffer = acquire_frame_buffer(the_buffer_size);
 	  D(bug("the_buffer = %p, the_buffer_copy = %p, the_host_buffer = %p\n", the_buffer, the_buffer_copy, the_host_buffer));
 	}
 #else
 	use_vosf = false;
 #endif
 #endif
+	if (!use_vosf)
+		export_off("Mac OS draws to the screen directly");
 
 	// Set frame buffer base
 	D(bug("the_buffer = %p, use_vosf = %d\n", the_buffer, use_vosf));
@@ -910,11 +1339,36 @@ static bool open_dga(int width, int height)
 	return display_open;
 }
 
+// Allocate frame buffer for headless mode, nothing is ever drawn on the host
+static bool open_headless(void)
+{
+	const VideoInfo &mode = VModes[cur_mode];
+	display_type = mode.viType;
+	depth = depth_of_video_mode(mode.viAppleMode);
+#ifdef ENABLE_VOSF
+	use_vosf = false;
+#endif
+	the_buffer_size = (mode.viYsize + 2) * mode.viRowBytes;
+	the_buffer = acquire_frame_buffer(the_buffer_size);
+	if (the_buffer == VM_MAP_FAILED) {
+		the_buffer = NULL;
+		return false;
+	}
+	screen_base = Host2MacAddr(the_buffer);
+	D(bug("headless the_buffer = %p\n", the_buffer));
+	if (export_frame_buffer)
+		FBExportSetMode(mode.viXsize, mode.viYsize, mode.viRowBytes, depth, mode.viAppleMode);
+	return true;
+}
+
 static bool open_display(void)
 {
 	D(bug("open_display()\n"));
 	const VideoInfo &mode = VModes[cur_mode];
 
+	if (headless)
+		return open_headless();
+
 	// Get original mouse acceleration
 	XGetPointerControl(x_display, &orig_accel_numer, &orig_accel_denom, &orig_threshold);
 
@@ -1029,6 +1483,18 @@ static bool open_display(void)
 		memset(the_buffer, 0, VModes[cur_mode].viRowBytes * VModes[cur_mode].viYsize);
 		memset(the_buffer_copy, 0, VModes[cur_mode].viRowBytes * VModes[cur_mode].viYsize);
 	}
+
+#ifdef ENABLE_UFFD_TRACKING
+	// Track frame buffer writes without SIGSEGV if the kernel supports it
+	if (display_open && use_vosf && display_type == DIS_WINDOW) {
+		LOCK_VOSF;
+		uffd_tracking_init();
+		UNLOCK_VOSF;
+	}
+#endif
+
+	if (display_open && export_frame_buffer)
+		FBExportSetMode(VModes[cur_mode].viXsize, VModes[cur_mode].viYsize, VModes[cur_mode].viRowBytes, depth, VModes[cur_mode].viAppleMode);
 	return display_open;
 }
 
@@ -1059,6 +1525,10 @@ static void close_window(void)
 	}
 	if (the_gc)
 		XFreeGC(x_display, the_gc);
+	if (tile_stamps) {
+		delete[] tile_stamps;
+		tile_stamps = NULL;
+	}
 
 	XFlush(x_display);
 	XSync(x_display, false);
@@ -1121,6 +1591,13 @@ static void close_dga(void)
 
 static void close_display(void)
 {
+	if (headless) {
+		if (the_buffer)
+			vm_release(the_buffer, the_buffer_size);
+		the_buffer = NULL;
+		return;
+	}
+
 	if (display_type == DIS_SCREEN)
 		close_dga();
 	else if (display_type == DIS_WINDOW)
@@ -1143,6 +1620,9 @@ static void close_display(void)
 		cmap[1] = 0;
 	}
 
+#ifdef ENABLE_UFFD_TRACKING
+	uffd_tracking_exit();
+#endif
 #ifdef ENABLE_VOSF
 	if (use_vosf) {
 		// Deinitialize VOSF
@@ -1183,6 +1663,73 @@ static void close_display(void)
 }
 
 
+/*
+ *  Redraw thread wakeup
+ *
+ *  The redraw thread sleeps until the display is damaged (NQD drawing, VOSF
+ *  fault, palette or cursor change) or its idle timer expires. Damage is
+ *  reported through a pipe because the VOSF fault handler runs in a signal
+ *  handler.
+ */
+
+static bool wake_pipe_open(void)
+{
+	if (pipe(wake_pipe) < 0) {
+		wake_pipe[0] = wake_pipe[1] = -1;
+		return false;
+	}
+	for (int i=0; i<2; i++) {
+		fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	wake_pending = false;
+	return true;
+}
+
+static void wake_pipe_close(void)
+{
+	for (int i=0; i<2; i++) {
+		if (wake_pipe[i] >= 0) {
+			close(wake_pipe[i]);
+			wake_pipe[i] = -1;
+		}
+	}
+}
+
+// Wake redraw thread, async-signal safe
+static void wake_redraw_thread(void)
+{
+	if (wake_pipe[1] < 0 || wake_pending.exchange(true))
+		return;
+	int saved_errno = errno;
+	ssize_t actual = write(wake_pipe[1], "", 1);
+	(void)actual;			// Pipe full means a wakeup is pending anyway
+	errno = saved_errno;
+}
+
+// Consume wakeups, returns true if there were any
+static bool wake_pipe_drain(void)
+{
+	// Clear the flag first, damage reported while draining writes a new byte
+	wake_pending = false;
+	bool woken = false;
+	char buf[16];
+	while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+		woken = true;
+	return woken;
+}
+
+static void redraw_stats_print(FILE *f)
+{
+	double seconds = (GetTicks_usec() - redraw_start_time) / 1000000.0;
+	if (seconds <= 0)
+		seconds = 1;
+	fprintf(f, "  Wakeups: %llu (%.1f/s)\n", (unsigned long long)redraw_wakeups, redraw_wakeups / seconds);
+	fprintf(f, "  Refreshes: %llu (%.1f/s)\n", (unsigned long long)redraw_refreshes, redraw_refreshes / seconds);
+	fprintf(f, "  Refreshes with changes: %llu\n", (unsigned long long)redraw_changes);
+}
+
+
 /*
  *  Initialization
  */
@@ -1362,6 +1909,59 @@ static bool has_mode(int x, int y)
 	return DisplayWidth(x_display, screen) >= x && DisplayHeight(x_display, screen) >= y;
 }
 
+// Export frame buffer in shared memory if requested ("fbexport" prefs item).
+// Clients rely on the size of the segment, so it is made big enough for
+// the frame buffer of every mode in VModes.
+static void export_init(void)
+{
+	const char *path = PrefsFindString("fbexport");
+	if (path == NULL)
+		return;
+#ifndef ENABLE_VOSF
+	// The window frame buffer is allocated with malloc(), it can't be moved into the segment
+	if (!headless) {
+		fprintf(stderr, "WARNING: Frame buffer export needs VOSF or the headless video driver, ignored\n");
+		return;
+	}
+#endif
+	uint32 max_size = 0;
+	for (VideoInfo *p = VModes; p->viType != DIS_INVALID; p++) {
+		uint32 width = (p->viXsize + 15) & ~15;		// See open_window()
+		uint32 height = (p->viYsize + 15) & ~15;
+		max_size = std::max(max_size, (height + 2) * std::max(p->viRowBytes, width * 4));
+	}
+	export_frame_buffer = FBExportInit(path, max_size);
+}
+
+// Headless mode: all depths at one size, the frame buffer is never converted
+static bool headless_init(const char *mode_str)
+{
+	headless = true;
+	int width = 640, height = 480;
+	if (sscanf(mode_str, "headless/%d/%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+		width = 640;
+		height = 480;
+	}
+
+	VideoInfo *p = VModes;
+	for (unsigned int d = APPLE_1_BIT; d <= APPLE_32_BIT; d++)
+		add_custom_mode(p, DIS_WINDOW, width, height, d, APPLE_CUSTOM);
+	p->viType = DIS_INVALID;	// End marker
+	p->viRowBytes = 0;
+	p->viXsize = p->viYsize = 0;
+	p->viAppleMode = 0;
+	p->viAppleID = 0;
+	cur_mode = find_mode(APPLE_32_BIT, APPLE_CUSTOM, DIS_WINDOW);
+
+	export_init();
+	if (!open_display()) {
+		ErrorAlert(GetString(STR_OPEN_WINDOW_ERR));
+		return false;
+	}
+	LOCK_FRAME_BUFFER;
+	return true;
+}
+
 bool VideoInit(void)
 {
 #ifdef ENABLE_VOSF
@@ -1369,6 +1969,20 @@ bool VideoInit(void)
 	mainBuffer.dirtyPages = NULL;
 	mainBuffer.pageInfo = NULL;
 #endif
+
+	// Read frame skip prefs
+	frame_skip = PrefsFindInt32("frameskip");
+	if (frame_skip == 0)
+		frame_skip = 1;
+
+	// Init variables
+	private_data = NULL;
+	video_activated = true;
+
+	// No X display needed in headless mode
+	const char *screen_str = PrefsFindString("screen");
+	if (screen_str && strncmp(screen_str, "headless", 8) == 0)
+		return headless_init(screen_str);
 	
 	// Check if X server runs on local machine
 	local_X11 = (strncmp(XDisplayName(x_display_name), ":", 1) == 0)
@@ -1378,19 +1992,10 @@ bool VideoInit(void)
 	// Init keycode translation
 	keycode_init();
 
-	// Read frame skip prefs
-	frame_skip = PrefsFindInt32("frameskip");
-	if (frame_skip == 0)
-		frame_skip = 1;
-
 	// Read mouse wheel prefs
 	mouse_wheel_mode = PrefsFindInt32("mousewheelmode");
 	mouse_wheel_lines = PrefsFindInt32("mousewheellines");
 
-	// Init variables
-	private_data = NULL;
-	video_activated = true;
-
 	// Find screen and root window
 	screen = XDefaultScreen(x_display);
 	rootwin = XRootWindow(x_display, screen);
@@ -1648,6 +2253,7 @@ bool VideoInit(void)
 #endif
 
 	// Open window/screen
+	export_init();
 	if (!open_display()) {
 		ErrorAlert(GetString(STR_OPEN_WINDOW_ERR));
 		return false;
@@ -1669,6 +2275,10 @@ bool VideoInit(void)
 	if (sem_init(&thread_resume_req, 0, 0) < 0)
 		return false;
 	Set_pthread_attr(&redraw_thread_attr, 0);
+	if (wake_pipe_open())
+		video_damage_hook = wake_redraw_thread;
+	redraw_start_time = GetTicks_usec();
+	StatsRegister("display refresh", redraw_stats_print);
 	redraw_thread_cancel = false;
 	redraw_thread_active = (pthread_create(&redraw_thread, &redraw_thread_attr, redraw_func, NULL) == 0);
 	D(bug("Redraw thread installed (%ld)\n", redraw_thread));
@@ -1691,10 +2301,16 @@ void VideoExit(void)
 		sem_destroy(&thread_resume_req);
 		redraw_thread_active = false;
 	}
+	video_damage_hook = NULL;
+	wake_pipe_close();
+#ifdef ENABLE_UFFD_TRACKING
+	blit_threads_stop();
+#endif
 
 	// Unlock frame buffer
 	UNLOCK_FRAME_BUFFER;
-	XSync(x_display, false);
+	if (x_display)
+		XSync(x_display, false);
 	D(bug(" frame buffer unlocked\n"));
 
 #ifdef ENABLE_VOSF
@@ -1705,7 +2321,9 @@ void VideoExit(void)
 #endif
 
 	// Close window and server connection
-	if (x_display != NULL) {
+	if (headless)
+		close_display();
+	else if (x_display != NULL) {
 		XSync(x_display, false);
 		close_display();
 		XFlush(x_display);
@@ -1719,6 +2337,12 @@ void VideoExit(void)
 		fb_dev_fd = -1;
 	}
 #endif
+
+	// Remove frame buffer export
+	if (export_frame_buffer) {
+		FBExportExit();
+		export_frame_buffer = false;
+	}
 }
 
 
@@ -1822,6 +2446,124 @@ static void resume_emul(void)
 }
 
 
+/*
+ *  Support for forked clones (see main_unix.cpp)
+ */
+
+// Stop redraw thread, fork() only keeps the calling thread
+bool VideoCloneBegin(void)
+{
+	if (display_type != DIS_WINDOW)
+		return false;
+	if (redraw_thread_active) {
+		redraw_thread_cancel = true;
+		wake_redraw_thread();
+		pthread_join(redraw_thread, NULL);
+		redraw_thread_active = false;
+	}
+#ifdef ENABLE_UFFD_TRACKING
+	blit_threads_stop();		// Restarted on demand after fork()
+#endif
+	if (x_display)
+		XSync(x_display, false);
+	return true;
+}
+
+// The X connection and the window belong to the parent, a clone opens
+// its own window and shows the inherited Mac frame buffer in it
+static bool clone_open_window(void)
+{
+	close(ConnectionNumber(x_display));
+	x_display = XOpenDisplay(x_display_name);
+	if (x_display == NULL)
+		return false;
+
+	// Drop the host side buffers, the SHM image is shared with the parent
+	if (have_shm)
+		shmdt(shminfo.shmaddr);
+#ifdef ENABLE_VOSF
+	else
+		free(the_host_buffer);
+	the_host_buffer = NULL;
+	free(the_buffer_copy);
+#else
+	else
+		free(the_buffer_copy);
+#endif
+	the_buffer_copy = NULL;
+	img->data = NULL;
+	XDestroyImage(img);
+	img = NULL;
+	delete[] tile_stamps;
+	tile_stamps = NULL;
+
+	// Colormaps are resources of the parent's connection
+	int alloc = (color_class == PseudoColor || color_class == DirectColor) ? AllocAll : AllocNone;
+	cmap[0] = XCreateColormap(x_display, rootwin, vis, alloc);
+	cmap[1] = XCreateColormap(x_display, rootwin, vis, alloc);
+
+	// Keep the Mac frame buffer, Mac OS knows its address. The one
+	// open_window() allocates is thrown away, so don't export it.
+	uint8 *mac_buffer = the_buffer;
+	const bool exported = export_frame_buffer;
+	export_frame_buffer = false;
+	bool ok = open_window(VModes[cur_mode].viXsize, VModes[cur_mode].viYsize);
+	export_frame_buffer = exported;
+	if (!ok)
+		return false;
+#ifdef ENABLE_VOSF
+	vm_release(the_buffer, the_buffer_size);
+#else
+	free(the_buffer);
+#endif
+	the_buffer = mac_buffer;
+	screen_base = Host2MacAddr(the_buffer);
+
+	// Redraw everything
+#ifdef ENABLE_VOSF
+	LOCK_VOSF;
+#ifdef ENABLE_UFFD_TRACKING
+	// The inherited userfaultfd doesn't cover our copy of the frame buffer
+	if (uffd_fd >= 0) {
+		free_back_image(false);
+		uffd_tracking_exit();
+		if (!uffd_tracking_init())
+			vm_protect(the_buffer, the_buffer_size, VM_PAGE_READ);
+	}
+#endif
+	PFLAG_SET_ALL;
+	memset(the_buffer_copy, 0, VModes[cur_mode].viRowBytes * VModes[cur_mode].viYsize);
+	UNLOCK_VOSF;
+#else
+	memset(the_buffer_copy, 0, VModes[cur_mode].viRowBytes * VModes[cur_mode].viYsize);
+#endif
+	palette_changed = true;
+	cursor_changed = true;
+	return true;
+}
+
+// Restart redraw thread in parent and clone
+bool VideoCloneEnd(bool child)
+{
+	// The exported frame buffer is shared with the parent, not copy-on-write
+	if (child && export_frame_buffer && !FBExportCloneChild(the_buffer, the_buffer_size))
+		export_frame_buffer = false;
+	if (headless)
+		return true;
+	if (child && !clone_open_window())
+		return false;
+	if (child) {
+		// The inherited pipe is shared with the parent
+		wake_pipe_close();
+		if (!wake_pipe_open())
+			video_damage_hook = NULL;
+	}
+	redraw_thread_cancel = false;
+	redraw_thread_active = (pthread_create(&redraw_thread, &redraw_thread_attr, redraw_func, NULL) == 0);
+	return true;
+}
+
+
 /*
  *  Close screen in full-screen mode
  */
@@ -1831,6 +2573,7 @@ void VideoQuitFullScreen(void)
 	D(bug("VideoQuitFullScreen()\n"));
 	if (display_type == DIS_SCREEN) {
 		quit_full_screen = true;
+		wake_redraw_thread();
 		while (!quit_full_screen_ack) ;
 	}
 }
@@ -2115,12 +2858,17 @@ static void handle_events(void)
 				if (use_vosf) {			// VOSF refresh
 					LOCK_VOSF;
 					PFLAG_SET_ALL;
+					mainBuffer.dirty = true;
+#ifdef ENABLE_UFFD_TRACKING
+					uffd_redraw_all = true;
+#endif
 					memset(the_buffer_copy, 0, VModes[cur_mode].viRowBytes * VModes[cur_mode].viYsize);
 					UNLOCK_VOSF;
 				}
 				else
 #endif
 					memset(the_buffer_copy, 0, VModes[cur_mode].viRowBytes * VModes[cur_mode].viYsize);
+				video_set_dirty_area(0, 0, VModes[cur_mode].viXsize, VModes[cur_mode].viYsize);
 				break;
 		}
 	}
@@ -2144,6 +2892,12 @@ void VideoVBL(void)
 	// Execute video VBL
 	if (private_data != NULL && private_data->interruptsEnabled)
 		VSLDoInterruptService(private_data->vslServiceID);
+
+	// Export frame in headless mode, where writes aren't tracked
+	if (headless && export_frame_buffer && ++frame_export_counter >= frame_skip) {
+		frame_export_counter = 0;
+		FBExportFrame(true);
+	}
 }
 
 
@@ -2166,9 +2920,12 @@ int16 video_mode_change(VidLocals *csSave, uint32 ParamPtr)
 			csSave->savePage = ReadMacInt16(ParamPtr + csPage);
 
 			// Disable interrupts and pause redraw thread
-			thread_stop_req = true;
-			sem_wait(&thread_stop_ack);
-			thread_stop_req = false;
+			if (redraw_thread_active) {
+				thread_stop_req = true;
+				wake_redraw_thread();
+				sem_wait(&thread_stop_ack);
+				thread_stop_req = false;
+			}
 			DisableInterrupt();
 
 			/* close old display */
@@ -2191,7 +2948,8 @@ int16 video_mode_change(VidLocals *csSave, uint32 ParamPtr)
 
 			// Enable interrupts and resume redraw thread
 			EnableInterrupt();
-			sem_post(&thread_resume_req);
+			if (redraw_thread_active)
+				sem_post(&thread_resume_req);
 			return noErr;
 		}
 	}
@@ -2205,6 +2963,13 @@ int16 video_mode_change(VidLocals *csSave, uint32 ParamPtr)
 
 void video_set_palette(void)
 {
+	if (export_frame_buffer)
+		FBExportSetPalette(mac_pal);
+
+	// No host colors in headless mode, mac_pal is all there is
+	if (headless)
+		return;
+
 	LOCK_PALETTE;
 
 	// Convert colors to XColor array
@@ -2239,12 +3004,16 @@ void video_set_palette(void)
 		PFLAG_SET_ALL;
 		if (display_type == DIS_SCREEN)
 			PFLAG_SET_VERY_DIRTY;
+#ifdef ENABLE_UFFD_TRACKING
+		uffd_redraw_all = true;
+#endif
 		UNLOCK_VOSF;
 	}
 #endif
 
 	// Tell redraw thread to change palette
 	palette_changed = true;
+	wake_redraw_thread();
 
 	UNLOCK_PALETTE;
 }
@@ -2267,6 +3036,7 @@ bool video_can_change_cursor(void)
 void video_set_cursor(void)
 {
 	cursor_changed = true;
+	wake_redraw_thread();
 }
 
 
@@ -2274,127 +3044,175 @@ void video_set_cursor(void)
  *  Thread for window refresh, event handling and other periodic actions
  */
 
-static void update_display(void)
+const int MAX_DIRTY_RECTS = 32;
+const int FULL_COMPARE_INTERVAL = 8;		// Compare all tiles every n-th refresh to catch writes outside of NQD
+
+const int VIDEO_REFRESH_HZ = 60;
+const int VIDEO_REFRESH_DELAY = 1000000 / VIDEO_REFRESH_HZ;
+
+struct dirty_rect {
+	int x1, x2;		// Byte offsets in row, x2 exclusive
+	int y1, y2;		// Rows, y2 exclusive
+};
+
+// Check whether n bytes differ
+static inline bool bytes_differ(const uint8 *p, const uint8 *p2, int n)
 {
-	// Incremental update code
-	int wide = 0, high = 0, x1, x2, y1, y2, i, j;
-	int bytes_per_row = VModes[cur_mode].viRowBytes;
-	int bytes_per_pixel = VModes[cur_mode].viRowBytes / VModes[cur_mode].viXsize;
-	uint8 *p, *p2;
+	int i = 0;
+#ifdef __AVX2__
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p2 + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != -1)
+			return true;
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(p2 + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+			return true;
+	}
+#endif
+	return i < n && memcmp(p + i, p2 + i, n - i) != 0;
+}
 
-	// Check for first line from top and first line from bottom that have changed
-	y1 = 0;
-	for (j=0; j<VModes[cur_mode].viYsize; j++) {
-		if (memcmp(&the_buffer[j * bytes_per_row], &the_buffer_copy[j * bytes_per_row], bytes_per_row)) {
-			y1 = j;
-			break;
-		}
+static bool tile_differs(const uint8 *p, const uint8 *p2, int bytes, int rows, int bytes_per_row)
+{
+	for (int i=0; i<rows; i++) {
+		if (bytes_differ(p, p2, bytes))
+			return true;
+		p += bytes_per_row;
+		p2 += bytes_per_row;
 	}
-	y2 = y1 - 1;
-	for (j=VModes[cur_mode].viYsize-1; j>=y1; j--) {
-		if (memcmp(&the_buffer[j * bytes_per_row], &the_buffer_copy[j * bytes_per_row], bytes_per_row)) {
-			y2 = j;
-			break;
+	return false;
+}
+
+// Add run of dirty tiles, extending the rectangle above it if it spans the same columns
+static bool add_dirty_rect(dirty_rect *rects, int &num_rects, int x1, int x2, int y1, int y2)
+{
+	for (int i=num_rects-1; i>=0 && rects[i].y2>=y1; i--) {
+		if (rects[i].y2 == y1 && rects[i].x1 == x1 && rects[i].x2 == x2) {
+			rects[i].y2 = y2;
+			return true;
 		}
 	}
-	high = y2 - y1 + 1;
-
-	// Check for first column from left and first column from right that have changed
-	if (high) {
-		if (depth == 1) {
-			x1 = VModes[cur_mode].viXsize;
-			for (j=y1; j<=y2; j++) {
-				p = &the_buffer[j * bytes_per_row];
-				p2 = &the_buffer_copy[j * bytes_per_row];
-				for (i=0; i<(x1>>3); i++) {
-					if (*p != *p2) {
-						x1 = i << 3;
-						break;
-					}
-					p++;
-					p2++;
-				}
-			}
-			x2 = x1;
-			for (j=y1; j<=y2; j++) {
-				p = &the_buffer[j * bytes_per_row];
-				p2 = &the_buffer_copy[j * bytes_per_row];
-				p += bytes_per_row;
-				p2 += bytes_per_row;
-				for (i=(VModes[cur_mode].viXsize>>3); i>(x2>>3); i--) {
-					p--;
-					p2--;
-					if (*p != *p2) {
-						x2 = i << 3;
-						break;
-					}
-				}
-			}
-			wide = x2 - x1;
+	if (num_rects == MAX_DIRTY_RECTS)
+		return false;
+	dirty_rect &r = rects[num_rects++];
+	r.x1 = x1;
+	r.x2 = x2;
+	r.y1 = y1;
+	r.y2 = y2;
+	return true;
+}
 
-			// Update copy of the_buffer
-			if (high && wide) {
-				for (j=y1; j<=y2; j++) {
-					i = j * bytes_per_row + (x1 >> 3);
-					memcpy(&the_buffer_copy[i], &the_buffer[i], wide >> 3);
-				}
-			}
+static int direct_write_refreshes = 0;		// Remaining refreshes that compare all tiles
 
-		} else {
-			x1 = VModes[cur_mode].viXsize;
-			for (j=y1; j<=y2; j++) {
-				p = &the_buffer[j * bytes_per_row];
-				p2 = &the_buffer_copy[j * bytes_per_row];
-				for (i=0; i<x1; i++) {
-					if (memcmp(p, p2, bytes_per_pixel)) {
-						x1 = i;
-						break;
-					}
-					p += bytes_per_pixel;
-					p2 += bytes_per_pixel;
-				}
-			}
-			x2 = x1;
-			for (j=y1; j<=y2; j++) {
-				p = &the_buffer[j * bytes_per_row];
-				p2 = &the_buffer_copy[j * bytes_per_row];
-				p += bytes_per_row;
-				p2 += bytes_per_row;
-				for (i=VModes[cur_mode].viXsize; i>x2; i--) {
-					p -= bytes_per_pixel;
-					p2 -= bytes_per_pixel;
-					if (memcmp(p, p2, bytes_per_pixel)) {
-						x2 = i;
-						break;
-					}
+// Returns true if anything changed
+static bool update_display(bool force_compare)
+{
+	// Tiles that NQD drew into during the last two refreshes are always compared,
+	// the others only every FULL_COMPARE_INTERVAL refreshes or if requested by the
+	// caller. If one of the others changed, the Mac writes to the frame buffer
+	// directly, so compare everything for a while.
+	const uint32 refresh = ++refresh_count;
+	const bool compare_all = force_compare || tile_stamps == NULL || direct_write_refreshes > 0 || refresh % FULL_COMPARE_INTERVAL == 0;
+	bool direct_write = false;
+	if (direct_write_refreshes > 0)
+		direct_write_refreshes--;
+
+	// Incremental update code, compare tiles and collect changed ones in rectangles
+	const int bytes_per_row = VModes[cur_mode].viRowBytes;
+	const int width = VModes[cur_mode].viXsize;
+	const int height = VModes[cur_mode].viYsize;
+	const int bytes_per_pixel = bytes_per_row / width;
+	const int line_bytes = (depth == 1) ? (width >> 3) : width * bytes_per_pixel;
+	const int num_tiles = (line_bytes + TILE_BYTES - 1) / TILE_BYTES;
+
+	dirty_rect rects[MAX_DIRTY_RECTS];
+	int num_rects = 0;
+	bool overflow = false;
+	dirty_rect bounds = { line_bytes, 0, height, 0 };
+
+	for (int y=0; y<height; y+=TILE_ROWS) {
+		int rows = (height - y < TILE_ROWS) ? height - y : TILE_ROWS;
+		int run_start = -1;
+		for (int t=0; t<=num_tiles; t++) {
+			int x = t * TILE_BYTES;
+			bool dirty = false;
+			if (t < num_tiles) {
+				int bytes = (line_bytes - x < TILE_BYTES) ? line_bytes - x : TILE_BYTES;
+				uint8 *p = &the_buffer[y * bytes_per_row + x];
+				uint8 *p2 = &the_buffer_copy[y * bytes_per_row + x];
+				bool drawn = tile_stamps && tile_stamps[(y / TILE_ROWS) * tile_columns + t] + 2 >= refresh;
+				if (compare_all || drawn) {
+					dirty = tile_differs(p, p2, bytes, rows, bytes_per_row);
+					if (dirty && !drawn)
+						direct_write = true;
 				}
-			}
-			wide = x2 - x1;
 
-			// Update copy of the_buffer
-			if (high && wide) {
-				for (j=y1; j<=y2; j++) {
-					i = j * bytes_per_row + x1 * bytes_per_pixel;
-					memcpy(&the_buffer_copy[i], &the_buffer[i], bytes_per_pixel * wide);
+				// Update copy of the_buffer
+				if (dirty) {
+					for (int i=0; i<rows; i++)
+						memcpy(p2 + i * bytes_per_row, p + i * bytes_per_row, bytes);
 				}
 			}
+			if (dirty) {
+				if (run_start < 0)
+					run_start = x;
+			} else if (run_start >= 0) {
+				int run_end = (x < line_bytes) ? x : line_bytes;
+				if (!overflow && !add_dirty_rect(rects, num_rects, run_start, run_end, y, y + rows))
+					overflow = true;
+				if (run_start < bounds.x1)
+					bounds.x1 = run_start;
+				if (run_end > bounds.x2)
+					bounds.x2 = run_end;
+				if (y < bounds.y1)
+					bounds.y1 = y;
+				bounds.y2 = y + rows;
+				run_start = -1;
+			}
 		}
 	}
 
+	if (direct_write)
+		direct_write_refreshes = VIDEO_REFRESH_HZ;
+
+	// Too many rectangles, refresh their bounding box instead
+	if (overflow) {
+		rects[0] = bounds;
+		num_rects = 1;
+	}
+
 	// Refresh display
-	if (high && wide) {
+	if (num_rects) {
 		XDisplayLock();
-		if (have_shm)
-			XShmPutImage(x_display, the_win, the_gc, img, x1, y1, x1, y1, wide, high, 0);
-		else
-			XPutImage(x_display, the_win, the_gc, img, x1, y1, x1, y1, wide, high);
+		for (int i=0; i<num_rects; i++) {
+			int x1, wide;
+			if (depth == 1) {
+				x1 = rects[i].x1 << 3;
+				wide = (rects[i].x2 - rects[i].x1) << 3;
+			} else {
+				x1 = rects[i].x1 / bytes_per_pixel;
+				wide = (rects[i].x2 - rects[i].x1) / bytes_per_pixel;
+			}
+			int y1 = rects[i].y1;
+			int high = rects[i].y2 - rects[i].y1;
+			if (export_frame_buffer)
+				FBExportAddDirty(x1, y1, wide, high);
+			if (have_shm)
+				XShmPutImage(x_display, the_win, the_gc, img, x1, y1, x1, y1, wide, high, 0);
+			else
+				XPutImage(x_display, the_win, the_gc, img, x1, y1, x1, y1, wide, high);
+		}
 		XDisplayUnlock();
 	}
+	return num_rects != 0;
 }
 
-const int VIDEO_REFRESH_HZ = 60;
-const int VIDEO_REFRESH_DELAY = 1000000 / VIDEO_REFRESH_HZ;
-
 static void handle_palette_changes(void)
 {
 	LOCK_PALETTE;
@@ -2432,13 +3250,19 @@ static void handle_palette_changes(void)
 	UNLOCK_PALETTE;
 }
 
+// Longest sleep of the redraw thread without damage. It doubles after each
+// refresh that found nothing to do. Frame buffer writes that are only found
+// by looking (non-VOSF compare, userfaultfd scan) are polled at the full rate.
+const int IDLE_DELAY_SIGNALED = 1000000;
+
 static void *redraw_func(void *arg)
 {
 	int fd = ConnectionNumber(x_display);
 
-	uint64 start = GetTicks_usec();
-	int64 ticks = 0;
-	uint64 next = GetTicks_usec() + VIDEO_REFRESH_DELAY;
+	const int64 min_delay = frame_skip * VIDEO_REFRESH_DELAY;
+	int64 idle_delay = min_delay;
+	uint64 last = GetTicks_usec();
+	bool damaged = true;
 
 	while (!redraw_thread_cancel) {
 
@@ -2446,19 +3270,18 @@ static void *redraw_func(void *arg)
 		if (thread_stop_req) {
 			sem_post(&thread_stop_ack);
 			sem_wait(&thread_resume_req);
+			damaged = true;
 		}
 
-		int64 delay = next - GetTicks_usec();
-		if (delay < -VIDEO_REFRESH_DELAY) {
-
-			// We are lagging far behind, so we reset the delay mechanism
-			next = GetTicks_usec();
-
-		} else if (delay <= 0) {
+		uint64 now = GetTicks_usec();
+		int64 delay = last + (damaged ? min_delay : idle_delay) - now;
+		if (delay <= 0) {
 
-			// Delay expired, refresh display
-			next += VIDEO_REFRESH_DELAY;
-			ticks++;
+			// Damage reported or idle timer expired, refresh display
+			const bool timed_out = !damaged;
+			damaged = false;
+			last = now;
+			redraw_refreshes++;
 
 			// Handle X11 events
 			handle_events();
@@ -2487,57 +3310,67 @@ static void *redraw_func(void *arg)
 			}
 
 			// Refresh display and set cursor image in window mode
-			static int tick_counter = 0;
+			bool changed = false;
+			bool exact_dirty_rects = false;		// Changes were passed to FBExportAddDirty()
+			int64 max_idle_delay = IDLE_DELAY_SIGNALED;
 			if (display_type == DIS_WINDOW) {
-				tick_counter++;
-				if (tick_counter >= frame_skip) {
-					tick_counter = 0;
 
-					// Update display
+				// Update display
 #ifdef ENABLE_VOSF
-					if (use_vosf) {
-						XDisplayLock();
-						if (mainBuffer.dirty) {
-							LOCK_VOSF;
-							update_display_window_vosf();
-							UNLOCK_VOSF;
-							XSync(x_display, false); // Let the server catch up
-						}
-						XDisplayUnlock();
+				if (use_vosf) {
+					XDisplayLock();
+#ifdef ENABLE_UFFD_TRACKING
+					if (uffd_fd >= 0) {
+						LOCK_VOSF;
+						changed = update_display_window_uffd();
+						UNLOCK_VOSF;
+						exact_dirty_rects = true;
+						max_idle_delay = min_delay;
+					} else
+#endif
+					if (mainBuffer.dirty) {
+						LOCK_VOSF;
+						update_display_window_vosf();
+						UNLOCK_VOSF;
+						XSync(x_display, false); // Let the server catch up
+						changed = true;
 					}
-					else
-#endif
-						update_display();
-
-					// Set new cursor image if it was changed
-					if (hw_mac_cursor_accl && cursor_changed) {
-						cursor_changed = false;
-						uint8 *x_data = (uint8 *)cursor_image->data;
-						uint8 *x_mask = (uint8 *)cursor_mask_image->data;
-						for (int i = 0; i < 32; i++) {
-							x_mask[i] = MacCursor[4 + i] | MacCursor[36 + i];
-							x_data[i] = MacCursor[4 + i];
-						}
-						XDisplayLock();
-						XFreeCursor(x_display, mac_cursor);
-						XPutImage(x_display, cursor_map, cursor_gc, cursor_image, 0, 0, 0, 0, 16, 16);
-						XPutImage(x_display, cursor_mask_map, cursor_mask_gc, cursor_mask_image, 0, 0, 0, 0, 16, 16);
-						mac_cursor = XCreatePixmapCursor(x_display, cursor_map, cursor_mask_map, &black, &white, MacCursor[2], MacCursor[3]);
-						XDefineCursor(x_display, the_win, mac_cursor);
-						XDisplayUnlock();
+					XDisplayUnlock();
+				}
+				else
+#endif
+				{
+					changed = update_display(timed_out);
+					exact_dirty_rects = true;
+					max_idle_delay = min_delay;
+				}
+
+				// Set new cursor image if it was changed
+				if (hw_mac_cursor_accl && cursor_changed) {
+					cursor_changed = false;
+					uint8 *x_data = (uint8 *)cursor_image->data;
+					uint8 *x_mask = (uint8 *)cursor_mask_image->data;
+					for (int i = 0; i < 32; i++) {
+						x_mask[i] = MacCursor[4 + i] | MacCursor[36 + i];
+						x_data[i] = MacCursor[4 + i];
 					}
+					XDisplayLock();
+					XFreeCursor(x_display, mac_cursor);
+					XPutImage(x_display, cursor_map, cursor_gc, cursor_image, 0, 0, 0, 0, 16, 16);
+					XPutImage(x_display, cursor_mask_map, cursor_mask_gc, cursor_mask_image, 0, 0, 0, 0, 16, 16);
+					mac_cursor = XCreatePixmapCursor(x_display, cursor_map, cursor_mask_map, &black, &white, MacCursor[2], MacCursor[3]);
+					XDefineCursor(x_display, the_win, mac_cursor);
+					XDisplayUnlock();
 				}
 			}
 #ifdef ENABLE_VOSF
 			else if (use_vosf) {
 				// Update display (VOSF variant)
-				if (++tick_counter >= frame_skip) {
-					tick_counter = 0;
-					if (mainBuffer.dirty) {
-						LOCK_VOSF;
-						update_display_dga_vosf();
-						UNLOCK_VOSF;
-					}
+				if (mainBuffer.dirty) {
+					LOCK_VOSF;
+					update_display_dga_vosf();
+					UNLOCK_VOSF;
+					changed = true;
 				}
 			}
 #endif
@@ -2545,17 +3378,50 @@ static void *redraw_func(void *arg)
 			// Set new palette if it was changed
 			handle_palette_changes();
 
+			// Announce frame to export clients
+			if (export_frame_buffer) {
+				if (changed)
+					FBExportFrame(!exact_dirty_rects);
+				else
+					FBExportPoll();
+			}
+
+			// Back off while nothing changes, unless nobody can wake us up
+			if (changed) {
+				redraw_changes++;
+				idle_delay = min_delay;
+			} else if (wake_pipe[0] >= 0) {
+				idle_delay = std::min(idle_delay * 2, std::max(max_idle_delay, min_delay));
+			}
+
 		} else {
 
-			// No display refresh pending, check for X events
+			// No display refresh pending, sleep until damage or X events arrive
+			handle_events();
 			fd_set readfds;
 			FD_ZERO(&readfds);
 			FD_SET(fd, &readfds);
+			int max_fd = fd;
+			if (wake_pipe[0] >= 0) {
+				FD_SET(wake_pipe[0], &readfds);
+				if (wake_pipe[0] > max_fd)
+					max_fd = wake_pipe[0];
+			}
+			const int export_fd = export_frame_buffer ? FBExportListenFD() : -1;
+			if (export_fd >= 0) {
+				FD_SET(export_fd, &readfds);
+				if (export_fd > max_fd)
+					max_fd = export_fd;
+			}
 			struct timeval timeout;
-			timeout.tv_sec = 0;
-			timeout.tv_usec = delay;
-			if (select(fd+1, &readfds, NULL, NULL, &timeout) > 0)
-				handle_events();
+			timeout.tv_sec = delay / 1000000;
+			timeout.tv_usec = delay % 1000000;
+			int ready = select(max_fd+1, &readfds, NULL, NULL, &timeout);
+			redraw_wakeups++;
+			if (ready > 0 && wake_pipe[0] >= 0 && FD_ISSET(wake_pipe[0], &readfds) && wake_pipe_drain())
+				damaged = true;
+			if (ready > 0 && export_fd >= 0 && FD_ISSET(export_fd, &readfds))
+				FBExportPoll();
 		}
 	}
 	return NULL;
@@ -2572,13 +3438,50 @@ void video_set_dirty_area(int x, int y, int w, int h)
 	const int screen_width = VIDEO_MODE_X;
 	const int screen_height = VIDEO_MODE_Y;
 	const int bytes_per_row = VIDEO_MODE_ROW_BYTES;
+	wake_redraw_thread();
 
 #ifdef ENABLE_VOSF
 	if (use_vosf) {
+#ifdef ENABLE_UFFD_TRACKING
+		// The written pages show up in the next PAGEMAP_SCAN anyway
+		if (uffd_fd >= 0)
+			return;
+#endif
 		vosf_set_dirty_area(x, y, w, h, screen_width, screen_height, bytes_per_row);
 		return;
 	}
 #endif
 
-	// XXX handle dirty bounding boxes for non-VOSF modes
+	// Stamp the tiles for update_display(), NQD calls us before it draws
+	if (tile_stamps == NULL)
+		return;
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > screen_width)
+		w = screen_width - x;
+	if (y + h > screen_height)
+		h = screen_height - y;
+	if (w <= 0 || h <= 0)
+		return;
+
+	int x1, x2;
+	if (depth == 1) {
+		x1 = x >> 3;
+		x2 = (x + w + 7) >> 3;
+	} else {
+		const int bytes_per_pixel = bytes_per_row / screen_width;
+		x1 = x * bytes_per_pixel;
+		x2 = (x + w) * bytes_per_pixel;
+	}
+	const uint32 stamp = refresh_count;
+	for (int ty = y / TILE_ROWS; ty <= (y + h - 1) / TILE_ROWS && ty < tile_lines; ty++) {
+		for (int tx = x1 / TILE_BYTES; tx <= (x2 - 1) / TILE_BYTES && tx < tile_columns; tx++)
+			tile_stamps[ty * tile_columns + tx] = stamp;
+	}
 }
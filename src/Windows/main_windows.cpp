@@ -45,6 +45,8 @@
 #include "sigsegv.h"
 #include "util_windows.h"
 #include "kernel_windows.h"
+#include "stats.h"
+#include "replay.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -74,6 +76,7 @@ uint32 PVR;				// Theoretical PVR
 int64 CPUClockSpeed;	// Processor clock speed (Hz)
 int64 BusClockSpeed;	// Bus clock speed (Hz)
 int64 TimebaseSpeed;	// Timebase clock speed (Hz)
+bool HugePagesEnabled = false;	// Flag: back Mac memory and translation cache with huge pages
 uint8 *RAMBaseHost;		// Base address of Mac RAM (host address space)
 uint8 *ROMBaseHost;		// Base address of Mac ROM (host address space)
 DWORD win_os;			// Windows OS id
@@ -632,8 +635,8 @@ static DWORD tick_func(void *arg)
 			next = GetTicks_usec();
 		ticks++;
 
-		// Pseudo Mac 1Hz interrupt, update local time
-		if (++tick_counter > 60) {
+		// Pseudo Mac 1Hz interrupt, update local time (done by emulator thread in event record/replay mode)
+		if (++tick_counter > 60 && ReplayMode == REPLAY_OFF) {
 			tick_counter = 0;
 			WriteMacInt32(0x20c, TimerDateTime());
 		}
@@ -689,6 +692,11 @@ static mutex_t intflags_mutex;
 
 void SetInterruptFlag(uint32 flag)
 {
+	InterruptStatsRaise(flag);
+	if (ReplayMode != REPLAY_OFF) {
+		ReplaySetInterruptFlag(flag);
+		return;
+	}
 	intflags_mutex.lock();
 	InterruptFlags |= flag;
 	intflags_mutex.unlock();
@@ -46,6 +46,9 @@
 #include "user_strings.h"
 #include "emul_op.h"
 #include "thunks.h"
+#include "stats.h"
+#include "replay.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -55,6 +58,105 @@
 static uint32 MakeExecutableTvec;
 
 
+/*
+ *  Call IdleWaitNextEvent() on entry of WaitNextEvent()
+ */
+
+static void patch_wait_next_event(void)
+{
+#if EMULATED_PPC
+	uint32 tvec = FindLibSymbol("\014InterfaceLib", "\015WaitNextEvent");
+	D(bug("WaitNextEvent TVECT at %08x\n", tvec));
+	if (tvec == 0)
+		return;
+	uint32 code = ReadMacInt32(tvec);
+	uint32 proc = SheepMem::ReserveProc(5 * 4);
+	WriteMacInt32(proc + 0, NativeOpcode(NATIVE_WAIT_NEXT_EVENT));
+	WriteMacInt32(proc + 4, 0x3c000000 | (code >> 16));		// lis	r0,code@h
+	WriteMacInt32(proc + 8, 0x60000000 | (code & 0xffff));	// ori	r0,r0,code@l
+	WriteMacInt32(proc + 12, 0x7c0903a6);					// mtctr	r0
+	WriteMacInt32(proc + 16, POWERPC_BCTR);					// bctr
+	WriteMacInt32(tvec, proc);
+#endif
+}
+
+
+/*
+ *  Count calls of frequently used InterfaceLib routines in A-trap profiler
+ */
+
+static void patch_lib_profile(void)
+{
+#if EMULATED_PPC
+	static const char *syms[] = {
+		"\006NewPtr",
+		"\013NewPtrClear",
+		"\012DisposePtr",
+		"\011NewHandle",
+		"\016NewHandleClear",
+		"\015DisposeHandle",
+		"\005HLock",
+		"\007HUnlock",
+		"\015GetHandleSize",
+		"\015SetHandleSize",
+		"\011HGetState",
+		"\011HSetState",
+		"\013GetResource",
+		"\014Get1Resource",
+		"\017ReleaseResource",
+		"\011TickCount",
+		"\006Button",
+		"\011StillDown",
+		"\010GetMouse",
+		"\012EventAvail",
+		"\014GetNextEvent",
+		"\015WaitNextEvent",
+		"\007GetPort",
+		"\007SetPort",
+		"\010CopyBits",
+		"\010DrawText",
+		"\006MoveTo",
+		"\006LineTo",
+		"\011EraseRect",
+		"\011InvalRect",
+		"\012PBReadSync",
+		"\013PBWriteSync",
+		"\006FSRead",
+		"\007FSWrite",
+		NULL
+	};
+	for (int i = 0; syms[i]; i++) {
+		uint32 tvec = FindLibSymbol("\014InterfaceLib", syms[i]);
+		if (tvec == 0)
+			continue;
+		int index = TrapProfileAddLib(syms[i] + 1, ReadMacInt32(tvec));
+		if (index < 0)
+			break;
+		uint32 proc = SheepMem::ReserveProc(4);
+		WriteMacInt32(proc, POWERPC_LIB_PROFILE | (index << 6));
+		WriteMacInt32(tvec, proc);
+	}
+#endif
+}
+
+
+/*
+ *  Replace InterfaceLib routine by native implementation
+ */
+
+static void patch_interface_lib(const char *sym, int selector)
+{
+	uint32 tvec = FindLibSymbol("\014InterfaceLib", sym);
+	D(bug("%s TVECT at %08x\n", sym + 1, tvec));
+	if (tvec == 0)
+		return;
+	WriteMacInt32(tvec, NativeFunction(selector));
+#if !EMULATED_PPC
+	WriteMacInt32(tvec + 4, (uint32)TOC);
+#endif
+}
+
+
 /*
  *  Execute EMUL_OP opcode (called by 68k emulator)
  */
@@ -152,6 +254,7 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 
 		case OP_SONY_OPEN:			// Floppy driver functions
 			r->d[0] = SonyOpen(r->a[0], r->a[1]);
+			SnapshotOpenDrivers |= SNAPSHOT_DRIVER_SONY;
 			break;
 		case OP_SONY_PRIME:
 			r->d[0] = SonyPrime(r->a[0], r->a[1]);
@@ -165,6 +268,7 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 
 		case OP_DISK_OPEN:			// Disk driver functions
 			r->d[0] = DiskOpen(r->a[0], r->a[1]);
+			SnapshotOpenDrivers |= SNAPSHOT_DRIVER_DISK;
 			break;
 		case OP_DISK_PRIME:
 			r->d[0] = DiskPrime(r->a[0], r->a[1]);
@@ -178,6 +282,7 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 
 		case OP_CDROM_OPEN:			// CD-ROM driver functions
 			r->d[0] = CDROMOpen(r->a[0], r->a[1]);
+			SnapshotOpenDrivers |= SNAPSHOT_DRIVER_CDROM;
 			break;
 		case OP_CDROM_PRIME:
 			r->d[0] = CDROMPrime(r->a[0], r->a[1]);
@@ -263,6 +368,25 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 			WriteMacInt32(MakeExecutableTvec + 4, (uint32)TOC);
 #endif
 
+			// Patch BlockMove() and friends (the DR emulator, which is disabled
+			// in OP_RESET, would need its translation cache invalidated)
+			patch_interface_lib("\011BlockMove", NATIVE_BLOCK_MOVE);
+			patch_interface_lib("\021BlockMoveUncached", NATIVE_BLOCK_MOVE);
+			patch_interface_lib("\015BlockMoveData", NATIVE_BLOCK_MOVE_DATA);
+			patch_interface_lib("\025BlockMoveDataUncached", NATIVE_BLOCK_MOVE_DATA);
+			patch_interface_lib("\011BlockZero", NATIVE_BLOCK_ZERO);
+			patch_interface_lib("\021BlockZeroUncached", NATIVE_BLOCK_ZERO);
+
+			// Patch polling routines to sleep when idle
+			if (IdlePollEnabled) {
+				patch_interface_lib("\011TickCount", NATIVE_TICK_COUNT);
+				patch_wait_next_event();
+			}
+
+			// Profile InterfaceLib calls
+			if (TrapProfileEnabled)
+				patch_lib_profile();
+
 			// Patch DebugStr()
 			static const uint8 proc_template[] = {
 				M68K_EMUL_OP_DEBUG_STR >> 8, M68K_EMUL_OP_DEBUG_STR & 0xFF,
@@ -304,11 +428,13 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 			r->d[0] = 0;
 			if (HasMacStarted()) {
 				if (InterruptFlags & INTFLAG_VIA) {
+					InterruptStatsDeliver(INTFLAG_VIA);
 					ClearInterruptFlag(INTFLAG_VIA);
 #if !PRECISE_TIMING
 					TimerInterrupt();
 #endif
 					ExecuteNative(NATIVE_VIDEO_VBL);
+					BootPhaseVBL();
 
 					static int tick_counter = 0;
 					if (++tick_counter >= 60) {
@@ -316,27 +442,34 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 						SonyInterrupt();
 						DiskInterrupt();
 						CDROMInterrupt();
+						if (ZeroPageReclaim)
+							ZeroPageFlush();
 					}
 
 					r->d[0] = 1;		// Flag: 68k interrupt routine executes VBLTasks etc.
 				}
 				if (InterruptFlags & INTFLAG_SERIAL) {
+					InterruptStatsDeliver(INTFLAG_SERIAL);
 					ClearInterruptFlag(INTFLAG_SERIAL);
 					SerialInterrupt();
 				}
 				if (InterruptFlags & INTFLAG_ETHER) {
+					InterruptStatsDeliver(INTFLAG_ETHER);
 					ClearInterruptFlag(INTFLAG_ETHER);
 					ExecuteNative(NATIVE_ETHER_IRQ);
 				}
 				if (InterruptFlags & INTFLAG_TIMER) {
+					InterruptStatsDeliver(INTFLAG_TIMER);
 					ClearInterruptFlag(INTFLAG_TIMER);
 					TimerInterrupt();
 				}
 				if (InterruptFlags & INTFLAG_AUDIO) {
+					InterruptStatsDeliver(INTFLAG_AUDIO);
 					ClearInterruptFlag(INTFLAG_AUDIO);
 					AudioInterrupt();
 				}
 				if (InterruptFlags & INTFLAG_ADB) {
+					InterruptStatsDeliver(INTFLAG_ADB);
 					ClearInterruptFlag(INTFLAG_ADB);
 					ADBInterrupt();
 				}
@@ -475,22 +608,124 @@ void EmulOp(M68kRegisters *r, uint32 pc, int selector)
 			break;
 
 		case OP_IDLE_TIME:
-			// Sleep if no events pending
-			if (ReadMacInt32(0x14c) == 0)
+			// Sleep if no events pending (not when replaying events)
+			if (ReadMacInt32(0x14c) == 0 && ReplayMode != REPLAY_PLAY)
 				idle_wait();
 			r->a[0] = ReadMacInt32(0x2b6);
 			break;
 
 		case OP_IDLE_TIME_2:
-			// Sleep if no events pending
-			if (ReadMacInt32(0x14c) == 0)
+			// Sleep if no events pending (not when replaying events)
+			if (ReadMacInt32(0x14c) == 0 && ReplayMode != REPLAY_PLAY)
 				idle_wait();
 			r->d[0] = (uint32)-2;
 			break;
 
+		case OP_TICK_COUNT:		// TickCount()
+			WriteMacInt32(r->a[7] + 4, IdleTickCount());
+			break;
+
+		case OP_BLOCK_MOVE:		// BlockMove()/BlockMoveData(), trap word in d1
+			if (r->d[1] & 0x200)
+				Mac_BlockMoveData(r->a[0], r->a[1], r->d[0]);
+			else
+				Mac_BlockMove(r->a[0], r->a[1], r->d[0]);
+			r->d[0] = 0;
+			break;
+
+		case OP_ATRAP_RETURN:	// Return trampoline of A-trap profiler, followed by RTS
+			r->a[7] -= 4;
+			WriteMacInt32(r->a[7], TrapProfileATrapReturn(pc));
+			break;
+
 		default:
 			printf("FATAL: EMUL_OP called with bogus selector %08x\n", selector);
 			QuitEmulator();
 			break;
 	}
 }
+
+
+/*
+ *  Sleep if the guest keeps polling time or events without calling
+ *  SynchIdleTime() (called by TickCount(), WaitNextEvent() and PowerPC
+ *  loops which only read low memory globals). idle_wait() returns on
+ *  the next interrupt, which includes Time Manager tasks getting due.
+ */
+
+bool IdlePollEnabled = false;				// Set by ROM patches if "idlewait" is on
+
+const int IDLE_POLL_THRESHOLD = 1000;		// Number of polls within one tick before sleeping
+
+static uint32 idle_poll_ticks = 0;			// Value of Ticks at last poll
+static int idle_poll_count = 0;				// Number of polls since Ticks changed
+
+static inline bool valid_ram(uint32 addr, uint32 size)
+{
+	return addr >= RAMBase && size <= RAMSize && addr - RAMBase <= RAMSize - size;
+}
+
+// Check whether the Event Manager would return an event right away: either
+// one in the event queue or an activate or update event, which WaitNextEvent()
+// generates from the Window Manager state
+static bool events_pending(void)
+{
+	if (ReadMacInt32(0x14c))							// EventQueue.qHead
+		return true;
+	if (ReadMacInt32(0xa64) || ReadMacInt32(0xa68))		// CurActivate, CurDeactive
+		return true;
+	uint32 window = ReadMacInt32(0x9d6);				// WindowList
+	for (int i = 0; i < 256 && valid_ram(window, 148); i++) {
+		if (ReadMacInt8(window + 110)) {				// visible
+			uint32 rgn_handle = ReadMacInt32(window + 122);	// updateRgn
+			if (valid_ram(rgn_handle, 4)) {
+				uint32 rgn = ReadMacInt32(rgn_handle);
+				if (valid_ram(rgn, 10)) {
+					int16 top = ReadMacInt16(rgn + 2), left = ReadMacInt16(rgn + 4);
+					int16 bottom = ReadMacInt16(rgn + 6), right = ReadMacInt16(rgn + 8);
+					if (bottom > top && right > left)
+						return true;
+				}
+			}
+		}
+		window = ReadMacInt32(window + 144);			// nextWindow
+	}
+	return false;
+}
+
+static inline bool idle_allowed(void)
+{
+	// Not if events are pending or when replaying events
+	return ReplayMode != REPLAY_PLAY && !events_pending();
+}
+
+void IdlePoll(void)
+{
+	if (!IdlePollEnabled)
+		return;
+	uint32 ticks = ReadMacInt32(0x16a);
+	if (ticks != idle_poll_ticks) {
+		idle_poll_ticks = ticks;
+		idle_poll_count = 0;
+	} else if (++idle_poll_count >= IDLE_POLL_THRESHOLD) {
+		idle_poll_count = 0;
+		if (idle_allowed())
+			idle_wait();
+	}
+}
+
+uint32 IdleTickCount(void)
+{
+	IdlePoll();
+	return ReadMacInt32(0x16a);
+}
+
+void IdleWaitNextEvent(uint32 sleep)
+{
+	// The application is willing to sleep for that many ticks if no event
+	// arrives, so waiting for the next interrupt is fine
+	if (sleep == 0)
+		IdlePoll();
+	else if (IdlePollEnabled && idle_allowed())
+		idle_wait();
+}
@@ -27,6 +27,8 @@ const uint32 POWERPC_ILLEGAL = 0x00000000;
 const uint32 POWERPC_BLR = 0x4e800020;
 const uint32 POWERPC_BCTR = 0x4e800420;
 const uint32 POWERPC_EMUL_OP = 0x18000000;	// Base opcode for EMUL_OP opcodes (only used with PPC emulation)
+const uint32 POWERPC_LIB_PROFILE = POWERPC_EMUL_OP | 0x3e;		// Profiled library call, index in bits 6..17 (only used with PPC emulation)
+const uint32 POWERPC_ATRAP_PROFILE = POWERPC_EMUL_OP | 0x3f;	// Profiled A-trap, trap number in bits 6..17 (only used with PPC emulation)
 
 // 68k opcodes
 const uint16 M68K_ILLEGAL = 0x4afc;
@@ -48,7 +50,8 @@ enum {	// Selectors for EMUL_OP opcodes
 	OP_DEBUG_STR, OP_INSTALL_DRIVERS, OP_NAME_REGISTRY, OP_RESET, OP_IRQ,
 	OP_SCSI_DISPATCH, OP_SCSI_ATOMIC,
 	OP_CHECK_SYSV, OP_NTRB_17_PATCH, OP_NTRB_17_PATCH2, OP_NTRB_17_PATCH3, OP_NTRB_17_PATCH4, OP_CHECKLOAD,
-	OP_EXTFS_COMM, OP_EXTFS_HFS, OP_IDLE_TIME, OP_IDLE_TIME_2,
+	OP_EXTFS_COMM, OP_EXTFS_HFS, OP_IDLE_TIME, OP_IDLE_TIME_2, OP_BLOCK_MOVE, OP_TICK_COUNT,
+	OP_ATRAP_RETURN,
 	OP_MAX
 };
 const uint16 M68K_EMUL_RETURN = 0xfe40;	// Extended opcodes
@@ -107,6 +110,9 @@ const uint16 M68K_EMUL_OP_EXTFS_COMM = M68K_EMUL_BREAK + OP_EXTFS_COMM;
 const uint16 M68K_EMUL_OP_EXTFS_HFS = M68K_EMUL_BREAK + OP_EXTFS_HFS;
 const uint16 M68K_EMUL_OP_IDLE_TIME = M68K_EMUL_BREAK + OP_IDLE_TIME;
 const uint16 M68K_EMUL_OP_IDLE_TIME_2 = M68K_EMUL_BREAK + OP_IDLE_TIME_2;
+const uint16 M68K_EMUL_OP_BLOCK_MOVE = M68K_EMUL_BREAK + OP_BLOCK_MOVE;
+const uint16 M68K_EMUL_OP_TICK_COUNT = M68K_EMUL_BREAK + OP_TICK_COUNT;
+const uint16 M68K_EMUL_OP_ATRAP_RETURN = M68K_EMUL_BREAK + OP_ATRAP_RETURN;
 
 extern "C" void EmulOp(M68kRegisters *r, uint32 pc, int selector);
 
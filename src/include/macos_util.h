@@ -360,6 +360,16 @@ extern uint32 TimeToMacTime(time_t t);					// Convert time_t value to MacOS time
 extern time_t MacTimeToTime(uint32 t);				// Convert MacOS time to time_t value
 extern uint32 Mac_sysalloc(uint32 size);				// Allocate block in MacOS system heap zone
 extern void Mac_sysfree(uint32 addr);					// Release block occupied by the nonrelocatable block p
+extern void Mac_BlockMove(uint32 src, uint32 dst, uint32 size);		// BlockMove(), flushes code caches
+extern void Mac_BlockMoveData(uint32 src, uint32 dst, uint32 size);	// BlockMoveData()
+extern void Mac_BlockZero(uint32 dst, uint32 size);					// BlockZero()
+
+// Release of Mac RAM pages cleared by the guest ("density" prefs item)
+extern bool ZeroPageReclaim;							// Flag: give zeroed pages back to the host
+extern uint64 ZeroPagesReleased;						// Number of host pages released
+extern void ZeroPageAdd(uint32 addr);					// 4 KB page at addr was cleared with dcbz
+extern void ZeroPageFlush(void);						// Release queued pages that are still zero
+extern void ZeroPageRelease(uint32 addr, uint32 size);	// Release page aligned range, contents become zero
 
 // Construct four-character-code from string
 #define FOURCC(a,b,c,d) (((uint32)(a) << 24) | ((uint32)(b) << 16) | ((uint32)(c) << 8) | (uint32)(d))
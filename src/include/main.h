@@ -30,6 +30,8 @@ extern uint32 PVR;				// Theoretical PVR
 extern int64 CPUClockSpeed;		// Processor clock speed (Hz)
 extern int64 BusClockSpeed;		// Bus clock speed (Hz)
 extern int64 TimebaseSpeed;		// Timebase clock speed (Hz)
+extern bool HugePagesEnabled;	// Flag: back Mac memory and translation cache with huge pages
+extern bool XPRAMSaveEnabled;	// Flag: write NVRAM back to its file (cleared in forked clones)
 
 #ifdef __BEOS__
 extern system_info SysInfo;		// System information
@@ -49,6 +51,10 @@ extern void Dump68kRegs(M68kRegisters *r);					// Dump 68k registers
 extern void MakeExecutable(int dummy, uint32 start, uint32 length);	// Make code executable
 extern void PatchAfterStartup(void);						// Patches after system startup
 extern void QuitEmulator(void);								// Quit emulator (must only be called from main thread)
+extern bool IdlePollEnabled;								// Flag: IdlePoll() may sleep ("idlewait" prefs item)
+extern void IdlePoll(void);									// Guest polls time or events, sleep if it keeps doing so
+extern uint32 IdleTickCount(void);							// TickCount() replacement
+extern void IdleWaitNextEvent(uint32 sleep);				// Called on WaitNextEvent() entry
 extern void ErrorAlert(const char *text);					// Display error alert
 extern void WarningAlert(const char *text);					// Display warning alert
 extern bool ChoiceAlert(const char *text, const char *pos, const char *neg);	// Display choice alert
@@ -0,0 +1,57 @@
+/*
+ *  replay.h - Deterministic record/replay of asynchronous events
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Modes
+enum {
+	REPLAY_OFF,
+	REPLAY_RECORD,				// Log events ("eventrecord" prefs item)
+	REPLAY_PLAY					// Inject logged events ("eventreplay" prefs item)
+};
+
+// Logged event types
+enum {
+	REPLAY_EV_INTERRUPT = 1,	// HandleInterrupt() call, data = newly raised interrupt flags
+	REPLAY_EV_TIME,				// timer_current_time() value
+	REPLAY_EV_DATETIME,			// TimerDateTime() value, logged when it changes
+	REPLAY_EV_TIMEBASE,			// Time base register value
+	REPLAY_EV_END				// End of log
+};
+
+extern int ReplayMode;
+
+extern void ReplayInit(void);
+extern void ReplayExit(void);
+
+// Called by SetInterruptFlag() when ReplayMode != REPLAY_OFF
+extern void ReplaySetInterruptFlag(uint32 flag);
+
+// Called by the CPU emulator after each block, returns true if HandleInterrupt() must be called now
+extern bool ReplayCheckpoint(void);
+
+// Called on HandleInterrupt() entry
+extern void ReplayInterrupt(void);
+
+// Log (record mode) or override (replay mode) a value derived from host time
+extern void ReplayValue(int type, void *data, int size);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ *  snapshot.h - Machine state snapshots
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+typedef void (*snapshot_func)(void);
+typedef bool (*snapshot_prepare_func)(void);	// Returns false if the state can't be saved now
+
+// Drivers that record guest state in their Open routine
+enum {
+	SNAPSHOT_DRIVER_SONY = 1,
+	SNAPSHOT_DRIVER_DISK = 2,
+	SNAPSHOT_DRIVER_CDROM = 4
+};
+
+// PowerPC registers
+struct snapshot_cpu_state {
+	uint32 gpr[32];
+	uint64 fpr[32];
+	uint32 vr[32][4];
+	uint32 cr, xer, vscr, vrsave, fpscr, lr, ctr, pc;
+};
+
+extern bool SnapshotPending;				// Flag: save snapshot at next safe point ("snapshotsave" prefs item)
+extern bool SnapshotRestored;				// Flag: machine state was loaded from snapshot ("snapshotload" prefs item)
+extern uint32 SnapshotOpenDrivers;			// SNAPSHOT_DRIVER_* opened by Mac OS, their host state isn't saved
+extern snapshot_cpu_state SnapshotCPU;		// CPU state to save or resume from
+
+extern bool SnapshotInit(void);				// Called at the end of InitAll(), loads snapshot if requested
+extern void SnapshotBootDone(void);			// Mac OS is up, request snapshot
+extern void SnapshotSafePoint(int nesting);	// Called by the CPU emulator with SnapshotCPU filled in, nesting = number of nested execute() calls
+extern void SnapshotSetBootHook(snapshot_func func);	// Run func at the safe point after Mac OS is up
+
+// Saved items
+enum {
+	SNAPSHOT_STATE,			// Host variables, restored verbatim
+	SNAPSHOT_CHECK			// Host variables that must have the same value on restore
+};
+
+extern void SnapshotAddArea(uint32 addr, uint32 size, bool lazy);	// Mac memory area, mapped from the file on restore if lazy
+extern void SnapshotAddState(const char *name, void *data, uint32 size, int type = SNAPSHOT_STATE,
+	snapshot_prepare_func prepare = NULL, snapshot_func restored = NULL);
+
+// Host state of other modules
+extern void TimerSnapshotRegister(void);
+extern void VideoSnapshotRegister(void);
+extern void MacOSUtilSnapshotRegister(void);
+extern void NameRegistrySnapshotRegister(void);
+extern void SerialSnapshotRegister(void);
+
+// Timer thread must be stopped around fork(), which only keeps the calling thread
+extern void TimerCloneBegin(void);
+extern void TimerCloneEnd(void);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ *  stats.h - Runtime statistics
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+extern bool StatsEnabled;			// Flag: collect statistics ("stats" prefs item)
+
+extern void StatsInit(void);
+extern void StatsExit(void);
+
+// Histogram with power-of-two buckets (bucket i holds values in [2^(i-1), 2^i))
+const int STATS_HISTOGRAM_BUCKETS = 40;
+
+struct stats_histogram {
+	uint64 count;					// Number of samples
+	uint64 total;					// Sum of samples
+	uint64 max;						// Largest sample
+	uint64 bucket[STATS_HISTOGRAM_BUCKETS];
+};
+
+extern void StatsHistogramReset(stats_histogram *h);
+extern void StatsHistogramAdd(stats_histogram *h, uint64 value);
+extern uint64 StatsHistogramPercentile(const stats_histogram *h, int percent);
+extern void StatsHistogramPrint(FILE *f, const stats_histogram *h, const char *unit);
+
+// Statistics providers, each one prints its own section of the report
+typedef void (*stats_print_func)(FILE *f);
+extern void StatsRegister(const char *name, stats_print_func print);
+extern bool StatsPrint(const char *name, FILE *f);	// Print one section, returns false if not found
+extern void StatsPrintAll(FILE *f);
+
+// Cheap timestamp for measuring short code paths (CPU cycles where available)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define STATS_TIMESTAMP_UNIT "cycles"
+static inline uint64 StatsTimestamp(void)
+{
+	uint32 lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64)hi << 32) | lo;
+}
+#else
+#include "timer.h"
+#define STATS_TIMESTAMP_UNIT "usec"
+static inline uint64 StatsTimestamp(void)
+{
+	return GetTicks_usec();
+}
+#endif
+
+// Interrupt latency statistics (flags are INTFLAG_*)
+enum {
+	IRQ_DEFER_NEST,					// Interrupts disabled (XLM_IRQ_NEST > 0)
+	IRQ_DEFER_MODE					// Run mode doesn't allow delivery
+};
+
+extern void InterruptStatsRaise(uint32 flag);				// Called by SetInterruptFlag()
+extern void InterruptStatsDeliver(uint32 flag);				// Called when guest handler runs for flag
+extern void InterruptStatsDefer(uint32 flags, int reason);	// Called when pending flags couldn't be delivered
+
+// Boot phase timings
+extern const char *BootBenchmarkFile;		// Write boot phase timings as JSON to this file and quit when Mac OS is up
+extern void BootPhaseStart(void);			// Start timing, called as early as possible
+extern void BootPhase(const char *name);	// Mark end of named boot phase
+extern void BootPhaseVBL(void);				// Called on each VBL after Mac OS has started
+extern void BootPhasePrintJSON(FILE *f);
+
+// A-trap profiler ("trapprofile" prefs item), counts and times A-line opcodes dispatched
+// by the 68k emulator and calls of selected shared library routines
+const int TRAP_PROFILE_ATRAPS = 0x1000;		// Opcodes A000..AFFF
+const int TRAP_PROFILE_LIBS = 64;			// Max. number of library routines
+const int TRAP_PROFILE_LIB_RETURN = 0xfff;	// Library index of return trampolines
+
+extern bool TrapProfileEnabled;
+extern void TrapProfileSetOpcode(int trap, uint32 opcode);		// Save PowerPC opcode replaced in 68k emulator opcode table
+extern uint32 TrapProfileATrap(int trap, uint32 *pc);			// Count A-trap, redirect return PC to trampoline, returns replaced opcode
+extern uint32 TrapProfileATrapReturn(uint32 pc);				// A-trap returned to trampoline at pc, returns original return PC
+extern int TrapProfileAddLib(const char *name, uint32 code);	// Register library routine, returns index or -1
+extern uint32 TrapProfileLibCall(int index, uint32 *lr);		// Count library call, redirect lr to trampoline, returns address of routine
+extern uint32 TrapProfileLibReturn(uint32 pc);					// Routine returned to trampoline at pc, returns original lr
+
+#endif
@@ -67,6 +67,11 @@ enum {
   NATIVE_NAMED_CHECK_LOAD_INVOC,
   NATIVE_GET_NAMED_RESOURCE,
   NATIVE_GET_1_NAMED_RESOURCE,
+  NATIVE_BLOCK_MOVE,
+  NATIVE_BLOCK_MOVE_DATA,
+  NATIVE_BLOCK_ZERO,
+  NATIVE_TICK_COUNT,
+  NATIVE_WAIT_NEXT_EVENT,
   NATIVE_OP_MAX
 };
 
@@ -138,12 +138,15 @@ extern void VideoExit(void);
 extern void VideoVBL(void);
 extern void VideoInstallAccel(void);
 extern void VideoQuitFullScreen(void);
+extern bool VideoCloneBegin(void);
+extern bool VideoCloneEnd(bool child);
 
 extern void video_set_palette(void);
 extern void video_set_cursor(void);
 extern bool video_can_change_cursor(void);
 extern int16 video_mode_change(VidLocals *csSave, uint32 ParamPtr);
 extern void video_set_dirty_area(int x, int y, int w, int h);
+extern void (*video_damage_hook)(void);	// Called after a frame buffer write fault, must be async-signal safe
 
 extern int16 VSLDoInterruptService(uint32 arg1);
 extern void NQDMisc(uint32 arg1, uintptr arg2);
@@ -32,6 +32,9 @@
 #include "cpu/ppc/ppc-operations.hpp"
 #include "cpu/ppc/ppc-instructions.hpp"
 #include "thunks.h"
+#include "stats.h"
+#include "replay.h"
+#include "snapshot.h"
 
 // Used for NativeOp trampolines
 #include "video.h"
@@ -79,6 +82,9 @@ static uint32 macos_exec_count = 0;
 static clock_t macos_exec_time = 0;
 #endif
 
+// Mode transition statistics
+static void transition_stats_print(FILE *f);
+
 static void enter_mon(void)
 {
 	// Start up mon in real-mode
@@ -123,6 +129,165 @@ static uint8 *native_op_trampoline;
 #endif
 
 
+/*
+ *  Mode transition statistics ("stats" prefs item)
+ *
+ *  Every transition between PPC, 68k and native code is timed with
+ *  StatsTimestamp() and accounted to its entry point, to the NATIVE_OP
+ *  selector or A-Trap, and to its call site. Times are inclusive: a
+ *  NATIVE_OP calling back into Mac code also gets the time spent there.
+ *  Call sites are host return addresses for transitions started by
+ *  emulator code (use addr2line), the guest PC for EMUL_OPs and
+ *  interrupts, and the guest LR for NATIVE_OPs.
+ */
+
+enum {
+	TRANSITION_EMUL_OP,			// PPC -> EMUL_OP
+	TRANSITION_NATIVE_OP,		// PPC -> NATIVE_OP
+	TRANSITION_EXEC_68K,		// Execute68k()
+	TRANSITION_EXEC_68K_TRAP,	// Execute68kTrap()
+	TRANSITION_MACOS_CODE,		// call_macos*()
+	TRANSITION_INTERRUPT,		// Nanokernel interrupt
+	TRANSITION_MAX
+};
+
+static const char *transition_names[TRANSITION_MAX] = {
+	"EmulOp", "NativeOp", "Execute68k", "Execute68kTrap", "CallMacOS", "Interrupt"
+};
+
+static const char *native_op_names[NATIVE_OP_MAX] = {
+	"PATCH_NAME_REGISTRY", "VIDEO_INSTALL_ACCEL", "VIDEO_VBL", "VIDEO_DO_DRIVER_IO",
+	"ETHER_AO_GET_HWADDR", "ETHER_AO_ADD_MULTI", "ETHER_AO_DEL_MULTI", "ETHER_AO_SEND_PACKET",
+	"ETHER_IRQ", "ETHER_INIT", "ETHER_TERM", "ETHER_OPEN", "ETHER_CLOSE", "ETHER_WPUT", "ETHER_RSRV",
+	"SERIAL_NOTHING", "SERIAL_OPEN", "SERIAL_PRIME_IN", "SERIAL_PRIME_OUT", "SERIAL_CONTROL",
+	"SERIAL_STATUS", "SERIAL_CLOSE", "GET_RESOURCE", "GET_1_RESOURCE", "GET_IND_RESOURCE",
+	"GET_1_IND_RESOURCE", "R_GET_RESOURCE", "MAKE_EXECUTABLE", "CHECK_LOAD_INVOC",
+	"NQD_SYNC_HOOK", "NQD_BITBLT_HOOK", "NQD_FILLRECT_HOOK", "NQD_UNKNOWN_HOOK",
+	"NQD_BITBLT", "NQD_INVRECT", "NQD_FILLRECT", "NAMED_CHECK_LOAD_INVOC",
+	"GET_NAMED_RESOURCE", "GET_1_NAMED_RESOURCE", "BLOCK_MOVE", "BLOCK_MOVE_DATA", "BLOCK_ZERO",
+	"TICK_COUNT", "WAIT_NEXT_EVENT"
+};
+
+static stats_histogram transition_stats[TRANSITION_MAX];
+static stats_histogram native_op_stats[NATIVE_OP_MAX];
+static stats_histogram *trap_stats[0x1000];		// Allocated on first use
+
+struct transition_site {
+	uintptr addr;
+	uint32 type;				// TRANSITION_*
+	uint32 count;
+	uint64 time;
+};
+
+const int TRANSITION_SITES = 1024;				// Must be a power of two
+static transition_site transition_sites[TRANSITION_SITES];
+static uint32 transition_sites_dropped = 0;
+
+#ifdef __GNUC__
+#define TRANSITION_CALLER ((uintptr)__builtin_return_address(0))
+#else
+#define TRANSITION_CALLER ((uintptr)0)
+#endif
+
+static void transition_site_add(int type, uintptr addr, uint64 time)
+{
+	uint32 h = (uint32)(((addr >> 2) + type) * 2654435761u);
+	for (int i = 0; i < 16; i++) {
+		transition_site *s = &transition_sites[(h + i) & (TRANSITION_SITES - 1)];
+		if (s->count == 0) {
+			s->addr = addr;
+			s->type = type;
+		}
+		if (s->addr == addr && s->type == uint32(type)) {
+			s->count++;
+			s->time += time;
+			return;
+		}
+	}
+	transition_sites_dropped++;
+}
+
+// Times one transition from construction to destruction
+class transition_timer {
+	uint64 start;
+	uintptr site;
+	int type;
+	int sub;					// NATIVE_OP selector or A-Trap number, -1 = none
+public:
+	transition_timer(int t, uintptr caller, int s = -1)
+		: start(StatsEnabled ? StatsTimestamp() : 0), site(caller), type(t), sub(s)
+		{ }
+	~transition_timer();
+};
+
+transition_timer::~transition_timer()
+{
+	if (start == 0 || !StatsEnabled)
+		return;
+	uint64 time = StatsTimestamp() - start;
+	StatsHistogramAdd(&transition_stats[type], time);
+	if (type == TRANSITION_NATIVE_OP && sub >= 0 && sub < NATIVE_OP_MAX)
+		StatsHistogramAdd(&native_op_stats[sub], time);
+	else if (type == TRANSITION_EXEC_68K_TRAP && sub >= 0) {
+		stats_histogram *&h = trap_stats[sub & 0xfff];
+		if (h == NULL) {
+			h = new stats_histogram;
+			StatsHistogramReset(h);
+		}
+		StatsHistogramAdd(h, time);
+	}
+	transition_site_add(type, site, time);
+}
+
+static inline bool transition_from_guest(int type)
+{
+	return type == TRANSITION_EMUL_OP || type == TRANSITION_NATIVE_OP || type == TRANSITION_INTERRUPT;
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+	const transition_site *sa = (const transition_site *)a;
+	const transition_site *sb = (const transition_site *)b;
+	return sa->count < sb->count ? 1 : sa->count > sb->count ? -1 : 0;
+}
+
+static void transition_stats_print(FILE *f)
+{
+	for (int i = 0; i < TRANSITION_MAX; i++) {
+		fprintf(f, "%s:\n", transition_names[i]);
+		StatsHistogramPrint(f, &transition_stats[i], STATS_TIMESTAMP_UNIT);
+	}
+	for (int i = 0; i < NATIVE_OP_MAX; i++) {
+		if (native_op_stats[i].count == 0)
+			continue;
+		fprintf(f, "NativeOp %s:\n", native_op_names[i]);
+		StatsHistogramPrint(f, &native_op_stats[i], STATS_TIMESTAMP_UNIT);
+	}
+	for (int i = 0; i < 0x1000; i++) {
+		if (trap_stats[i] == NULL)
+			continue;
+		fprintf(f, "A-Trap %04x:\n", 0xa000 + i);
+		StatsHistogramPrint(f, trap_stats[i], STATS_TIMESTAMP_UNIT);
+	}
+
+	// Top call sites by number of transitions
+	transition_site *sites = new transition_site[TRANSITION_SITES];
+	int num_sites = 0;
+	for (int i = 0; i < TRANSITION_SITES; i++)
+		if (transition_sites[i].count)
+			sites[num_sites++] = transition_sites[i];
+	qsort(sites, num_sites, sizeof(transition_site), compare_sites);
+	fprintf(f, "Top call sites (%u transitions not recorded):\n", transition_sites_dropped);
+	for (int i = 0; i < num_sites && i < 20; i++) {
+		const transition_site *s = &sites[i];
+		fprintf(f, "  %-14s %s %p: %10u times, avg %llu %s\n", transition_names[s->type],
+			transition_from_guest(s->type) ? "guest" : "host ", (void *)s->addr, s->count,
+			(unsigned long long)(s->time / s->count), STATS_TIMESTAMP_UNIT);
+	}
+	delete[] sites;
+}
+
+
 /**
  *		PowerPC emulator glue with special 'sheep' opcodes
  **/
@@ -138,6 +303,22 @@ class sheepshaver_cpu
 	void init_decoder();
 	void execute_sheep(uint32 opcode);
 
+	// Caller state saved by execute_68k() and execute_macos_code(), one per nesting level
+	struct exec_context {
+		uint32 pc, lr, ctr, cr;
+		uint32 gpr[32 - 13];				// r13..r31, or r2 and arguments
+		double fpr[32];						// Saved lazily
+		double *outer_fpr_save_area;
+	};
+	static const int EXEC_CONTEXT_DEPTH = 64;
+	exec_context exec_contexts[EXEC_CONTEXT_DEPTH];
+	int exec_depth;
+	exec_context *push_exec_context();
+	void pop_exec_context() { exec_depth--; }
+
+	// Permanent trampoline with EXEC_RETURN, returns from execute()
+	uint32 exec_return_trampoline;
+
 public:
 
 	// Constructor
@@ -149,6 +330,12 @@ public:
 	uint32 get_xer() const		{ return xer().get(); }
 	void set_xer(uint32 v)		{ xer().set(v); }
 
+	// Snapshot support, only possible when no host code runs on behalf of the guest,
+	// i.e. outside of nested execute() calls (Execute68k(), CallMacOS(), execute_ppc(), ...)
+	int nesting_level() const	{ return get_execute_depth() - 1; }
+	void save_state(snapshot_cpu_state *s);
+	void restore_state(const snapshot_cpu_state *s);
+
 	// Execute NATIVE_OP routine
 	void execute_native_op(uint32 native_op);
 
@@ -181,11 +368,58 @@ public:
 sheepshaver_cpu::sheepshaver_cpu()
 {
 	init_decoder();
+	exec_depth = 0;
+	exec_return_trampoline = SheepMem::ReserveProc(4);
+	WriteMacInt32(exec_return_trampoline, POWERPC_EXEC_RETURN);
 
 #if PPC_ENABLE_JIT
-	if (PrefsFindBool("jit"))
-		enable_jit();
+	// Event record/replay counts guest blocks, which needs the block dispatcher
+	if (PrefsFindBool("jit") && ReplayMode == REPLAY_OFF)
+		enable_jit(0, HugePagesEnabled);
 #endif
+	if (ReplayMode != REPLAY_OFF)
+		spcflags().set(SPCFLAG_CPU_EVENT_STEP);
+	ZeroedPageTracking = ZeroPageReclaim;
+}
+
+/*
+ *  Save and restore registers for snapshots
+ */
+
+void sheepshaver_cpu::save_state(snapshot_cpu_state *s)
+{
+	for (int i = 0; i < 32; i++) {
+		s->gpr[i] = gpr(i);
+		s->fpr[i] = fpr_dw(i);
+		for (int j = 0; j < 4; j++)
+			s->vr[i][j] = vr(i).w[j];
+	}
+	s->cr = cr().get();
+	s->xer = xer().get();
+	s->vscr = vscr().get();
+	s->vrsave = vrsave();
+	s->fpscr = fpscr();
+	s->lr = lr();
+	s->ctr = ctr();
+	s->pc = pc();
+}
+
+void sheepshaver_cpu::restore_state(const snapshot_cpu_state *s)
+{
+	for (int i = 0; i < 32; i++) {
+		gpr(i) = s->gpr[i];
+		fpr_dw(i) = s->fpr[i];
+		for (int j = 0; j < 4; j++)
+			vr(i).w[j] = s->vr[i][j];
+	}
+	cr().set(s->cr);
+	xer().set(s->xer);
+	vscr().set(s->vscr);
+	vrsave() = s->vrsave;
+	fpscr() = s->fpscr;
+	lr() = s->lr;
+	ctr() = s->ctr;
+	pc() = s->pc;
 }
 
 void sheepshaver_cpu::init_decoder()
@@ -217,10 +451,12 @@ void sheepshaver_cpu::init_decoder()
 typedef bit_field< 19, 19 > FN_field;
 typedef bit_field< 20, 25 > NATIVE_OP_field;
 typedef bit_field< 26, 31 > EMUL_OP_field;
+typedef bit_field< 14, 25 > PROFILE_field;
 
 // Execute EMUL_OP routine
 void sheepshaver_cpu::execute_emul_op(uint32 emul_op)
 {
+	transition_timer timer(TRANSITION_EMUL_OP, pc());
 	M68kRegisters r68;
 	WriteMacInt32(XLM_68K_R25, gpr(25));
 	WriteMacInt32(XLM_RUN_MODE, MODE_EMUL_OP);
@@ -246,7 +482,7 @@ void sheepshaver_cpu::execute_emul_op(uint32 emul_op)
 void sheepshaver_cpu::execute_sheep(uint32 opcode)
 {
 //	D(bug("Extended opcode %08x at %08x (68k pc %08x)\n", opcode, pc(), gpr(24)));
-	assert((((opcode >> 26) & 0x3f) == 6) && OP_MAX <= 64 + 3);
+	assert((((opcode >> 26) & 0x3f) == 6) && OP_MAX + 3 <= (POWERPC_LIB_PROFILE & 0x3f));
 
 	switch (opcode & 0x3f) {
 	case 0:		// EMUL_RETURN
@@ -254,6 +490,8 @@ void sheepshaver_cpu::execute_sheep(uint32 opcode)
 		break;
 
 	case 1:		// EXEC_RETURN
+		// There is no direct return path, execute() only unwinds through
+		// check_spcflags(), which tests this flag first
 		spcflags().set(SPCFLAG_CPU_EXEC_RETURN);
 		break;
 
@@ -265,6 +503,23 @@ void sheepshaver_cpu::execute_sheep(uint32 opcode)
 			pc() += 4;
 		break;
 
+	case POWERPC_LIB_PROFILE & 0x3f: {
+		int index = PROFILE_field::extract(opcode);
+		if (index == TRAP_PROFILE_LIB_RETURN)
+			pc() = TrapProfileLibReturn(pc());
+		else
+			pc() = TrapProfileLibCall(index, &lr());
+		break;
+	}
+
+	case POWERPC_ATRAP_PROFILE & 0x3f: {
+		// The trap returns to the 68k PC in r24, r27 holds the prefetched word there
+		uint32 trap_opcode = TrapProfileATrap(PROFILE_field::extract(opcode), &gpr(24));
+		gpr(27) = (int32)(int16)ReadMacInt16(gpr(24));
+		execute_opcode(trap_opcode);
+		break;
+	}
+
 	default:	// EMUL_OP
 		execute_emul_op(EMUL_OP_field::extract(opcode) - 3);
 		pc() += 4;
@@ -300,7 +555,9 @@ int sheepshaver_cpu::compile1(codegen_context_t & cg_context)
 
 	case 2: {	// EXEC_NATIVE
 		uint32 selector = NATIVE_OP_field::extract(opcode);
-		switch (selector) {
+		// Keep NativeOps out of line when collecting statistics, so
+		// that execute_native_op() gets to see all of them
+		if (!StatsEnabled) switch (selector) {
 #if !PPC_REENTRANT_JIT
 		// Filter out functions that may invoke Execute68k() or
 		// CallMacOS(), this would break reentrancy as they could
@@ -432,6 +689,12 @@ int sheepshaver_cpu::compile1(codegen_context_t & cg_context)
 #endif
 	}
 
+	case POWERPC_LIB_PROFILE & 0x3f:
+	case POWERPC_ATRAP_PROFILE & 0x3f:
+		// Let it generate a call to execute_sheep() which will update
+		// the program counter
+		break;
+
 	default: {	// EMUL_OP
 		uint32 emul_op = EMUL_OP_field::extract(opcode) - 3;
 #if PPC_REENTRANT_JIT
@@ -464,6 +727,7 @@ void sheepshaver_cpu::interrupt(uint32 entry)
 	ppc_interrupt_count++;
 	const clock_t interrupt_start = clock();
 #endif
+	transition_timer timer(TRANSITION_INTERRUPT, entry);
 
 	// Save program counters and branch registers
 	uint32 saved_pc = pc();
@@ -474,9 +738,6 @@ void sheepshaver_cpu::interrupt(uint32 entry)
 	// Initialize stack pointer to SheepShaver alternate stack base
 	gpr(1) = SignalStackBase() - 64;
 
-	// Build trampoline to return from interrupt
-	SheepVar32 trampoline = POWERPC_EXEC_RETURN;
-
 	// Prepare registers for nanokernel interrupt routine
 	kernel_data->v[0x004 >> 2] = htonl(gpr(1));
 	kernel_data->v[0x018 >> 2] = htonl(gpr(6));
@@ -494,8 +755,8 @@ void sheepshaver_cpu::interrupt(uint32 entry)
 	gpr(1)  = KernelDataAddr;
 	gpr(7)  = ntohl(kernel_data->v[0x660 >> 2]);
 	gpr(8)  = 0;
-	gpr(10) = trampoline.addr();
-	gpr(12) = trampoline.addr();
+	gpr(10) = exec_return_trampoline;		// Return from interrupt
+	gpr(12) = exec_return_trampoline;
 	gpr(13) = get_cr();
 
 	// rlwimi. r7,r7,8,0,0
@@ -520,6 +781,17 @@ void sheepshaver_cpu::interrupt(uint32 entry)
 #endif
 }
 
+// Get caller state save area for next nesting level
+sheepshaver_cpu::exec_context *sheepshaver_cpu::push_exec_context()
+{
+	if (exec_depth == EXEC_CONTEXT_DEPTH) {
+		printf("FATAL: Execute68k()/CallMacOS() nested too deeply\n");
+		QuitEmulator();
+		abort();	// In case QuitEmulator() returns, don't write past the stack
+	}
+	return &exec_contexts[exec_depth++];
+}
+
 // Execute 68k routine
 void sheepshaver_cpu::execute_68k(uint32 entry, M68kRegisters *r)
 {
@@ -534,10 +806,11 @@ void sheepshaver_cpu::execute_68k(uint32 entry, M68kRegisters *r)
 #endif
 
 	// Save program counters and branch registers
-	uint32 saved_pc = pc();
-	uint32 saved_lr = lr();
-	uint32 saved_ctr= ctr();
-	uint32 saved_cr = get_cr();
+	exec_context *ctx = push_exec_context();
+	ctx->pc = pc();
+	ctx->lr = lr();
+	ctx->ctr = ctr();
+	ctx->cr = get_cr();
 
 	// Create MacOS stack frame
 	// FIXME: make sure MacOS doesn't expect PPC registers to live on top
@@ -546,11 +819,16 @@ void sheepshaver_cpu::execute_68k(uint32 entry, M68kRegisters *r)
 	WriteMacInt32(gpr(1), sp);
 
 	// Save PowerPC registers
-	uint32 saved_GPRs[19];
-	memcpy(&saved_GPRs[0], &gpr(13), sizeof(uint32)*(32-13));
+	memcpy(&ctx->gpr[0], &gpr(13), sizeof(uint32)*(32-13));
 #if SAVE_FP_EXEC_68K
-	double saved_FPRs[18];
-	memcpy(&saved_FPRs[0], &fpr(14), sizeof(double)*(32-14));
+	ctx->outer_fpr_save_area = fpr_save_area;
+#if PPC_ENABLE_JIT && PPC_REENTRANT_JIT
+	// Translated code doesn't call fpr_will_change()
+	memcpy(&ctx->fpr[0], &fpr(0), sizeof(double)*32);
+#else
+	// Nested execute() calls are interpreted, FPRs are saved on first change
+	fpr_save_area = &ctx->fpr[0];
+#endif
 #endif
 
 	// Setup registers for 68k emulator
@@ -597,19 +875,22 @@ void sheepshaver_cpu::execute_68k(uint32 entry, M68kRegisters *r)
 	  r->a[i] = gpr(16 + i);
 
 	// Restore PowerPC registers
-	memcpy(&gpr(13), &saved_GPRs[0], sizeof(uint32)*(32-13));
+	memcpy(&gpr(13), &ctx->gpr[0], sizeof(uint32)*(32-13));
 #if SAVE_FP_EXEC_68K
-	memcpy(&fpr(14), &saved_FPRs[0], sizeof(double)*(32-14));
+	if (fpr_save_area != &ctx->fpr[0])			// Saved, so they may have changed
+		memcpy(&fpr(0), &ctx->fpr[0], sizeof(double)*32);
+	fpr_save_area = ctx->outer_fpr_save_area;
 #endif
 
 	// Cleanup stack
 	gpr(1) += 56;
 
 	// Restore program counters and branch registers
-	pc() = saved_pc;
-	lr() = saved_lr;
-	ctr()= saved_ctr;
-	set_cr(saved_cr);
+	pc() = ctx->pc;
+	lr() = ctx->lr;
+	ctr()= ctx->ctr;
+	set_cr(ctx->cr);
+	pop_exec_context();
 
 #if EMUL_TIME_STATS
 	exec68k_time += (clock() - exec68k_start);
@@ -625,20 +906,20 @@ uint32 sheepshaver_cpu::execute_macos_code(uint32 tvect, int nargs, uint32 const
 #endif
 
 	// Save program counters and branch registers
-	uint32 saved_pc = pc();
-	uint32 saved_lr = lr();
-	uint32 saved_ctr= ctr();
+	exec_context *ctx = push_exec_context();
+	ctx->pc = pc();
+	ctx->lr = lr();
+	ctx->ctr = ctr();
 
-	// Build trampoline with EXEC_RETURN
-	SheepVar32 trampoline = POWERPC_EXEC_RETURN;
-	lr() = trampoline.addr();
+	// Return through EXEC_RETURN trampoline
+	lr() = exec_return_trampoline;
 
 	gpr(1) -= 64;								// Create stack frame
 	uint32 proc = ReadMacInt32(tvect);			// Get routine address
 	uint32 toc = ReadMacInt32(tvect + 4);		// Get TOC pointer
 
 	// Save PowerPC registers
-	uint32 regs[8];
+	uint32 *regs = ctx->gpr;
 	regs[0] = gpr(2);
 	for (int i = 0; i < nargs; i++)
 		regs[i + 1] = gpr(i + 3);
@@ -658,9 +939,10 @@ uint32 sheepshaver_cpu::execute_macos_code(uint32 tvect, int nargs, uint32 const
 	gpr(1) += 64;
 
 	// Restore program counters and branch registers
-	pc() = saved_pc;
-	lr() = saved_lr;
-	ctr()= saved_ctr;
+	pc() = ctx->pc;
+	lr() = ctx->lr;
+	ctr()= ctx->ctr;
+	pop_exec_context();
 
 #if EMUL_TIME_STATS
 	macos_exec_time += (clock() - macos_exec_start);
@@ -675,9 +957,7 @@ inline void sheepshaver_cpu::execute_ppc(uint32 entry)
 	// Save branch registers
 	uint32 saved_lr = lr();
 
-	SheepVar32 trampoline = POWERPC_EXEC_RETURN;
-	WriteMacInt32(trampoline.addr(), POWERPC_EXEC_RETURN);
-	lr() = trampoline.addr();
+	lr() = exec_return_trampoline;
 
 	execute(entry);
 
@@ -759,8 +1039,11 @@ sigsegv_return_t sigsegv_handler(sigsegv_info_t *sip)
 #if ENABLE_VOSF
 	// Handle screen fault
 	extern bool Screen_fault_handler(sigsegv_info_t *sip);
-	if (Screen_fault_handler(sip))
+	if (Screen_fault_handler(sip)) {
+		if (video_damage_hook)
+			video_damage_hook();
 		return SIGSEGV_RETURN_SUCCESS;
+	}
 #endif
 
 	const uintptr addr = (uintptr)sigsegv_get_fault_address(sip);
@@ -850,6 +1133,8 @@ void init_emul_ppc(void)
 #if EMUL_TIME_STATS
 	emul_start_time = clock();
 #endif
+
+	StatsRegister("mode transitions", transition_stats_print);
 }
 
 /*
@@ -923,6 +1208,12 @@ void emul_ppc(uint32 entry)
 #if 0
 	ppc_cpu->start_log();
 #endif
+	// Resume where the snapshot was taken instead of booting
+	if (SnapshotRestored) {
+		ppc_cpu->restore_state(&SnapshotCPU);
+		entry = SnapshotCPU.pc;
+	}
+
 	// start emulation loop and enable code translation or caching
 	ppc_cpu->execute(entry);
 }
@@ -933,6 +1224,10 @@ void emul_ppc(uint32 entry)
 
 void TriggerInterrupt(void)
 {
+	// Only logged interrupts are delivered in event replay mode
+	if (ReplayMode == REPLAY_PLAY)
+		return;
+
 	idle_resume();
 #if 0
   WriteMacInt32(0x16a, ReadMacInt32(0x16a) + 1);
@@ -943,16 +1238,42 @@ void TriggerInterrupt(void)
 #endif
 }
 
-void HandleInterrupt(powerpc_registers *r)
+// Called by translated code detected as a spin loop
+void HandleSpinLoop(void)
+{
+	IdlePoll();
+}
+
+// Called by dcbz when the last cache line of a page was cleared
+bool ZeroedPageTracking = false;
+
+void HandleZeroedPage(uint32 addr)
+{
+	ZeroPageAdd(addr);
+}
+
+void HandleInterrupt(powerpc_interrupt_frame *r)
 {
 #ifdef USE_SDL_VIDEO
 	// We must fill in the events queue in the same thread that did call SDL_SetVideoMode()
 	SDL_PumpEvents();
 #endif
 
+	// Registers still hold the interrupted state here
+	if (SnapshotPending) {
+		ppc_cpu->save_state(&SnapshotCPU);
+		SnapshotSafePoint(ppc_cpu->nesting_level());
+	}
+
+	// Make interrupt flags visible at a reproducible point
+	if (ReplayMode != REPLAY_OFF)
+		ReplayInterrupt();
+
 	// Do nothing if interrupts are disabled
-	if (int32(ReadMacInt32(XLM_IRQ_NEST)) > 0)
+	if (int32(ReadMacInt32(XLM_IRQ_NEST)) > 0) {
+		InterruptStatsDefer(InterruptFlags, IRQ_DEFER_NEST);
 		return;
+	}
 
 	// Update interrupt count
 #if EMUL_TIME_STATS
@@ -985,6 +1306,8 @@ void HandleInterrupt(powerpc_registers *r)
 			else
 				ppc_cpu->interrupt(ROMBase + 0x312a3c);
 		}
+		else
+			InterruptStatsDefer(InterruptFlags, IRQ_DEFER_MODE);
 		break;
 #endif
     
@@ -1025,6 +1348,8 @@ void HandleInterrupt(powerpc_registers *r)
 			interrupt_time += (clock() - interrupt_start);
 #endif
 		}
+		else
+			InterruptStatsDefer(InterruptFlags, IRQ_DEFER_MODE);
 		break;
 #endif
 	}
@@ -1037,6 +1362,7 @@ void sheepshaver_cpu::execute_native_op(uint32 selector)
 	native_exec_count++;
 	const clock_t native_exec_start = clock();
 #endif
+	transition_timer timer(TRANSITION_NATIVE_OP, lr(), selector);
 
 	switch (selector) {
 	case NATIVE_PATCH_NAME_REGISTRY:
@@ -1143,6 +1469,21 @@ void sheepshaver_cpu::execute_native_op(uint32 selector)
 	case NATIVE_MAKE_EXECUTABLE:
 		MakeExecutable(0, gpr(4), gpr(5));
 		break;
+	case NATIVE_BLOCK_MOVE:
+		Mac_BlockMove(gpr(3), gpr(4), gpr(5));
+		break;
+	case NATIVE_BLOCK_MOVE_DATA:
+		Mac_BlockMoveData(gpr(3), gpr(4), gpr(5));
+		break;
+	case NATIVE_BLOCK_ZERO:
+		Mac_BlockZero(gpr(3), gpr(4));
+		break;
+	case NATIVE_TICK_COUNT:
+		gpr(3) = IdleTickCount();
+		break;
+	case NATIVE_WAIT_NEXT_EVENT:
+		IdleWaitNextEvent(gpr(5));
+		break;
 	case NATIVE_CHECK_LOAD_INVOC:
 		check_load_invoc(gpr(3), gpr(4), gpr(5));
 		break;
@@ -1168,6 +1509,7 @@ void sheepshaver_cpu::execute_native_op(uint32 selector)
 
 void Execute68k(uint32 pc, M68kRegisters *r)
 {
+	transition_timer timer(TRANSITION_EXEC_68K, TRANSITION_CALLER);
 	ppc_cpu->execute_68k(pc, r);
 }
 
@@ -1182,7 +1524,8 @@ void Execute68kTrap(uint16 trap, M68kRegisters *r)
 	uint32 proc = proc_var.addr();
 	WriteMacInt16(proc, trap);
 	WriteMacInt16(proc + 2, M68K_RTS);
-	Execute68k(proc, r);
+	transition_timer timer(TRANSITION_EXEC_68K_TRAP, TRANSITION_CALLER, trap);
+	ppc_cpu->execute_68k(proc, r);
 }
 
 /*
@@ -1191,47 +1534,55 @@ void Execute68kTrap(uint16 trap, M68kRegisters *r)
 
 uint32 call_macos(uint32 tvect)
 {
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, 0, NULL);
 }
 
 uint32 call_macos1(uint32 tvect, uint32 arg1)
 {
 	const uint32 args[] = { arg1 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
 
 uint32 call_macos2(uint32 tvect, uint32 arg1, uint32 arg2)
 {
 	const uint32 args[] = { arg1, arg2 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
 
 uint32 call_macos3(uint32 tvect, uint32 arg1, uint32 arg2, uint32 arg3)
 {
 	const uint32 args[] = { arg1, arg2, arg3 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
 
 uint32 call_macos4(uint32 tvect, uint32 arg1, uint32 arg2, uint32 arg3, uint32 arg4)
 {
 	const uint32 args[] = { arg1, arg2, arg3, arg4 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
 
 uint32 call_macos5(uint32 tvect, uint32 arg1, uint32 arg2, uint32 arg3, uint32 arg4, uint32 arg5)
 {
 	const uint32 args[] = { arg1, arg2, arg3, arg4, arg5 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
 
 uint32 call_macos6(uint32 tvect, uint32 arg1, uint32 arg2, uint32 arg3, uint32 arg4, uint32 arg5, uint32 arg6)
 {
 	const uint32 args[] = { arg1, arg2, arg3, arg4, arg5, arg6 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
 
 uint32 call_macos7(uint32 tvect, uint32 arg1, uint32 arg2, uint32 arg3, uint32 arg4, uint32 arg5, uint32 arg6, uint32 arg7)
 {
 	const uint32 args[] = { arg1, arg2, arg3, arg4, arg5, arg6, arg7 };
+	transition_timer timer(TRANSITION_MACOS_CODE, TRANSITION_CALLER);
 	return ppc_cpu->execute_macos_code(tvect, sizeof(args)/sizeof(args[0]), args);
 }
@@ -22,6 +22,10 @@
 #include "vm_alloc.h"
 #include "cpu/jit/jit-cache.hpp"
 
+#ifdef HAVE_MADVISE
+#include <sys/mman.h>
+#endif
+
 #define DEBUG 0
 #include "debug.h"
 
@@ -35,8 +39,11 @@ const int JIT_CACHE_SIZE = 8 * 1024;
 #endif
 const int JIT_CACHE_SIZE_GUARD = 4096;
 
+// Large page size for the translation cache
+const uint32 JIT_CACHE_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
 basic_jit_cache::basic_jit_cache()
-	: cache_size(0), tcode_start(NULL), code_start(NULL), code_p(NULL), code_end(NULL), data(NULL)
+	: cache_size(0), huge_pages(false), tcode_start(NULL), code_start(NULL), code_p(NULL), code_end(NULL), data(NULL)
 {
 }
 
@@ -64,11 +71,15 @@ basic_jit_cache::init_translation_cache(uint32 size)
 	cache_size = (size + JIT_CACHE_SIZE_GUARD + roundup - 1) & -roundup;
 	assert(cache_size > 0);
 
-	tcode_start = (uint8 *)vm_acquire(cache_size, VM_MAP_PRIVATE | VM_MAP_32BIT);
-	if (tcode_start == VM_MAP_FAILED) {
-		tcode_start = NULL;
-		return false;
+	if (huge_pages)
+		tcode_start = acquire_huge_pages();
+	else {
+		tcode_start = (uint8 *)vm_acquire(cache_size, VM_MAP_PRIVATE | VM_MAP_32BIT);
+		if (tcode_start == VM_MAP_FAILED)
+			tcode_start = NULL;
 	}
+	if (tcode_start == NULL)
+		return false;
 
 	if (vm_protect(tcode_start, cache_size,
 				   VM_PAGE_READ | VM_PAGE_WRITE | VM_PAGE_EXECUTE) < 0) {
@@ -84,6 +95,36 @@ basic_jit_cache::init_translation_cache(uint32 size)
 	return true;
 }
 
+// Allocate translation cache on 2 MB boundaries and ask for transparent huge pages,
+// returns NULL if the cache could not be allocated at all
+uint8 *
+basic_jit_cache::acquire_huge_pages()
+{
+	const uint32 huge_size = JIT_CACHE_HUGE_PAGE_SIZE;
+	uint32 size = (cache_size + huge_size - 1) & -huge_size;
+	uint8 *ptr = (uint8 *)vm_acquire(size + huge_size, VM_MAP_PRIVATE | VM_MAP_32BIT);
+	if (ptr == VM_MAP_FAILED)
+		return NULL;
+
+	// Trim the unaligned head and tail
+	uint8 *start = (uint8 *)(((uintptr)ptr + huge_size - 1) & -(uintptr)huge_size);
+	if (start > ptr)
+		vm_release(ptr, start - ptr);
+	if (start + size < ptr + size + huge_size)
+		vm_release(start + size, (ptr + size + huge_size) - (start + size));
+	cache_size = size;
+
+	bool advised = false;
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+	advised = madvise(start, size, MADV_HUGEPAGE) == 0;
+#endif
+	if (advised)
+		printf("Translation cache: %d KB on 2 MB pages\n", size / 1024);
+	else
+		printf("WARNING: Huge pages not available for translation cache, using normal pages\n");
+	return start;
+}
+
 void
 basic_jit_cache::kill_translation_cache()
 {
@@ -32,6 +32,7 @@ class basic_jit_cache
 {
 	// Translation cache (allocated base, current pointer, end pointer)
 	uint32 cache_size;
+	bool huge_pages;
 	uint8 *tcode_start;
 	uint8 *code_start;
 	uint8 *code_p;
@@ -50,6 +51,7 @@ protected:
 	// Initialize translation cache
 	bool init_translation_cache(uint32 size);
 	void kill_translation_cache();
+	uint8 *acquire_huge_pages();
 
 	// Initialize user code start
 	void set_code_start(uint8 *ptr);
@@ -68,6 +70,7 @@ public:
 
 	bool initialize(void);
 	void set_cache_size(uint32 size);
+	void set_huge_pages(bool enable)	{ huge_pages = enable; }
 
 	// Invalidate translation cache
 	void invalidate_cache();
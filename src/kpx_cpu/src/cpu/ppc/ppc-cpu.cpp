@@ -28,6 +28,10 @@
 #include "basic-kernel.hpp"
 #endif
 
+#ifdef SHEEPSHAVER
+#include "replay.h"
+#endif
+
 #if PPC_ENABLE_JIT
 #include "cpu/jit/dyngen-exec.h"
 #endif
@@ -114,12 +118,6 @@ any_register powerpc_cpu::get_register(int id)
 	return value;
 }
 
-#if KPX_MAX_CPUS != 1
-uint32 powerpc_registers::reserve_valid = 0;
-uint32 powerpc_registers::reserve_addr = 0;
-uint32 powerpc_registers::reserve_data = 0;
-#endif
-
 void powerpc_cpu::init_registers()
 {
 	assert((((uintptr)&vr(0)) % 16) == 0);
@@ -263,6 +261,10 @@ void powerpc_cpu::initialize()
 	init_registers();
 	init_decode_cache();
 	execute_depth = 0;
+	fpr_save_area = NULL;
+#ifdef SHEEPSHAVER
+	processing_interrupt = false;
+#endif
 
 	// Initialize block lookup table
 #if PPC_DECODE_CACHE || PPC_ENABLE_JIT
@@ -303,9 +305,10 @@ void powerpc_cpu::initialize()
 }
 
 #if PPC_ENABLE_JIT
-void powerpc_cpu::enable_jit(uint32 cache_size)
+void powerpc_cpu::enable_jit(uint32 cache_size, bool huge_pages)
 {
 	use_jit = true;
+	codegen.set_huge_pages(huge_pages);
 	if (cache_size)
 		codegen.set_cache_size(cache_size);
 	codegen.initialize();
@@ -475,30 +478,51 @@ void powerpc_cpu::fake_dump_registers(uint32)
 	dump_registers();
 }
 
-void powerpc_registers::interrupt_copy(powerpc_registers &oregs, powerpc_registers const &iregs)
+void powerpc_interrupt_frame::save(powerpc_registers const &regs)
 {
-	for (int i = 0; i < 32; i++) {
-		oregs.gpr[i] = iregs.gpr[i];
-		oregs.fpr[i] = iregs.fpr[i];
+	memcpy(gpr, regs.gpr, sizeof(gpr));
+	cr		= regs.cr;
+	xer		= regs.xer;
+	fpscr	= regs.fpscr;
+	lr		= regs.lr;
+	ctr		= regs.ctr;
+	pc		= regs.pc;
+
+	vrsave	= regs.vrsave;
+	if (vrsave) {
+		for (int i = 0; i < 32; i++) {
+			if (vrsave & (0x80000000 >> i))
+				vr[i] = regs.vr[i];
+		}
 	}
-	oregs.cr	= iregs.cr;
-	oregs.fpscr	= iregs.fpscr;
-	oregs.xer	= iregs.xer;
-	oregs.lr	= iregs.lr;
-	oregs.ctr	= iregs.ctr;
-	oregs.pc	= iregs.pc;
-
-	uint32 vrsave = iregs.vrsave;
-	oregs.vrsave  = vrsave;
+}
+
+void powerpc_interrupt_frame::restore(powerpc_registers &regs) const
+{
+	memcpy(regs.gpr, gpr, sizeof(gpr));
+	regs.cr		= cr;
+	regs.xer	= xer;
+	regs.fpscr	= fpscr;
+	regs.lr		= lr;
+	regs.ctr	= ctr;
+	regs.pc		= pc;
+
+	regs.vrsave	= vrsave;
 	if (vrsave) {
-		for (int i = 31; i >= 0; i--) {
-			if (vrsave & 1)
-				oregs.vr[i] = iregs.vr[i];
-			vrsave >>= 1;
+		for (int i = 0; i < 32; i++) {
+			if (vrsave & (0x80000000 >> i))
+				regs.vr[i] = vr[i];
 		}
 	}
 }
 
+void powerpc_cpu::save_fprs()
+{
+	for (int i = 0; i < 32; i++)
+		fpr_save_area[i] = fpr(i);
+	fpr_save_area = NULL;
+}
+
 bool powerpc_cpu::check_spcflags()
 {
 	if (spcflags().test(SPCFLAG_CPU_EXEC_RETURN)) {
@@ -506,15 +530,32 @@ bool powerpc_cpu::check_spcflags()
 		return false;
 	}
 #ifdef SHEEPSHAVER
+	if (spcflags().test(SPCFLAG_CPU_EVENT_STEP)) {
+		if (ReplayCheckpoint())
+			spcflags().set(SPCFLAG_CPU_HANDLE_INTERRUPT);
+	}
 	if (spcflags().test(SPCFLAG_CPU_HANDLE_INTERRUPT)) {
 		spcflags().clear(SPCFLAG_CPU_HANDLE_INTERRUPT);
-		static bool processing_interrupt = false;
 		if (!processing_interrupt) {
 			processing_interrupt = true;
-			powerpc_registers r;
-			powerpc_registers::interrupt_copy(r, regs());
+			powerpc_interrupt_frame & r = interrupt_frame;
+			r.save(regs());
+			double *outer_fpr_save_area = fpr_save_area;
+#if PPC_ENABLE_JIT && PPC_REENTRANT_JIT
+			// Translated code doesn't call fpr_will_change()
+			for (int i = 0; i < 32; i++)
+				r.fpr[i] = fpr(i);
+#else
+			// Handlers run in nested execute() calls, which are interpreted
+			fpr_save_area = r.fpr;
+#endif
 			HandleInterrupt(&r);
-			powerpc_registers::interrupt_copy(regs(), r);
+			r.restore(regs());
+			if (fpr_save_area != r.fpr) {
+				for (int i = 0; i < 32; i++)
+					fpr(i) = r.fpr[i];
+			}
+			fpr_save_area = outer_fpr_save_area;
 			processing_interrupt = false;
 		}
 	}
@@ -116,6 +116,13 @@ public:
 	powerpc_vr & vr(int i)		{ return regs().vr[i]; }
 	powerpc_vr const & vr(int i) const { return regs().vr[i]; }
 
+	// Lazy saving of FPRs: if fpr_save_area is set, all 32 FPRs are
+	// copied there before the interpreter first modifies one of them
+	double *fpr_save_area;
+	void fpr_will_change()
+		{ if (fpr_save_area) save_fprs(); }
+	void save_fprs();
+
 protected:
 
 	// Condition codes management
@@ -249,6 +256,12 @@ private:
 	// Current execute() nested level
 	int execute_depth;
 
+#ifdef SHEEPSHAVER
+	// Interrupt handler state, handlers don't nest
+	bool processing_interrupt;
+	powerpc_interrupt_frame interrupt_frame;
+#endif
+
 public:
 
 	// Initialization & finalization
@@ -286,6 +299,9 @@ public:
 	void execute(uint32 entry);
 	void execute();
 
+	// Number of execute() calls in progress
+	int get_execute_depth() const { return execute_depth; }
+
 	// Interrupts handling
 	void trigger_interrupt();
 	
@@ -309,6 +325,11 @@ protected:
 	// Init decoder with one instruction info
 	void init_decoder_entry(const instr_info_t * ii);
 
+#ifdef SHEEPSHAVER
+	// Interpret one opcode as if it was found at pc()
+	void execute_opcode(uint32 opcode) { decode(opcode)->execute(this, opcode); }
+#endif
+
 #if PPC_ENABLE_JIT
 	// Dynamic translation engine
 	struct codegen_context_t {
@@ -334,7 +355,7 @@ protected:
 
 	bool use_jit;
 public:
-	void enable_jit(uint32 cache_size = 0);
+	void enable_jit(uint32 cache_size = 0, bool huge_pages = false);
 #endif
 
 private:
@@ -508,7 +529,10 @@ inline void powerpc_cpu::trigger_interrupt()
 }
 
 #ifdef SHEEPSHAVER
-extern void HandleInterrupt(powerpc_registers *r);
+extern void HandleInterrupt(powerpc_interrupt_frame *r);
+extern void HandleSpinLoop(void);
+extern bool ZeroedPageTracking;			// Flag: report pages cleared with dcbz
+extern void HandleZeroedPage(uint32 addr);
 #endif
 
 #endif /* PPC_CPU_H */
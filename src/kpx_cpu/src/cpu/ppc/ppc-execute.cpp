@@ -38,6 +38,7 @@
 #ifdef SHEEPSHAVER
 #include "main.h"
 #include "prefs.h"
+#include "replay.h"
 #endif
 
 #if ENABLE_MON
@@ -759,16 +760,20 @@ void powerpc_cpu::execute_stwcx(uint32 opcode)
 	const uint32 ea = RA::get(this, opcode) + operand_RB::get(this, opcode);
 	cr().clear(0);
 	if (regs().reserve_valid) {
-		if (regs().reserve_addr == ea /* physical_addr(EA) */
-#if KPX_MAX_CPUS != 1
-			/* HACK: if another processor wrote to the reserved block,
-			   nothing happens, i.e. we should operate as if reserve == 0 */
-			&& regs().reserve_data == vm_read_memory_4(ea)
-#endif
-			) {
+#if KPX_MAX_CPUS == 1
+		if (regs().reserve_addr == ea /* physical_addr(EA) */) {
 			vm_write_memory_4(ea, operand_RS::get(this, opcode));
 			cr().set(0, standalone_CR_EQ_field::mask());
 		}
+#else
+		/* Each processor has its own reservation. If another processor
+		   wrote to the reserved word, the store must fail: approximate
+		   this by an atomic compare-and-swap with the value loaded by
+		   lwarx (an A-B-A sequence by the other processor is missed) */
+		if (regs().reserve_addr == ea /* physical_addr(EA) */
+			&& vm_compare_and_swap_memory_4(ea, regs().reserve_data, operand_RS::get(this, opcode)))
+			cr().set(0, standalone_CR_EQ_field::mask());
+#endif
 		regs().reserve_valid = 0;
 	}
 	cr().set_so(0, xer().get_so());
@@ -1212,6 +1217,8 @@ static inline uint64 get_tb_ticks(void)
 #ifdef SHEEPSHAVER
 	const uint32 TBFreq = TimebaseSpeed;
 	ticks = muldiv64(GetTicks_usec(), TBFreq, 1000000);
+	if (ReplayMode != REPLAY_OFF)
+		ReplayValue(REPLAY_EV_TIMEBASE, &ticks, sizeof(ticks));
 #else
 	const uint32 TBFreq = 25 * 1000 * 1000; // 25 MHz
 	ticks = muldiv64((uint64)clock(), TBFreq, CLOCKS_PER_SEC);
@@ -1280,6 +1287,11 @@ void powerpc_cpu::execute_dcbz(uint32 opcode)
 {
 	uint32 ea = RA::get(this, opcode) + RB::get(this, opcode);
 	vm_memset(ea - (ea % 32), 0, 32);
+#ifdef SHEEPSHAVER
+	// Page cleared in ascending order, let the host check and reclaim it
+	if (ZeroedPageTracking && (ea & 0xfe0) == 0xfe0)
+		HandleZeroedPage(ea & -4096);
+#endif
 	increment_pc(4);
 }
 
@@ -114,7 +114,9 @@ struct input_fpr {
 template< class field >
 struct output_fpr {
 	static inline void set(powerpc_cpu * cpu, uint32 opcode, double value) {
-		cpu->fpr(field::extract(opcode)) = value;
+		const int i = field::extract(opcode);
+		cpu->fpr_will_change();
+		cpu->fpr(i) = value;
 	}
 };
 
@@ -131,7 +133,9 @@ struct input_fpr_dw {
 template< class field >
 struct output_fpr_dw {
 	static inline void set(powerpc_cpu * cpu, uint32 opcode, uint64 value) {
-		cpu->fpr_dw(field::extract(opcode)) = value;
+		const int i = field::extract(opcode);
+		cpu->fpr_will_change();
+		cpu->fpr_dw(i) = value;
 	}
 };
 
@@ -224,7 +224,6 @@ struct powerpc_registers
 
 	static inline int GPR(int r) { return GPR_BASE + r; }
 	static inline int FPR(int r) { return FPR_BASE + r; }
-	static void interrupt_copy(powerpc_registers &oregs, powerpc_registers const &iregs);
 	
 	uint32 gpr[32];				// General-Purpose Registers
 	powerpc_fpr fpr[32];		// Floating-Point Registers
@@ -238,14 +237,37 @@ struct powerpc_registers
 	uint32 ctr;					// Count Register (SPR 9)
 	uint32 pc;					// Program Counter
 	powerpc_spcflags spcflags;	// Special CPU flags
-#if KPX_MAX_CPUS == 1
 	uint32 reserve_valid;
 	uint32 reserve_addr;
-#else
-	static uint32 reserve_valid;
-	static uint32 reserve_addr;
-	static uint32 reserve_data;
+#if KPX_MAX_CPUS != 1
+	uint32 reserve_data;		// Value loaded by lwarx, stwcx. fails if memory changed
 #endif
 };
 
+
+/**
+ *		Registers saved around interrupt handlers
+ *
+ *		FPRs are only saved when the handler is about to modify them
+ *		(see powerpc_cpu::fpr_save_area), vector registers only if
+ *		VRSAVE marks them as live.
+ **/
+
+struct powerpc_interrupt_frame
+{
+	uint32 gpr[32];				// General-Purpose Registers
+	powerpc_cr_register cr;		// Condition Register
+	powerpc_xer_register xer;	// XER Register (SPR 1)
+	uint32 vrsave;				// AltiVec Save Register
+	uint32 fpscr;				// Floating-Point Status and Control Register
+	uint32 lr;					// Link Register (SPR 8)
+	uint32 ctr;					// Count Register (SPR 9)
+	uint32 pc;					// Program Counter
+	double fpr[32];				// Floating-Point Registers, saved lazily
+	powerpc_vr vr[32];			// Vector Registers, saved if live
+
+	void save(powerpc_registers const &regs);
+	void restore(powerpc_registers &regs) const;
+};
+
 #endif /* PPC_REGISTERS_H */
@@ -54,6 +54,47 @@ static inline bool is_read_only_memory(uintptr addr)
 	return false;
 }
 
+#ifdef SHEEPSHAVER
+// Returns TRUE if the block at ENTRY is a short loop that only reads
+// low memory globals, i.e. it can't exit before an interrupt happened
+static bool is_spin_loop(uint32 entry)
+{
+	const int SPIN_LOOP_MAX_INSNS = 8;
+	for (int i = 0; i < SPIN_LOOP_MAX_INSNS; i++) {
+		uint32 pc = entry + 4 * i;
+		uint32 opcode = vm_read_memory_4(pc);
+		switch (opcode >> 26) {
+		case 32:	// lwz
+		case 34:	// lbz
+		case 40:	// lhz
+		case 42: {	// lha
+			uint32 d = opcode & 0xffff;
+			if (((opcode >> 16) & 0x1f) != 0 || d < 0x100 || d >= 0x3000)
+				return false;
+			break;
+		}
+		case 10:	// cmpli
+		case 11:	// cmpi
+		case 21:	// rlwinm
+		case 28:	// andi.
+		case 29:	// andis.
+			break;
+		case 31:	// cmp, cmpl
+			if (((opcode >> 1) & 0x3ff) != 0 && ((opcode >> 1) & 0x3ff) != 32)
+				return false;
+			break;
+		case 16:	// bc, must not decrement CTR nor link
+			if ((opcode & 3) != 0 || (((opcode >> 21) & 0x04) == 0))
+				return false;
+			return i > 0 && pc + (int32)(int16)(opcode & 0xfffc) == entry;
+		default:
+			return false;
+		}
+	}
+	return false;
+}
+#endif
+
 // Returns TRUE if we can directly generate a jump to the target block
 // XXX mixing front-end and back-end conditions is not a very good idea...
 static inline bool direct_chaining_possible(uint32 bpc, uint32 tpc)
@@ -147,6 +188,12 @@ powerpc_cpu::compile_block(uint32 entry_point)
 	bi->init(entry_point);
 	bi->entry_point = dg.gen_start(entry_point);
 
+#ifdef SHEEPSHAVER
+	// Let the host CPU rest while the guest is polling
+	if (is_spin_loop(entry_point))
+		dg.gen_invoke(HandleSpinLoop);
+#endif
+
 	// Direct block chaining support variables
 	bool use_direct_block_chaining = false;
 
@@ -1092,6 +1139,10 @@ powerpc_cpu::compile_block(uint32 entry_point)
 		}
 		case PPC_I(DCBZ):		// Data Cache Block Clear to Zero
 		{
+#ifdef SHEEPSHAVER
+			if (ZeroedPageTracking)
+				goto do_generic;
+#endif
 			const int rA = rA_field::extract(opcode);
 			const int rB = rB_field::extract(opcode);
 			if (rA == 0)
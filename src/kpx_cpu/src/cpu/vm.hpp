@@ -257,6 +257,17 @@ static inline void vm_write_memory_4(vm_addr_t addr, uint32 value)
 	uint32 * const m = (uint32 *)vm_do_get_real_address(addr);
 	vm_do_write_memory_4(m, value);
 }
+#if KPX_MAX_CPUS != 1
+// Atomically store VALUE to ADDR if it still holds EXPECTED, returns true on success
+static inline bool vm_compare_and_swap_memory_4(vm_addr_t addr, uint32 expected, uint32 value)
+{
+	uint32 * const m = (uint32 *)vm_do_get_real_address(addr);
+	uint32 expected_raw, value_raw;
+	vm_do_write_memory_4(&expected_raw, expected);
+	vm_do_write_memory_4(&value_raw, value);
+	return __sync_bool_compare_and_swap(m, expected_raw, value_raw);
+}
+#endif
 static inline void vm_write_memory_8(vm_addr_t addr, uint64 value)
 {
 	uint64 * const m = (uint64 *)vm_do_get_real_address(addr);
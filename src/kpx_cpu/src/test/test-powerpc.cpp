@@ -154,6 +154,9 @@ typedef uintptr_t uintptr;
 static inline uint32 POWERPC_LI(int RD, uint32 v) { return _D(14,RD,00,(v&0xffff)); }
 static inline uint32 POWERPC_MR(int RD, int RA) { return _X(31,RA,RD,RA,444,0); }
 static inline uint32 POWERPC_MFCR(int RD) { return _X(31,RD,00,00,19,0); }
+static inline uint32 POWERPC_STW(int RS, int RA, uint32 d) { return _D(36,RS,RA,(d&0xffff)); }
+static inline uint32 POWERPC_LWARX(int RD, int RA, int RB) { return _X(31,RD,RA,RB,20,0); }
+static inline uint32 POWERPC_STWCX(int RS, int RA, int RB) { return _X(31,RS,RA,RB,150,1); }
 static inline uint32 POWERPC_LVX(int vD, int rA, int rB) { return _X(31,vD,rA,rB,103,0); }
 static inline uint32 POWERPC_STVX(int vS, int rA, int rB) { return _X(31,vS,rA,rB,231,0); }
 static inline uint32 POWERPC_MFSPR(int rD, int SPR) { return _X(31,rD,(SPR&0x1f),((SPR>>5)&0x1f),339,0); }
@@ -210,7 +213,28 @@ uint64 GetTicks_usec(void)
 	return clock();
 }
 
-void HandleInterrupt(powerpc_registers *)
+void HandleInterrupt(powerpc_interrupt_frame *)
+{
+}
+
+void HandleSpinLoop(void)
+{
+}
+
+bool ZeroedPageTracking = false;
+
+void HandleZeroedPage(uint32)
+{
+}
+
+int ReplayMode = 0;
+
+bool ReplayCheckpoint(void)
+{
+	return false;
+}
+
+void ReplayValue(int, void *, int)
 {
 }
 
@@ -709,6 +733,9 @@ public:
 	~powerpc_test_cpu();
 
 	bool test(void);
+#if EMU_KHEPERIX && KPX_MAX_CPUS != 1
+	bool test_reservation(powerpc_test_cpu *other);
+#endif
 
 	void set_results_file(FILE *fp)
 		{ results_file = fp; }
@@ -800,20 +827,31 @@ private:
 	void test_vector_load(void);
 	void test_vector_load_for_shift(void);
 	void test_vector_arith(void);
+
+#if EMU_KHEPERIX && KPX_MAX_CPUS != 1
+	uint32 run_reservation(uint32 *code, uint32 addr, uint32 value);
+	void check_reservation(const char *name, bool stored, uint32 result, uint32 expected);
+#endif
 };
 
+#if ENABLE_MON
+static int mon_users = 0;					// Number of test CPUs sharing the monitor
+#endif
+
 powerpc_test_cpu::powerpc_test_cpu()
 	: powerpc_cpu_base(), results_file(NULL)
 {
 #if ENABLE_MON
-	mon_init();
+	if (mon_users++ == 0)
+		mon_init();
 #endif
 }
 
 powerpc_test_cpu::~powerpc_test_cpu()
 {
 #if ENABLE_MON
-	mon_exit();
+	if (--mon_users == 0)
+		mon_exit();
 #endif
 }
 
@@ -2146,6 +2184,78 @@ static void sigill_handler(int sig)
 }
 #endif
 
+#if EMU_KHEPERIX && KPX_MAX_CPUS != 1
+static uint32 reservation_word;				// Big endian, as seen by the emulated processors
+
+// Execute CODE with rA = ADDR and rB = VALUE, returns rD
+uint32 powerpc_test_cpu::run_reservation(uint32 *code, uint32 addr, uint32 value)
+{
+	emul_set_cr(0);
+	set_gpr(RA, addr);
+	set_gpr(RB, value);
+	execute(code);
+	return get_gpr(RD);
+}
+
+void powerpc_test_cpu::check_reservation(const char *name, bool stored, uint32 cr, uint32 expected)
+{
+	static const uint32 CR0_EQ = 0x20000000;
+	++tests;
+	const uint32 value = ntohl(reservation_word);
+	if (((cr & CR0_EQ) != 0) != stored || value != expected) {
+		printf("FAIL: %s: stwcx. %s, memory holds %08x instead of %08x\n", name,
+			   (cr & CR0_EQ) ? "succeeded" : "failed", value, expected);
+		errors++;
+	}
+}
+
+// Check that each processor has its own reservation, and that stwcx. fails
+// if another processor stored to the reserved word since lwarx
+bool powerpc_test_cpu::test_reservation(powerpc_test_cpu *other)
+{
+	tests = errors = 0;
+	other->tests = other->errors = 0;
+	printf("Testing lwarx/stwcx. with two processors\n");
+
+	uint32 &word = reservation_word;
+	assert((uintptr)&word <= UINT_MAX);
+	const uint32 addr = (uintptr)&word;
+	uint32 lwarx[] = { POWERPC_LWARX(RD, 0, RA), POWERPC_BLR };
+	uint32 stwcx[] = { POWERPC_STWCX(RB, 0, RA), POWERPC_MFCR(RD), POWERPC_BLR };
+	uint32 stw[] = { POWERPC_STW(RB, RA, 0), POWERPC_BLR };
+
+	// No other processor involved
+	word = htonl(1);
+	run_reservation(lwarx, addr, 0);
+	check_reservation("single processor", true, run_reservation(stwcx, addr, 2), 2);
+
+	// Other processor stores to the reserved word
+	word = htonl(1);
+	run_reservation(lwarx, addr, 0);
+	other->run_reservation(stw, addr, 3);
+	check_reservation("store by other processor", false, run_reservation(stwcx, addr, 2), 3);
+
+	// Other processor takes its own reservation and completes it first
+	word = htonl(1);
+	run_reservation(lwarx, addr, 0);
+	other->run_reservation(lwarx, addr, 0);
+	other->check_reservation("other processor first", true, other->run_reservation(stwcx, addr, 3), 3);
+	check_reservation("other processor first", false, run_reservation(stwcx, addr, 2), 3);
+
+	// Other processor takes its own reservation but completes it last
+	word = htonl(1);
+	run_reservation(lwarx, addr, 0);
+	other->run_reservation(lwarx, addr, 0);
+	check_reservation("other processor last", true, run_reservation(stwcx, addr, 2), 2);
+	other->check_reservation("other processor last", false, other->run_reservation(stwcx, addr, 3), 2);
+
+	tests += other->tests;
+	errors += other->errors;
+	printf("%u errors out of %u tests\n", errors, tests);
+	return errors == 0;
+}
+#endif
+
 bool powerpc_test_cpu::test(void)
 {
 	// Tests initialization
@@ -2188,6 +2298,7 @@ int main(int argc, char *argv[])
 	FILE *fp = NULL;
 	powerpc_test_cpu *ppc = new powerpc_test_cpu;
 
+#if PPC_ENABLE_JIT
 	if (argc > 1) {
 		const char *arg = argv[1];
 		if (strcmp(arg, "--jit") == 0) {
@@ -2197,6 +2308,7 @@ int main(int argc, char *argv[])
 			ppc->enable_jit();
 		}
 	}
+#endif
 
 	if (argc > 1) {
 		const char *file = argv[1];
@@ -2218,6 +2330,19 @@ int main(int argc, char *argv[])
 		setvbuf(fp, buffer, _IOFBF, sizeof(buffer));
 	}
 
+#if EMU_KHEPERIX && KPX_MAX_CPUS != 1
+	// Multiprocessor specific checks, these need no results file
+	powerpc_test_cpu *other = new powerpc_test_cpu;
+	bool mp_ok = ppc->test_reservation(other);
+	delete other;
+#ifndef NATIVE_POWERPC
+	if (fp == NULL) {
+		delete ppc;
+		return !mp_ok;
+	}
+#endif
+#endif
+
 	// We need a results file on non PowerPC platforms
 #ifndef NATIVE_POWERPC
 	if (fp == NULL) {
@@ -2236,6 +2361,9 @@ int main(int argc, char *argv[])
 #endif
 
 	bool ok = ppc->test();
+#if EMU_KHEPERIX && KPX_MAX_CPUS != 1
+	ok = ok && mp_ok;
+#endif
 	if (fp) fclose(fp);
 	delete ppc;
 	return !ok;
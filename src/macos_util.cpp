@@ -28,6 +28,15 @@
 #include "emul_op.h"
 #include "macos_util.h"
 #include "thunks.h"
+#include "snapshot.h"
+
+#ifdef HAVE_MADVISE
+#include <unistd.h>
+#include <sys/mman.h>
+static inline uint32 host_page_size(void) { return getpagesize(); }
+#else
+static inline uint32 host_page_size(void) { return 4096; }
+#endif
 
 #define DEBUG 0
 #include "debug.h"
@@ -71,6 +80,16 @@ static inline void DisposePtr(uint32 arg1)
 	CallMacOS1(d_ptr, d_tvect, arg1);
 }
 
+void MacOSUtilSnapshotRegister(void)
+{
+	SnapshotAddState("cu_tvect", &cu_tvect, sizeof(cu_tvect));
+	SnapshotAddState("gsl_tvect", &gsl_tvect, sizeof(gsl_tvect));
+	SnapshotAddState("fs_tvect", &fs_tvect, sizeof(fs_tvect));
+	SnapshotAddState("cc_tvect", &cc_tvect, sizeof(cc_tvect));
+	SnapshotAddState("nps_tvect", &nps_tvect, sizeof(nps_tvect));
+	SnapshotAddState("d_tvect", &d_tvect, sizeof(d_tvect));
+}
+
 
 /*
  *  Reset MacOS utilities
@@ -363,3 +382,148 @@ void Mac_sysfree(uint32 addr)
 {
 	DisposePtr(addr);
 }
+
+
+/*
+ *  Block memory operations, replacing BlockMove() and friends
+ *  (BlockMove() also keeps the instruction cache coherent, BlockMoveData()
+ *  is only used for data and doesn't have to)
+ *
+ *  Host memmove()/memset() are only used within Mac RAM (and ROM as the
+ *  source). Other ranges, including bogus ones, are accessed byte by
+ *  byte like the emulated routines would, so they stay within the Mac
+ *  address space.
+ */
+
+static inline bool in_ram(uint32 addr, uint32 size)
+{
+	return addr >= RAMBase && size <= RAMSize && addr - RAMBase <= RAMSize - size;
+}
+
+static inline bool in_rom(uint32 addr, uint32 size)
+{
+	return addr >= ROMBase && size <= ROM_AREA_SIZE && addr - ROMBase <= ROM_AREA_SIZE - size;
+}
+
+static void block_move(uint32 src, uint32 dst, uint32 size)
+{
+	if (in_ram(dst, size) && (in_ram(src, size) || in_rom(src, size)))
+		memmove(Mac2HostAddr(dst), Mac2HostAddr(src), size);
+	else if (dst < src) {
+		for (uint32 i = 0; i < size; i++)
+			WriteMacInt8(dst + i, ReadMacInt8(src + i));
+	} else {
+		for (uint32 i = size; i-- > 0; )
+			WriteMacInt8(dst + i, ReadMacInt8(src + i));
+	}
+}
+
+void Mac_BlockMoveData(uint32 src, uint32 dst, uint32 size)
+{
+	if (int32(size) <= 0 || src == dst)
+		return;
+	block_move(src, dst, size);
+}
+
+void Mac_BlockMove(uint32 src, uint32 dst, uint32 size)
+{
+	if (int32(size) <= 0 || src == dst)
+		return;
+	block_move(src, dst, size);
+	MakeExecutable(0, dst, size);
+}
+
+void Mac_BlockZero(uint32 dst, uint32 size)
+{
+	if (int32(size) <= 0)
+		return;
+	if (!in_ram(dst, size)) {
+		for (uint32 i = 0; i < size; i++)
+			WriteMacInt8(dst + i, 0);
+		return;
+	}
+	if (ZeroPageReclaim && size >= 0x10000) {
+		// Give whole pages back to the host, they read as zero afterwards
+		uint32 page_size = host_page_size();
+		uint32 start = (dst + page_size - 1) & -page_size;
+		uint32 end = (dst + size) & -page_size;
+		memset(Mac2HostAddr(dst), 0, start - dst);
+		memset(Mac2HostAddr(end), 0, dst + size - end);
+		ZeroPageRelease(start, end - start);
+		return;
+	}
+	memset(Mac2HostAddr(dst), 0, size);
+}
+
+
+/*
+ *  Release of Mac RAM pages cleared by the guest ("density" prefs item)
+ *
+ *  dcbz reports each 4 KB page when its last cache line is cleared. Pages
+ *  are queued and released in batches after checking that they are still
+ *  zero, since the guest may have written to them in the meantime.
+ */
+
+bool ZeroPageReclaim = false;
+uint64 ZeroPagesReleased = 0;
+
+const int ZERO_PAGE_QUEUE_SIZE = 256;
+static uint32 zero_page_queue[ZERO_PAGE_QUEUE_SIZE];
+static int zero_page_count = 0;
+
+void ZeroPageRelease(uint32 addr, uint32 size)
+{
+	if (size == 0)
+		return;
+#ifdef HAVE_MADVISE
+	if (madvise(Mac2HostAddr(addr), size, MADV_DONTNEED) == 0) {
+		ZeroPagesReleased += size / host_page_size();
+		return;
+	}
+#endif
+	memset(Mac2HostAddr(addr), 0, size);
+}
+
+static bool page_is_zero(const uint8 *p, uint32 size)
+{
+	const uint32 *q = (const uint32 *)p;
+	for (uint32 i = 0; i < size / 4; i += 4) {
+		if (q[i] | q[i + 1] | q[i + 2] | q[i + 3])
+			return false;
+	}
+	return true;
+}
+
+void ZeroPageFlush(void)
+{
+	uint32 page_size = host_page_size();
+	uint32 range_start = 0, range_end = 0;
+	for (int i = 0; i < zero_page_count; i++) {
+		uint32 addr = zero_page_queue[i];
+		if (!page_is_zero(Mac2HostAddr(addr), page_size))
+			continue;
+		if (addr != range_end) {
+			ZeroPageRelease(range_start, range_end - range_start);
+			range_start = addr;
+		}
+		range_end = addr + page_size;
+	}
+	ZeroPageRelease(range_start, range_end - range_start);
+	zero_page_count = 0;
+}
+
+void ZeroPageAdd(uint32 addr)
+{
+	// Only consider the last 4 KB page of each host page
+	uint32 page_size = host_page_size();
+	if (((addr + 0x1000) & (page_size - 1)) != 0)
+		return;
+	addr = (addr + 0x1000) - page_size;
+	if (addr < RAMBase || addr + page_size > RAMBase + RAMSize)
+		return;
+	if (zero_page_count > 0 && zero_page_queue[zero_page_count - 1] == addr)
+		return;
+	zero_page_queue[zero_page_count++] = addr;
+	if (zero_page_count == ZERO_PAGE_QUEUE_SIZE)
+		ZeroPageFlush();
+}
@@ -47,6 +47,9 @@
 #include "vm_alloc.h"
 #include "sigsegv.h"
 #include "thunks.h"
+#include "stats.h"
+#include "replay.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -65,6 +68,9 @@ static void sheepshaver_write_byte(uintptr adr, uint32 b)
 }
 #endif
 
+// Global variables
+bool XPRAMSaveEnabled = true;	// Flag: write NVRAM back to its file (cleared in forked clones)
+
 
 /*
  *  Initialize everything, returns false on error
@@ -72,6 +78,12 @@ static void sheepshaver_write_byte(uintptr adr, uint32 b)
 
 bool InitAll(const char *vmdir)
 {
+	// Init statistics
+	StatsInit();
+
+	// Init event record/replay
+	ReplayInit();
+
 	// Load NVRAM
 	XPRAMInit(vmdir);
 
@@ -113,6 +125,7 @@ bool InitAll(const char *vmdir)
 	i16 = PrefsFindInt32("bootdriver");
 	XPRAM[0x137a] = i16 >> 8;
 	XPRAM[0x137b] = i16 & 0xff;
+	BootPhase("xpram");
 
 	// Create BootGlobs at top of Mac memory
 	memset(RAMBaseHost + RAMSize - 4096, 0, 4096);
@@ -125,43 +138,54 @@ bool InitAll(const char *vmdir)
 	// Init thunks
 	if (!ThunksInit())
 		return false;
+	BootPhase("thunks");
 
 	// Init drivers
 	SonyInit();
 	DiskInit();
 	CDROMInit();
 	SCSIInit();
+	BootPhase("drivers");
 
 	// Init external file system
 	ExtFSInit(); 
+	BootPhase("extfs");
 
 	// Init ADB
 	ADBInit();
+	BootPhase("adb");
 
 	// Init audio
 	AudioInit();
+	BootPhase("audio");
 
 	// Init network
 	EtherInit();
+	BootPhase("ether");
 
 	// Init serial ports
 	SerialInit();
+	BootPhase("serial");
 
 	// Init Time Manager
 	TimerInit();
+	BootPhase("timer");
 
 	// Init clipboard
 	ClipInit();
+	BootPhase("clip");
 
 	// Init video
 	if (!VideoInit())
 		return false;
+	BootPhase("video");
 
 	// Install ROM patches
 	if (!PatchROM()) {
 		ErrorAlert(GetString(STR_UNSUPPORTED_ROM_TYPE_ERR));
 		return false;
 	}
+	BootPhase("patch_rom");
 
 	// Initialize Kernel Data
 	KernelData *kernel_data = (KernelData *)Mac2HostAddr(KERNEL_DATA_BASE);
@@ -254,6 +278,7 @@ bool InitAll(const char *vmdir)
 	WriteMacInt32(XLM_ETHER_RSRV, NativeFunction(NATIVE_ETHER_RSRV));
 	WriteMacInt32(XLM_VIDEO_DOIO, NativeFunction(NATIVE_VIDEO_DO_DRIVER_IO));
 	D(bug("Low Memory initialized\n"));
+	BootPhase("low_mem");
 
 #if ENABLE_MON
 	// Initialize mon
@@ -262,6 +287,10 @@ bool InitAll(const char *vmdir)
 	mon_write_byte = sheepshaver_write_byte;
 #endif
 
+	// Restore machine state from snapshot
+	if (!SnapshotInit())
+		return false;
+
 	return true;
 }
 
@@ -278,7 +307,8 @@ void ExitAll(void)
 #endif
 
 	// Save NVRAM
-	XPRAMExit();
+	if (XPRAMSaveEnabled)
+		XPRAMExit();
 
 	// Exit clipboard
 	ClipExit();
@@ -312,6 +342,12 @@ void ExitAll(void)
 
 	// Delete thunks
 	ThunksExit();
+
+	// Close event log
+	ReplayExit();
+
+	// Print statistics
+	StatsExit();
 }
 
 
@@ -321,6 +357,8 @@ void ExitAll(void)
 
 void PatchAfterStartup(void)
 {
+	BootPhase("rom_boot");
 	ExecuteNative(NATIVE_VIDEO_INSTALL_ACCEL);
 	InstallExtFS();
+	BootPhase("patch_after_startup");
 }
@@ -27,6 +27,7 @@
 #include "user_strings.h"
 #include "emul_op.h"
 #include "thunks.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -53,6 +54,12 @@ static inline int16 RegistryPropertyCreateStr(uintptr arg1, const char *arg2, co
 	return RegistryPropertyCreate(arg1, arg2, arg3str.addr(), strlen(arg3) + 1);
 }
 
+void NameRegistrySnapshotRegister(void)
+{
+	SnapshotAddState("rcec_tvect", &rcec_tvect, sizeof(rcec_tvect));
+	SnapshotAddState("rpc_tvect", &rpc_tvect, sizeof(rpc_tvect));
+}
+
 // Video driver stub
 static const uint8 video_driver[] = {
 #include "VideoDriverStub.i"
@@ -58,6 +58,12 @@ prefs_desc common_prefs_items[] = {
 	{"jit", TYPE_BOOLEAN, false,        "enable JIT compiler"},
 	{"jit68k", TYPE_BOOLEAN, false,     "enable 68k DR emulator"},
 	{"keyboardtype", TYPE_INT32, false, "hardware keyboard type"},
+	{"stats", TYPE_BOOLEAN, false,      "collect runtime statistics and print them on exit"},
+	{"eventrecord", TYPE_STRING, false, "path of file to record asynchronous events to"},
+	{"eventreplay", TYPE_STRING, false, "path of file to replay recorded asynchronous events from"},
+	{"trapprofile", TYPE_BOOLEAN, false, "profile A-traps, print call counts and times on exit"},
+	{"snapshotsave", TYPE_STRING, false, "path of file to save machine snapshot to when Mac OS has started"},
+	{"snapshotload", TYPE_STRING, false, "path of machine snapshot to resume from instead of booting"},
 	{NULL, TYPE_END, false, NULL} // End of list
 };
 
@@ -92,4 +98,5 @@ void AddPrefsDefaults(void)
 	PrefsAddBool("jit68k", false);
 
 	PrefsAddInt32("keyboardtype", 5);
+	PrefsAddBool("stats", false);
 }
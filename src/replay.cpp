@@ -0,0 +1,308 @@
+/*
+ *  replay.cpp - Deterministic record/replay of asynchronous events
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  NOTES:
+ *    In record and replay mode, interrupt flags raised by other threads
+ *    don't reach InterruptFlags directly. They are collected and merged
+ *    by the emulator thread when HandleInterrupt() is called, which is
+ *    logged together with the number of guest blocks executed so far.
+ *    Values derived from host time that the guest can observe (Time
+ *    Manager, DateTime, time base register) are logged in call order.
+ *
+ *    On replay, asynchronous interrupts are ignored and the logged ones
+ *    are delivered at the same block count. The block count requires
+ *    the CPU emulator to stop after each block, so the JIT compiler is
+ *    disabled in both modes. Event payloads (ADB input, network packets)
+ *    are not logged, so host keyboard and mouse input is kept away from
+ *    the guest, and record/replay is refused when networking is enabled.
+ */
+
+#include "sysdeps.h"
+
+#include <string.h>
+
+#include "main.h"
+#include "prefs.h"
+#include "timer.h"
+#include "cpu_emulation.h"
+#include "replay.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Log file format
+static const char REPLAY_SIGNATURE[8] = {'S', 'S', 'E', 'V', 'L', 'O', 'G', '1'};
+
+struct replay_event {
+	uint64 count;				// Guest block count
+	uint32 type;				// REPLAY_EV_*
+	uint32 size;				// Size of data
+	uint8 data[16];
+};
+
+// Global variables
+int ReplayMode = REPLAY_OFF;
+
+static FILE *replay_file = NULL;			// Log file
+static uint64 block_count = 0;				// Guest blocks executed
+static replay_event next_event;				// Next event to replay
+static bool have_next_event = false;		// Flag: next_event is valid
+static B2_mutex *pending_lock = NULL;		// Protects pending_flags
+static uint32 pending_flags = 0;			// Interrupt flags raised since last HandleInterrupt()
+static uint32 last_date_time = 0;			// Last local time written to the guest
+
+
+/*
+ *  Initialization
+ */
+
+static bool read_event(void)
+{
+	have_next_event = fread(&next_event, sizeof(next_event), 1, replay_file) == 1;
+	return have_next_event;
+}
+
+void ReplayInit(void)
+{
+	const char *record = PrefsFindString("eventrecord");
+	const char *replay = PrefsFindString("eventreplay");
+#if !EMULATED_PPC
+	// Guest blocks can only be counted by the CPU emulator
+	if (record || replay)
+		fprintf(stderr, "WARNING: Event record/replay needs the PowerPC emulator, disabled\n");
+	return;
+#endif
+	// Received packets would have to be logged
+	if ((record || replay) && PrefsFindString("ether")) {
+		fprintf(stderr, "WARNING: Event record/replay doesn't work with networking, disabled\n");
+		return;
+	}
+	if (replay) {
+		replay_file = fopen(replay, "rb");
+		char sig[8];
+		if (replay_file == NULL || fread(sig, 8, 1, replay_file) != 1 || memcmp(sig, REPLAY_SIGNATURE, 8)) {
+			fprintf(stderr, "WARNING: Cannot read event log '%s', replay disabled\n", replay);
+			if (replay_file) {
+				fclose(replay_file);
+				replay_file = NULL;
+			}
+			return;
+		}
+		read_event();
+		ReplayMode = REPLAY_PLAY;
+		printf("Replaying events from '%s'\n", replay);
+	} else if (record) {
+		replay_file = fopen(record, "wb");
+		if (replay_file == NULL) {
+			fprintf(stderr, "WARNING: Cannot create event log '%s', recording disabled\n", record);
+			return;
+		}
+		fwrite(REPLAY_SIGNATURE, 8, 1, replay_file);
+		pending_lock = B2_create_mutex();
+		ReplayMode = REPLAY_RECORD;
+		printf("Recording events to '%s'\n", record);
+	}
+}
+
+
+/*
+ *  Deinitialization
+ */
+
+static void write_event(int type, const void *data, int size)
+{
+	replay_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.count = block_count;
+	ev.type = type;
+	ev.size = size;
+	memcpy(ev.data, data, size);
+	fwrite(&ev, sizeof(ev), 1, replay_file);
+}
+
+void ReplayExit(void)
+{
+	if (ReplayMode == REPLAY_RECORD) {
+		write_event(REPLAY_EV_END, NULL, 0);
+		printf("Recorded %llu guest blocks\n", (unsigned long long)block_count);
+	}
+	ReplayMode = REPLAY_OFF;
+	if (replay_file) {
+		fclose(replay_file);
+		replay_file = NULL;
+	}
+	if (pending_lock) {
+		B2_delete_mutex(pending_lock);
+		pending_lock = NULL;
+	}
+}
+
+
+/*
+ *  Stop replaying and continue with live events
+ */
+
+static void replay_diverged(const char *reason)
+{
+	fprintf(stderr, "WARNING: Event replay diverged at block %llu (%s), continuing with live events\n",
+		(unsigned long long)block_count, reason);
+	ReplayMode = REPLAY_OFF;
+}
+
+
+/*
+ *  Collect interrupt flags raised by other threads
+ */
+
+void ReplaySetInterruptFlag(uint32 flag)
+{
+	if (ReplayMode != REPLAY_RECORD)
+		return;
+
+	// ADB events are queued by the host, ignore input instead of logging it
+	flag &= ~INTFLAG_ADB;
+	if (flag == 0)
+		return;
+
+	B2_lock_mutex(pending_lock);
+	pending_flags |= flag;
+	B2_unlock_mutex(pending_lock);
+}
+
+
+/*
+ *  Count guest blocks, check whether a logged interrupt is due
+ */
+
+bool ReplayCheckpoint(void)
+{
+	block_count++;
+	if (ReplayMode != REPLAY_PLAY)
+		return false;
+
+	if (!have_next_event) {
+		replay_diverged("unexpected end of log");
+		return false;
+	}
+	if (next_event.count > block_count)
+		return false;
+	if (next_event.count < block_count) {
+		replay_diverged("missed event");
+		return false;
+	}
+	switch (next_event.type) {
+	case REPLAY_EV_INTERRUPT:
+		return true;
+	case REPLAY_EV_END:
+		printf("Event replay finished after %llu guest blocks\n", (unsigned long long)block_count);
+		ReplayMode = REPLAY_OFF;
+		QuitEmulator();
+		return false;
+	}
+	return false;
+}
+
+
+/*
+ *  Pseudo Mac 1Hz interrupt, update local time (only logged when it changes)
+ */
+
+static void update_date_time(void)
+{
+	uint32 date_time;
+	switch (ReplayMode) {
+	case REPLAY_RECORD:
+		date_time = TimerDateTime();
+		if (date_time == last_date_time)
+			return;
+		write_event(REPLAY_EV_DATETIME, &date_time, sizeof(date_time));
+		break;
+	case REPLAY_PLAY:
+		if (!have_next_event || next_event.type != REPLAY_EV_DATETIME || next_event.count != block_count)
+			return;
+		memcpy(&date_time, next_event.data, sizeof(date_time));
+		read_event();
+		break;
+	default:
+		return;
+	}
+	last_date_time = date_time;
+	WriteMacInt32(0x20c, date_time);
+}
+
+
+/*
+ *  HandleInterrupt() called, make new interrupt flags visible to the guest
+ */
+
+void ReplayInterrupt(void)
+{
+	uint32 flags = 0;
+	switch (ReplayMode) {
+	case REPLAY_RECORD:
+		B2_lock_mutex(pending_lock);
+		flags = pending_flags;
+		pending_flags = 0;
+		B2_unlock_mutex(pending_lock);
+		write_event(REPLAY_EV_INTERRUPT, &flags, sizeof(flags));
+		break;
+	case REPLAY_PLAY:
+		if (!have_next_event || next_event.type != REPLAY_EV_INTERRUPT || next_event.count != block_count) {
+			replay_diverged("unexpected interrupt");
+			return;
+		}
+		memcpy(&flags, next_event.data, sizeof(flags));
+		read_event();
+		break;
+	default:
+		return;
+	}
+
+	// The 1Hz local time update is done here instead of in the tick thread
+	if (flags & INTFLAG_VIA)
+		update_date_time();
+
+	// Only the emulator thread modifies InterruptFlags in this mode
+	InterruptFlags |= flags;
+}
+
+
+/*
+ *  Log or replay a value derived from host time
+ */
+
+void ReplayValue(int type, void *data, int size)
+{
+	switch (ReplayMode) {
+	case REPLAY_RECORD:
+		write_event(type, data, size);
+		break;
+	case REPLAY_PLAY:
+		if (!have_next_event || next_event.type != uint32(type) || next_event.size != uint32(size) || next_event.count != block_count) {
+			replay_diverged("unexpected time value");
+			return;
+		}
+		memcpy(data, next_event.data, size);
+		read_event();
+		break;
+	}
+}
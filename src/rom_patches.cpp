@@ -41,6 +41,7 @@
 #include "serial.h"
 #include "macos_util.h"
 #include "thunks.h"
+#include "stats.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -1094,6 +1095,15 @@ static bool patch_68k_emul(void)
 		*lp++ = htonl(POWERPC_EMUL_OP | (i + 3));
 		*lp++ = htonl(0x4bf66e68 - i*8);				// b	0x366084
 	}
+
+	// Count A-line opcodes for A-trap profiler
+	if (TrapProfileEnabled) {
+		lp = (uint32 *)(ROMBaseHost + 0x380000 + (0xa000 << 3));
+		for (int i=0; i<TRAP_PROFILE_ATRAPS; i++, lp += 2) {
+			TrapProfileSetOpcode(i, ntohl(*lp));
+			*lp = htonl(POWERPC_ATRAP_PROFILE | (i << 6));
+		}
+	}
 #else
 	// Install EMUL_RETURN, EXEC_RETURN and EMUL_OP opcodes
 	lp = (uint32 *)(ROMBaseHost + 0x380000 + (M68K_EMUL_RETURN << 3));
@@ -2227,6 +2237,15 @@ static bool patch_68k(void)
 	*wp++ = htons(M68K_EMUL_OP_MICROSECONDS);
 	*wp = htons(M68K_RTS);
 
+	// Replace BlockMove()/BlockMoveData()
+	base = find_rom_trap(0xa02e);
+	D(bug("BlockMove %08lx\n", base));
+	if (base && base < ROM_SIZE) {
+		wp = (uint16 *)(ROMBaseHost + base);
+		*wp++ = htons(M68K_EMUL_OP_BLOCK_MOVE);
+		*wp = htons(M68K_RTS);
+	}
+
 	// Disable Egret Manager
 	static const uint8 egret_dat[] = {0x2f, 0x30, 0x81, 0xe2, 0x20, 0x10, 0x00, 0x18};
 	if ((base = find_rom_data(0xa000, 0x10000, egret_dat, sizeof(egret_dat))) == 0) return false;
@@ -2312,12 +2331,24 @@ static bool patch_68k(void)
 	base = ROMBase + ReadMacInt32(ROMBase + 0x22);
 	WriteMacInt32(base + 4 * (0xa9fd & 0x3ff), GET_SCRAP_PATCH_SPACE);
 
-	// Patch SynchIdleTime()
+	// Patch SynchIdleTime() and TickCount()
 	if (PrefsFindBool("idlewait")) {
-		base = find_rom_trap(0xabf7) + 4;						// SynchIdleTime()
-		wp = (uint16 *)(ROMBaseHost + base);
-		D(bug("SynchIdleTime at %08lx\n", base));
-		if (ntohs(*wp) == 0x2078) {								// movea.l	ExpandMem,a0
+		IdlePollEnabled = true;
+		base = find_rom_trap(0xa975);							// TickCount()
+		if (base && base < ROM_SIZE) {
+			wp = (uint16 *)(ROMBaseHost + base);
+			*wp++ = htons(M68K_EMUL_OP_TICK_COUNT);
+			*wp = htons(M68K_RTS);
+		} else
+			printf("WARNING: TickCount() not found in ROM, not patched\n");
+
+		base = find_rom_trap(0xabf7);							// SynchIdleTime()
+		wp = (uint16 *)(ROMBaseHost + base + 4);
+		D(bug("SynchIdleTime at %08lx\n", base + 4));
+		if (base == 0 || base >= ROM_SIZE) {
+			D(bug("SynchIdleTime patch not installed\n"));
+		}
+		else if (ntohs(*wp) == 0x2078) {						// movea.l	ExpandMem,a0
 			*wp++ = htons(M68K_EMUL_OP_IDLE_TIME);
 			*wp = htons(M68K_NOP);
 		}
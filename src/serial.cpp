@@ -23,6 +23,7 @@
 #include "macos_util.h"
 #include "serial.h"
 #include "serial_defs.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -39,6 +40,11 @@ static inline int16 IOCommandIsComplete(uint32 arg1, int16 arg2)
 	return (int16)CallMacOS2(iocic_ptr, iocic_tvect, arg1, arg2);
 }
 
+void SerialSnapshotRegister(void)
+{
+	SnapshotAddState("serial_iocic_tvect", &iocic_tvect, sizeof(iocic_tvect));
+}
+
 
 /*
  *  Empty function (AIn/BIn Open/Close)
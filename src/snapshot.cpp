@@ -0,0 +1,390 @@
+/*
+ *  snapshot.cpp - Machine state snapshots
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *  NOTES:
+ *    A snapshot holds the Mac memory areas and the host variables that
+ *    modules registered with SnapshotAddArea() and SnapshotAddState().
+ *    It is written when Mac OS has finished booting, as soon as the CPU
+ *    emulator reaches a point where no host code runs on behalf of the
+ *    guest. Restoring happens after all modules have been initialized
+ *    with the same prefs. Large areas are mapped privately from the file,
+ *    so pages are only read in when the guest touches them.
+ *
+ *    Host state that drivers set up when Mac OS opens them is not covered:
+ *    the Ethernet driver keeps host pointers to its STREAMS state, and the
+ *    floppy, disk and CD-ROM drivers record drive numbers and status
+ *    record addresses in their Open routines. No snapshot is saved once
+ *    Mac OS has opened one of them.
+ */
+
+#include "sysdeps.h"
+
+#include <string.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "main.h"
+#include "prefs.h"
+#include "cpu_emulation.h"
+#include "xpram.h"
+#include "ether.h"
+#include "snapshot.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// File format
+static const char SNAPSHOT_SIGNATURE[8] = {'S', 'S', 'S', 'N', 'A', 'P', '0', '1'};
+const uint32 SNAPSHOT_ALIGN = 0x10000;		// File alignment of memory areas, allows mmap() with 64 KB pages
+
+struct snapshot_header {
+	char signature[8];
+	uint32 num_areas;
+	uint32 num_states;
+};
+
+struct snapshot_area_entry {
+	uint32 addr;
+	uint32 size;
+	uint64 offset;
+};
+
+struct snapshot_state_entry {
+	char name[32];
+	uint32 size;
+	uint32 type;
+	uint64 offset;
+};
+
+// Registered items
+const int SNAPSHOT_MAX_AREAS = 16;
+const int SNAPSHOT_MAX_STATES = 64;
+
+struct snapshot_area {
+	uint32 addr;
+	uint32 size;
+	bool lazy;
+};
+
+struct snapshot_state {
+	const char *name;
+	void *data;
+	uint32 size;
+	int type;
+	snapshot_prepare_func prepare;
+	snapshot_func restored;
+};
+
+static snapshot_area areas[SNAPSHOT_MAX_AREAS];
+static int num_areas = 0;
+static snapshot_state states[SNAPSHOT_MAX_STATES];
+static int num_states = 0;
+
+// Global variables
+bool SnapshotPending = false;
+bool SnapshotRestored = false;
+uint32 SnapshotOpenDrivers = 0;
+snapshot_cpu_state SnapshotCPU;
+
+static const char *save_path = NULL;		// File to save snapshot to
+static snapshot_func boot_hook = NULL;		// Called at the safe point after saving
+
+
+/*
+ *  Register items
+ */
+
+void SnapshotAddArea(uint32 addr, uint32 size, bool lazy)
+{
+	if (size == 0)
+		return;
+	if (num_areas == SNAPSHOT_MAX_AREAS) {
+		D(bug("SnapshotAddArea: too many areas, ignoring %08x\n", addr));
+		return;
+	}
+	areas[num_areas].addr = addr;
+	areas[num_areas].size = size;
+	areas[num_areas].lazy = lazy;
+	num_areas++;
+}
+
+void SnapshotAddState(const char *name, void *data, uint32 size, int type, snapshot_prepare_func prepare, snapshot_func restored)
+{
+	for (int i = 0; i < num_states; i++) {
+		if (strcmp(states[i].name, name) == 0)
+			return;
+	}
+	if (num_states == SNAPSHOT_MAX_STATES) {
+		D(bug("SnapshotAddState: too many items, ignoring '%s'\n", name));
+		return;
+	}
+	snapshot_state &s = states[num_states++];
+	s.name = name;
+	s.data = data;
+	s.size = size;
+	s.type = type;
+	s.prepare = prepare;
+	s.restored = restored;
+}
+
+
+/*
+ *  Save snapshot
+ */
+
+void SnapshotBootDone(void)
+{
+	if (save_path || boot_hook)
+		SnapshotPending = true;
+}
+
+void SnapshotSetBootHook(snapshot_func func)
+{
+	boot_hook = func;
+}
+
+static uint64 align_offset(uint64 offset)
+{
+	return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64)(SNAPSHOT_ALIGN - 1);
+}
+
+static bool snapshot_save(void)
+{
+	if (save_path == NULL)
+		return false;
+
+	if (ether_driver_opened) {
+		fprintf(stderr, "WARNING: Ethernet driver is open, not saving snapshot\n");
+		return false;
+	}
+	if (SnapshotOpenDrivers) {
+		fprintf(stderr, "WARNING: %s driver is open, not saving snapshot\n",
+			(SnapshotOpenDrivers & SNAPSHOT_DRIVER_SONY) ? "Floppy" : (SnapshotOpenDrivers & SNAPSHOT_DRIVER_DISK) ? "Disk" : "CD-ROM");
+		return false;
+	}
+	for (int i = 0; i < num_states; i++) {
+		if (states[i].prepare && !states[i].prepare()) {
+			fprintf(stderr, "WARNING: Cannot save '%s' state, not saving snapshot\n", states[i].name);
+			return false;
+		}
+	}
+
+	FILE *f = fopen(save_path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "WARNING: Cannot create snapshot '%s'\n", save_path);
+		return false;
+	}
+
+	// Header and directory
+	snapshot_header header;
+	memcpy(header.signature, SNAPSHOT_SIGNATURE, 8);
+	header.num_areas = num_areas;
+	header.num_states = num_states;
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+	uint64 offset = sizeof(header) + num_areas * sizeof(snapshot_area_entry) + num_states * sizeof(snapshot_state_entry);
+	for (int i = 0; i < num_states; i++) {
+		snapshot_state_entry e;
+		memset(&e, 0, sizeof(e));
+		strncpy(e.name, states[i].name, sizeof(e.name) - 1);
+		e.size = states[i].size;
+		e.type = states[i].type;
+		e.offset = offset;
+		offset += e.size;
+		ok = ok && fwrite(&e, sizeof(e), 1, f) == 1;
+	}
+	for (int i = 0; i < num_areas; i++) {
+		snapshot_area_entry e;
+		offset = align_offset(offset);
+		e.addr = areas[i].addr;
+		e.size = areas[i].size;
+		e.offset = offset;
+		offset += e.size;
+		ok = ok && fwrite(&e, sizeof(e), 1, f) == 1;
+	}
+
+	// Contents, in the same order
+	for (int i = 0; i < num_states; i++)
+		ok = ok && fwrite(states[i].data, states[i].size, 1, f) == 1;
+	for (int i = 0; i < num_areas; i++) {
+		ok = ok && fseek(f, align_offset(ftell(f)), SEEK_SET) == 0;
+		ok = ok && fwrite(Mac2HostAddr(areas[i].addr), areas[i].size, 1, f) == 1;
+	}
+
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok) {
+		fprintf(stderr, "WARNING: Cannot write snapshot '%s'\n", save_path);
+		remove(save_path);
+		return false;
+	}
+	printf("Saved snapshot to '%s'\n", save_path);
+	return true;
+}
+
+void SnapshotSafePoint(int nesting)
+{
+	// Host code called by the guest (Execute68k(), CallMacOS(), ...) is
+	// still running, its state isn't saved, so wait for the top level
+	if (nesting > 0)
+		return;
+
+	SnapshotPending = false;
+	snapshot_save();
+	if (boot_hook)
+		boot_hook();
+}
+
+
+/*
+ *  Load snapshot
+ */
+
+static bool read_at(FILE *f, uint64 offset, void *data, uint32 size)
+{
+	return fseek(f, offset, SEEK_SET) == 0 && fread(data, size, 1, f) == 1;
+}
+
+static bool load_area(FILE *f, const snapshot_area &a, uint64 offset)
+{
+#ifdef HAVE_MMAP
+	if (a.lazy) {
+		// Map privately, pages are read when the guest first touches them
+		void *p = mmap(Mac2HostAddr(a.addr), a.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(f), offset);
+		if (p != MAP_FAILED)
+			return true;
+		D(bug("Snapshot: mmap() of area %08x failed, reading it\n", a.addr));
+	}
+#endif
+	return read_at(f, offset, Mac2HostAddr(a.addr), a.size);
+}
+
+static bool snapshot_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "WARNING: Cannot open snapshot '%s'\n", path);
+		return false;
+	}
+
+	// Check that the snapshot matches this configuration
+	snapshot_header header;
+	const char *error = NULL;
+	snapshot_state_entry state_entries[SNAPSHOT_MAX_STATES];
+	snapshot_area_entry area_entries[SNAPSHOT_MAX_AREAS];
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.signature, SNAPSHOT_SIGNATURE, 8))
+		error = "not a snapshot file";
+	else if (header.num_states != uint32(num_states) || header.num_areas != uint32(num_areas))
+		error = "different configuration";
+	else if (fread(state_entries, sizeof(snapshot_state_entry), num_states, f) != size_t(num_states)
+		  || fread(area_entries, sizeof(snapshot_area_entry), num_areas, f) != size_t(num_areas))
+		error = "file truncated";
+	for (int i = 0; error == NULL && i < num_states; i++) {
+		const snapshot_state_entry &e = state_entries[i];
+		if (strncmp(e.name, states[i].name, sizeof(e.name)) || e.size != states[i].size || e.type != uint32(states[i].type))
+			error = "different configuration";
+		else if (e.type == SNAPSHOT_CHECK) {
+			uint8 buf[64];
+			if (e.size > sizeof(buf) || !read_at(f, e.offset, buf, e.size) || memcmp(buf, states[i].data, e.size)) {
+				fprintf(stderr, "Snapshot: '%s' differs\n", e.name);
+				error = "different configuration";
+			}
+		}
+	}
+	for (int i = 0; error == NULL && i < num_areas; i++) {
+		if (area_entries[i].addr != areas[i].addr || area_entries[i].size != areas[i].size)
+			error = "different memory layout";
+	}
+	if (error) {
+		fprintf(stderr, "WARNING: Cannot restore snapshot '%s' (%s)\n", path, error);
+		fclose(f);
+		return false;
+	}
+
+	// Restore host variables and Mac memory
+	bool ok = true;
+	for (int i = 0; ok && i < num_states; i++) {
+		if (state_entries[i].type == SNAPSHOT_STATE)
+			ok = read_at(f, state_entries[i].offset, states[i].data, states[i].size);
+	}
+	for (int i = 0; ok && i < num_areas; i++)
+		ok = load_area(f, areas[i], area_entries[i].offset);
+	fclose(f);
+	if (!ok) {
+		ErrorAlert("Error reading snapshot, machine state is inconsistent");
+		return false;
+	}
+
+	for (int i = 0; i < num_states; i++) {
+		if (states[i].restored)
+			states[i].restored();
+	}
+	printf("Restored snapshot from '%s'\n", path);
+	return true;
+}
+
+
+/*
+ *  Initialization
+ */
+
+bool SnapshotInit(void)
+{
+	const char *load_path = PrefsFindString("snapshotload");
+	save_path = PrefsFindString("snapshotsave");
+#if !EMULATED_PPC
+	if (load_path || save_path) {
+		fprintf(stderr, "WARNING: Snapshots need the emulated PowerPC CPU, ignored\n");
+		save_path = NULL;
+		return true;
+	}
+#endif
+	if ((load_path || save_path) && num_areas == 0) {
+		fprintf(stderr, "WARNING: Snapshots are not supported on this platform, ignored\n");
+		save_path = NULL;
+		return true;
+	}
+
+	SnapshotAddState("cpu", &SnapshotCPU, sizeof(SnapshotCPU));
+	SnapshotAddState("xpram", XPRAM, XPRAM_SIZE);
+	SnapshotAddState("ramsize", &RAMSize, sizeof(RAMSize), SNAPSHOT_CHECK);
+	SnapshotAddState("rambase", &RAMBase, sizeof(RAMBase), SNAPSHOT_CHECK);
+	SnapshotAddState("rombase", &ROMBase, sizeof(ROMBase), SNAPSHOT_CHECK);
+	TimerSnapshotRegister();
+	VideoSnapshotRegister();
+	MacOSUtilSnapshotRegister();
+	NameRegistrySnapshotRegister();
+	SerialSnapshotRegister();
+
+	// A machine restored from a snapshot doesn't boot, don't save it again
+	if (load_path) {
+		if (!snapshot_load(load_path))
+			return false;
+		SnapshotRestored = true;
+		save_path = NULL;
+		if (boot_hook)
+			SnapshotPending = true;
+	}
+	return true;
+}
@@ -0,0 +1,561 @@
+/*
+ *  stats.cpp - Runtime statistics
+ *
+ *  SheepShaver (C) 1997-2008 Christian Bauer and Marc Hellwig
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "sysdeps.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "main.h"
+#include "prefs.h"
+#include "timer.h"
+#include "cpu_emulation.h"
+#include "emul_op.h"
+#include "thunks.h"
+#include "stats.h"
+#include "snapshot.h"
+
+#define DEBUG 0
+#include "debug.h"
+
+
+// Global variables
+bool StatsEnabled = false;
+
+// Registered statistics providers
+const int MAX_STATS_PROVIDERS = 16;
+
+struct stats_provider {
+	const char *name;
+	stats_print_func print;
+};
+
+static stats_provider providers[MAX_STATS_PROVIDERS];
+static int num_providers = 0;
+
+// Prototypes
+static void interrupt_stats_print(FILE *f);
+static void boot_phase_print(FILE *f);
+static void trap_profile_init(void);
+
+
+/*
+ *  Initialization
+ */
+
+void StatsInit(void)
+{
+	StatsEnabled = PrefsFindBool("stats");
+	StatsRegister("interrupts", interrupt_stats_print);
+	StatsRegister("boot phases", boot_phase_print);
+	trap_profile_init();
+}
+
+
+/*
+ *  Deinitialization, print summary
+ */
+
+void StatsExit(void)
+{
+	if (StatsEnabled)
+		StatsPrintAll(stdout);
+	else if (TrapProfileEnabled)
+		StatsPrint("A-traps", stdout);
+	StatsEnabled = false;
+	TrapProfileEnabled = false;
+}
+
+
+/*
+ *  Histograms
+ */
+
+void StatsHistogramReset(stats_histogram *h)
+{
+	memset(h, 0, sizeof(stats_histogram));
+}
+
+void StatsHistogramAdd(stats_histogram *h, uint64 value)
+{
+	int i = 0;
+	for (uint64 v = value; v && i < STATS_HISTOGRAM_BUCKETS - 1; v >>= 1)
+		i++;
+	h->bucket[i]++;
+	h->count++;
+	h->total += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+// Returns upper bound of bucket holding the given percentile
+uint64 StatsHistogramPercentile(const stats_histogram *h, int percent)
+{
+	if (h->count == 0)
+		return 0;
+	uint64 limit = (h->count * percent + 99) / 100;
+	uint64 sum = 0;
+	for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		sum += h->bucket[i];
+		if (sum >= limit) {
+			uint64 upper = i ? (UVAL64(1) << i) - 1 : 0;
+			return upper < h->max ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+void StatsHistogramPrint(FILE *f, const stats_histogram *h, const char *unit)
+{
+	if (h->count == 0) {
+		fprintf(f, "  no samples\n");
+		return;
+	}
+	fprintf(f, "  samples %llu, avg %llu %s, p50 <= %llu, p99 <= %llu, max %llu %s\n",
+		(unsigned long long)h->count, (unsigned long long)(h->total / h->count), unit,
+		(unsigned long long)StatsHistogramPercentile(h, 50), (unsigned long long)StatsHistogramPercentile(h, 99),
+		(unsigned long long)h->max, unit);
+	for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		if (h->bucket[i] == 0)
+			continue;
+		uint64 lower = i ? UVAL64(1) << (i - 1) : 0;
+		uint64 upper = i ? (UVAL64(1) << i) - 1 : 0;
+		fprintf(f, "  %12llu .. %-12llu %s : %10llu %5.1f%%\n",
+			(unsigned long long)lower, (unsigned long long)upper, unit,
+			(unsigned long long)h->bucket[i], 100.0 * double(h->bucket[i]) / double(h->count));
+	}
+}
+
+
+/*
+ *  Statistics providers
+ */
+
+void StatsRegister(const char *name, stats_print_func print)
+{
+	for (int i = 0; i < num_providers; i++) {
+		if (strcmp(providers[i].name, name) == 0) {
+			providers[i].print = print;
+			return;
+		}
+	}
+	if (num_providers < MAX_STATS_PROVIDERS) {
+		providers[num_providers].name = name;
+		providers[num_providers].print = print;
+		num_providers++;
+	} else
+		D(bug("StatsRegister: too many providers, ignoring '%s'\n", name));
+}
+
+bool StatsPrint(const char *name, FILE *f)
+{
+	for (int i = 0; i < num_providers; i++) {
+		if (strcmp(providers[i].name, name) == 0) {
+			providers[i].print(f);
+			return true;
+		}
+	}
+	return false;
+}
+
+void StatsPrintAll(FILE *f)
+{
+	for (int i = 0; i < num_providers; i++) {
+		fprintf(f, "### Statistics for %s\n", providers[i].name);
+		providers[i].print(f);
+		fprintf(f, "\n");
+	}
+	fflush(f);
+}
+
+
+/*
+ *  Interrupt latency statistics
+ *
+ *  The latency of an interrupt source is the time between the first
+ *  SetInterruptFlag() and the execution of its handler in OP_IRQ.
+ *  Further SetInterruptFlag() calls for a source that is still pending
+ *  are counted as coalesced. A pending interrupt that HandleInterrupt()
+ *  can't deliver is counted as deferred once, however often it is tried.
+ */
+
+const int NUM_IRQ_SOURCES = 7;	// INTFLAG_* bit numbers 0..6
+
+static const char *irq_source_names[NUM_IRQ_SOURCES] = {
+	"VIA", "Serial", "Ethernet", NULL, "Audio", "Timer", "ADB"
+};
+
+struct irq_source_stats {
+	volatile uint64 raise_time;	// Time of pending SetInterruptFlag() [usec], 0 = not pending
+	volatile uint32 raised;		// Number of SetInterruptFlag() calls (from any thread)
+	volatile uint32 coalesced;	// Number of SetInterruptFlag() calls while already pending
+	uint32 deferred[2];			// Number of deferred interrupts, per IRQ_DEFER_* reason
+	bool defer_counted;			// Flag: pending interrupt already counted as deferred
+	stats_histogram latency;	// SetInterruptFlag() to handler [usec]
+};
+
+static irq_source_stats irq_stats[NUM_IRQ_SOURCES];
+
+static inline int irq_source(uint32 flag)
+{
+	int i = 0;
+	while (flag > 1 && i < NUM_IRQ_SOURCES - 1) {
+		flag >>= 1;
+		i++;
+	}
+	return i;
+}
+
+void InterruptStatsRaise(uint32 flag)
+{
+	if (!StatsEnabled)
+		return;
+	irq_source_stats *s = &irq_stats[irq_source(flag)];
+	__sync_fetch_and_add(&s->raised, 1);
+	if (InterruptFlags & flag)
+		__sync_fetch_and_add(&s->coalesced, 1);
+	else if (s->raise_time == 0)
+		__sync_bool_compare_and_swap(&s->raise_time, 0, GetTicks_usec());
+}
+
+void InterruptStatsDeliver(uint32 flag)
+{
+	if (!StatsEnabled)
+		return;
+	irq_source_stats *s = &irq_stats[irq_source(flag)];
+	s->defer_counted = false;
+	uint64 raise_time = s->raise_time;
+	if (raise_time) {
+		s->raise_time = 0;
+		uint64 now = GetTicks_usec();
+		StatsHistogramAdd(&s->latency, now > raise_time ? now - raise_time : 0);
+	}
+}
+
+void InterruptStatsDefer(uint32 flags, int reason)
+{
+	if (!StatsEnabled)
+		return;
+	for (int i = 0; i < NUM_IRQ_SOURCES; i++) {
+		irq_source_stats *s = &irq_stats[i];
+		if ((flags & (1 << i)) && !s->defer_counted) {
+			s->deferred[reason]++;
+			s->defer_counted = true;
+		}
+	}
+}
+
+static void interrupt_stats_print(FILE *f)
+{
+	for (int i = 0; i < NUM_IRQ_SOURCES; i++) {
+		const irq_source_stats *s = &irq_stats[i];
+		if (irq_source_names[i] == NULL || s->raised == 0)
+			continue;
+		fprintf(f, "%-8s: raised %u, coalesced %u, deferred %u (irq nest) + %u (run mode)\n",
+			irq_source_names[i], s->raised, s->coalesced, s->deferred[IRQ_DEFER_NEST], s->deferred[IRQ_DEFER_MODE]);
+		StatsHistogramPrint(f, &s->latency, "usec");
+	}
+}
+
+
+/*
+ *  Boot phase timings
+ *
+ *  Each phase lasts from the previous BootPhase() call (or from
+ *  BootPhaseStart()) to the BootPhase() call that names it. Mac OS counts as up on
+ *  the first VBL after both the warm start flag has been set and
+ *  PatchAfterStartup() has been called.
+ */
+
+const char *BootBenchmarkFile = NULL;
+
+const int MAX_BOOT_PHASES = 32;
+
+struct boot_phase {
+	const char *name;
+	uint64 time;				// End of phase [usec]
+};
+
+static boot_phase boot_phases[MAX_BOOT_PHASES];
+static int num_boot_phases = 0;
+static uint64 boot_start_time = 0;
+static bool boot_patched = false;			// Flag: PatchAfterStartup() called
+static bool boot_done = false;
+
+void BootPhaseStart(void)
+{
+	boot_start_time = GetTicks_usec();
+}
+
+void BootPhase(const char *name)
+{
+	uint64 now = GetTicks_usec();
+	if (boot_start_time == 0)
+		boot_start_time = now;
+	if (boot_done || num_boot_phases == MAX_BOOT_PHASES)
+		return;
+	boot_phases[num_boot_phases].name = name;
+	boot_phases[num_boot_phases].time = now;
+	num_boot_phases++;
+	if (strcmp(name, "patch_after_startup") == 0)
+		boot_patched = true;
+	D(bug("Boot phase '%s' done after %llu usec\n", name, (unsigned long long)(now - boot_start_time)));
+}
+
+void BootPhaseVBL(void)
+{
+	if (boot_done || !boot_patched)
+		return;
+	BootPhase("desktop");
+	boot_done = true;
+	SnapshotBootDone();
+	if (BootBenchmarkFile) {
+		FILE *f = fopen(BootBenchmarkFile, "w");
+		if (f) {
+			BootPhasePrintJSON(f);
+			fclose(f);
+		} else
+			fprintf(stderr, "WARNING: Cannot create boot benchmark file '%s'\n", BootBenchmarkFile);
+		QuitEmulator();
+	}
+}
+
+void BootPhasePrintJSON(FILE *f)
+{
+	uint64 last = boot_start_time;
+	fprintf(f, "{\n  \"phases\": [\n");
+	for (int i = 0; i < num_boot_phases; i++) {
+		fprintf(f, "    { \"name\": \"%s\", \"usec\": %llu, \"end_usec\": %llu }%s\n",
+			boot_phases[i].name, (unsigned long long)(boot_phases[i].time - last),
+			(unsigned long long)(boot_phases[i].time - boot_start_time), i < num_boot_phases - 1 ? "," : "");
+		last = boot_phases[i].time;
+	}
+	fprintf(f, "  ],\n  \"complete\": %s,\n  \"total_usec\": %llu\n}\n",
+		boot_done ? "true" : "false", (unsigned long long)(last - boot_start_time));
+	fflush(f);
+}
+
+static void boot_phase_print(FILE *f)
+{
+	uint64 last = boot_start_time;
+	for (int i = 0; i < num_boot_phases; i++) {
+		uint64 t = boot_phases[i].time;
+		fprintf(f, "%-20s: %10.1f msec (at %10.1f msec)\n", boot_phases[i].name,
+			double(t - last) / 1000.0, double(t - boot_start_time) / 1000.0);
+		last = t;
+	}
+}
+
+
+/*
+ *  A-trap profiler
+ *
+ *  The entries for A-line opcodes in the opcode table of the 68k emulator
+ *  are replaced by a SheepShaver opcode which counts the trap and then
+ *  executes the replaced PowerPC opcode. Library routines are profiled
+ *  by pointing their TVector to a SheepShaver opcode which counts the
+ *  call and jumps to the original code.
+ *
+ *  To time a call, it gets a frame slot and its return address is replaced
+ *  by the return trampoline of that slot: the link register for library
+ *  routines, the 68k PC the trap dispatcher returns to for A-traps. The
+ *  PowerPC trampolines are SheepShaver opcodes, the 68k ones an EMUL_OP
+ *  that pushes the original return address, followed by an RTS. Times
+ *  include nested calls and interrupts. Auto-pop traps, which don't return
+ *  to their caller, and calls made while all slots are in use are only
+ *  counted. While profiling, patches that look at the return address of a
+ *  trap ("come-from" patches) see the trampoline instead of the caller.
+ */
+
+bool TrapProfileEnabled = false;
+
+const int TRAP_PROFILE_ENTRIES = TRAP_PROFILE_ATRAPS + TRAP_PROFILE_LIBS;
+const int TRAP_PROFILE_FRAMES = 256;	// Max. number of calls being timed
+
+struct trap_profile_entry {
+	uint32 count;					// Number of calls
+	uint32 returns;					// Number of timed calls that returned
+	uint64 time;					// Accumulated time of returned calls [STATS_TIMESTAMP_UNIT]
+};
+
+struct trap_profile_frame {
+	int32 id;						// Entry being timed, -1 if slot is free
+	uint32 ret;						// Original return address
+	uint64 start;					// Time of call
+};
+
+// Calls being timed, saved in snapshots because the guest stack refers to their trampolines
+struct trap_profile_frames {
+	trap_profile_frame frame[TRAP_PROFILE_FRAMES];
+	int32 free[TRAP_PROFILE_FRAMES];	// Stack of free slots
+	int32 num_free;
+};
+
+static trap_profile_entry trap_profile[TRAP_PROFILE_ENTRIES];
+static uint32 trap_profile_opcode[TRAP_PROFILE_ATRAPS];		// Replaced opcode table entries
+static const char *trap_profile_lib_name[TRAP_PROFILE_LIBS];
+static uint32 trap_profile_lib_code[TRAP_PROFILE_LIBS];		// Original code addresses of library routines
+static int trap_profile_num_libs = 0;
+static trap_profile_frames trap_profile_calls;
+static uint32 trap_profile_lib_return = 0;		// PowerPC return trampolines, 4 bytes per slot
+static uint32 trap_profile_atrap_return = 0;	// 68k return trampolines, 4 bytes per slot
+
+static void trap_profile_print(FILE *f);
+static void trap_profile_restored(void);
+
+static void trap_profile_init(void)
+{
+	if (!PrefsFindBool("trapprofile"))
+		return;
+	TrapProfileEnabled = true;
+	StatsRegister("A-traps", trap_profile_print);
+
+	for (int i = 0; i < TRAP_PROFILE_FRAMES; i++) {
+		trap_profile_calls.frame[i].id = -1;
+		trap_profile_calls.free[i] = TRAP_PROFILE_FRAMES - 1 - i;
+	}
+	trap_profile_calls.num_free = TRAP_PROFILE_FRAMES;
+#if EMULATED_PPC
+	trap_profile_lib_return = SheepMem::ReserveProc(TRAP_PROFILE_FRAMES * 4);
+	trap_profile_atrap_return = SheepMem::ReserveProc(TRAP_PROFILE_FRAMES * 4);
+	for (int i = 0; i < TRAP_PROFILE_FRAMES; i++) {
+		WriteMacInt32(trap_profile_lib_return + i * 4, POWERPC_LIB_PROFILE | (TRAP_PROFILE_LIB_RETURN << 6));
+		WriteMacInt16(trap_profile_atrap_return + i * 4, M68K_EMUL_OP_ATRAP_RETURN);
+		WriteMacInt16(trap_profile_atrap_return + i * 4 + 2, M68K_RTS);
+	}
+#endif
+	SnapshotAddState("trap_profile", &trap_profile_calls, sizeof(trap_profile_calls), SNAPSHOT_STATE,
+		NULL, trap_profile_restored);
+}
+
+// Calls from the saved session are timed from the restore on
+static void trap_profile_restored(void)
+{
+	uint64 now = StatsTimestamp();
+	for (int i = 0; i < TRAP_PROFILE_FRAMES; i++)
+		trap_profile_calls.frame[i].start = now;
+}
+
+// Count call and start timing it, returns frame slot or -1 if none is free
+static int trap_profile_enter(int id, uint32 ret)
+{
+	trap_profile[id].count++;
+	if (trap_profile_calls.num_free == 0)
+		return -1;
+	int slot = trap_profile_calls.free[--trap_profile_calls.num_free];
+	trap_profile_frame &fr = trap_profile_calls.frame[slot];
+	fr.id = id;
+	fr.ret = ret;
+	fr.start = StatsTimestamp();
+	return slot;
+}
+
+// Call in frame slot returned, returns original return address
+static uint32 trap_profile_leave(int slot)
+{
+	assert(slot >= 0 && slot < TRAP_PROFILE_FRAMES);
+	trap_profile_frame &fr = trap_profile_calls.frame[slot];
+	assert(fr.id >= 0);
+	trap_profile_entry &e = trap_profile[fr.id];
+	e.returns++;
+	e.time += StatsTimestamp() - fr.start;
+	fr.id = -1;
+	trap_profile_calls.free[trap_profile_calls.num_free++] = slot;
+	return fr.ret;
+}
+
+void TrapProfileSetOpcode(int trap, uint32 opcode)
+{
+	trap_profile_opcode[trap] = opcode;
+}
+
+uint32 TrapProfileATrap(int trap, uint32 *pc)
+{
+	if ((trap & 0x0c00) == 0x0c00)		// Auto-pop bit set
+		trap_profile[trap].count++;
+	else {
+		int slot = trap_profile_enter(trap, *pc);
+		if (slot >= 0)
+			*pc = trap_profile_atrap_return + slot * 4;
+	}
+	return trap_profile_opcode[trap];
+}
+
+uint32 TrapProfileATrapReturn(uint32 pc)
+{
+	return trap_profile_leave((pc - trap_profile_atrap_return) / 4);
+}
+
+int TrapProfileAddLib(const char *name, uint32 code)
+{
+	if (trap_profile_num_libs == TRAP_PROFILE_LIBS)
+		return -1;
+	trap_profile_lib_name[trap_profile_num_libs] = name;
+	trap_profile_lib_code[trap_profile_num_libs] = code;
+	return trap_profile_num_libs++;
+}
+
+uint32 TrapProfileLibCall(int index, uint32 *lr)
+{
+	int slot = trap_profile_enter(TRAP_PROFILE_ATRAPS + index, *lr);
+	if (slot >= 0)
+		*lr = trap_profile_lib_return + slot * 4;
+	return trap_profile_lib_code[index];
+}
+
+uint32 TrapProfileLibReturn(uint32 pc)
+{
+	return trap_profile_leave((pc - trap_profile_lib_return) / 4);
+}
+
+static int trap_profile_compare(const void *a, const void *b)
+{
+	const trap_profile_entry *x = &trap_profile[*(const int *)a];
+	const trap_profile_entry *y = &trap_profile[*(const int *)b];
+	if (x->time != y->time)
+		return x->time < y->time ? 1 : -1;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return *(const int *)a - *(const int *)b;
+}
+
+static void trap_profile_print(FILE *f)
+{
+	static int order[TRAP_PROFILE_ENTRIES];
+	int n = 0;
+	for (int i = 0; i < TRAP_PROFILE_ENTRIES; i++) {
+		if (trap_profile[i].count)
+			order[n++] = i;
+	}
+	qsort(order, n, sizeof(order[0]), trap_profile_compare);
+
+	fprintf(f, "%-24s %10s %10s %16s %12s  (time in %s, including nested calls)\n",
+		"Trap", "calls", "returns", "time", "avg", STATS_TIMESTAMP_UNIT);
+	for (int i = 0; i < n; i++) {
+		const trap_profile_entry *e = &trap_profile[order[i]];
+		char name[32];
+		if (order[i] < TRAP_PROFILE_ATRAPS)
+			sprintf(name, "%04X", 0xa000 + order[i]);
+		else
+			sprintf(name, "%.23s()", trap_profile_lib_name[order[i] - TRAP_PROFILE_ATRAPS]);
+		fprintf(f, "%-24s %10u %10u %16llu %12llu\n", name, e->count, e->returns,
+			(unsigned long long)e->time, (unsigned long long)(e->returns ? e->time / e->returns : 0));
+	}
+}
@@ -64,6 +64,7 @@ uint32 NativeOpcode(int selector)
 	case NATIVE_NQD_BITBLT:
 	case NATIVE_NQD_INVRECT:
 	case NATIVE_NQD_FILLRECT:
+	case NATIVE_WAIT_NEXT_EVENT:
 		opcode = POWERPC_NATIVE_OP(0, selector);
 		break;
   	case NATIVE_PATCH_NAME_REGISTRY:
@@ -96,6 +97,10 @@ uint32 NativeOpcode(int selector)
 	case NATIVE_GET_NAMED_RESOURCE:
 	case NATIVE_GET_1_NAMED_RESOURCE:
   	case NATIVE_MAKE_EXECUTABLE:
+	case NATIVE_BLOCK_MOVE:
+	case NATIVE_BLOCK_MOVE_DATA:
+	case NATIVE_BLOCK_ZERO:
+	case NATIVE_TICK_COUNT:
 		opcode = POWERPC_NATIVE_OP(1, selector);
 		break;
 	default:
@@ -328,6 +333,10 @@ bool ThunksInit(void)
 	DEFINE_NATIVE_OP(NATIVE_NQD_BITBLT, NQD_bitblt);
 	DEFINE_NATIVE_OP(NATIVE_NQD_INVRECT, NQD_invrect);
 	DEFINE_NATIVE_OP(NATIVE_NQD_FILLRECT, NQD_fillrect);
+	DEFINE_NATIVE_OP(NATIVE_BLOCK_MOVE, Mac_BlockMove);
+	DEFINE_NATIVE_OP(NATIVE_BLOCK_MOVE_DATA, Mac_BlockMoveData);
+	DEFINE_NATIVE_OP(NATIVE_BLOCK_ZERO, Mac_BlockZero);
+	DEFINE_NATIVE_OP(NATIVE_TICK_COUNT, IdleTickCount);
 #undef DEFINE_NATIVE_OP
 #endif
 
@@ -23,6 +23,8 @@
 #include "macos_util.h"
 #include "main.h"
 #include "cpu_emulation.h"
+#include "replay.h"
+#include "snapshot.h"
 
 #ifdef PRECISE_TIMING_POSIX
 #include <pthread.h>
@@ -120,6 +122,18 @@ inline static TMDesc *find_desc(uint32 tm)
 }
 
 
+/*
+ *  Get current time as seen by the emulator thread (logged in event record/replay mode)
+ */
+
+inline static void emul_current_time(tm_time_t &t)
+{
+	timer_current_time(t);
+	if (ReplayMode != REPLAY_OFF)
+		ReplayValue(REPLAY_EV_TIME, &t, sizeof(t));
+}
+
+
 /*
  *  Enqueue task in Time Manager queue
  */
@@ -314,6 +328,31 @@ void TimerExit(void)
 }
 
 
+/*
+ *  Stop timer thread before fork() and start it again in both processes
+ */
+
+void TimerCloneBegin(void)
+{
+#ifdef PRECISE_TIMING_POSIX
+	if (timer_thread_active) {
+		timer_thread_kill();
+		sem_destroy(&suspend_ack_sem);
+	}
+#endif
+}
+
+void TimerCloneEnd(void)
+{
+#ifdef PRECISE_TIMING_POSIX
+	if (timer_thread_active) {
+		timer_thread_cancel = false;
+		timer_thread_active = timer_thread_init();
+	}
+#endif
+}
+
+
 /*
  *  Emulator reset, remove all timer tasks
  */
@@ -394,7 +433,7 @@ int16 RmvTime(uint32 tm)
 
 		// Compute remaining time
 		tm_time_t remaining, current;
-		timer_current_time(current);
+		emul_current_time(current);
 		timer_sub_time(remaining, desc->wakeup, current);
 		WriteMacInt32(tm + tmCount, timer_host2mac_time(remaining));
 	} else
@@ -467,7 +506,7 @@ int16 PrimeTime(uint32 tm, int32 time)
 
 			// No, calculate wakeup time relative to current time
 			tm_time_t now;
-			timer_current_time(now);
+			emul_current_time(now);
 			timer_add_time(desc->wakeup, now, delay);
 		}
 
@@ -478,7 +517,7 @@ int16 PrimeTime(uint32 tm, int32 time)
 
 		// Not extended task, calculate wakeup time relative to current time
 		tm_time_t now;
-		timer_current_time(now);
+		emul_current_time(now);
 		timer_add_time(desc->wakeup, now, delay);
 	}
 
@@ -601,6 +640,70 @@ static void *timer_func(void *arg)
 #endif
 
 
+/*
+ *  Save and restore installed tasks in snapshots
+ */
+
+const int TM_SNAPSHOT_TASKS = 64;
+
+struct tm_snapshot {
+	uint32 num_tasks;
+	struct {
+		uint32 task;		// Mac address of TMTask
+		int32 remaining;	// Time until wakeup (Mac format: >0 ms, <0 usec)
+	} tasks[TM_SNAPSHOT_TASKS];
+};
+
+static tm_snapshot tm_snapshot_data;
+
+static bool timer_snapshot_prepare(void)
+{
+	tm_time_t now;
+	timer_current_time(now);
+	int n = 0;
+	for (TMDesc *d = tmDescList; d; d = d->next, n++) {
+		if (n == TM_SNAPSHOT_TASKS) {
+			printf("WARNING: More than %d Time Manager tasks installed, not saving snapshot\n", TM_SNAPSHOT_TASKS);
+			return false;
+		}
+		tm_snapshot_data.tasks[n].task = d->task;
+		tm_snapshot_data.tasks[n].remaining = 0;
+		if (timer_cmp_time(d->wakeup, now) > 0) {
+			tm_time_t remaining;
+			timer_sub_time(remaining, d->wakeup, now);
+			tm_snapshot_data.tasks[n].remaining = timer_host2mac_time(remaining);
+		}
+	}
+	tm_snapshot_data.num_tasks = n;
+	return true;
+}
+
+static void timer_snapshot_restored(void)
+{
+	TimerReset();
+	tm_time_t now;
+	timer_current_time(now);
+	for (uint32 i = 0; i < tm_snapshot_data.num_tasks; i++) {
+		TMDesc *desc = new TMDesc;
+		tm_time_t delay;
+		timer_mac2host_time(delay, tm_snapshot_data.tasks[i].remaining);
+		desc->task = tm_snapshot_data.tasks[i].task;
+		timer_add_time(desc->wakeup, now, delay);
+		desc->next = tmDescList;
+		tmDescList = desc;
+	}
+
+	// TimerInterrupt() will schedule the next wakeup
+	SetInterruptFlag(INTFLAG_TIMER);
+}
+
+void TimerSnapshotRegister(void)
+{
+	SnapshotAddState("timer", &tm_snapshot_data, sizeof(tm_snapshot_data), SNAPSHOT_STATE,
+		timer_snapshot_prepare, timer_snapshot_restored);
+}
+
+
 /*
  *  Timer interrupt function (executed as part of 60Hz interrupt)
  */
@@ -611,7 +714,7 @@ void TimerInterrupt(void)
 
 	// Look for active TMTasks that have expired
 	tm_time_t now;
-	timer_current_time(now);
+	emul_current_time(now);
 	TMDesc *desc = tmDescList;
 	while (desc) {
 		TMDesc *next = desc->next;
@@ -35,6 +35,7 @@
 #include "user_strings.h"
 #include "version.h"
 #include "thunks.h"
+#include "snapshot.h"
 
 #define DEBUG 0
 #include "debug.h"
@@ -48,6 +49,7 @@ int display_type = DIS_INVALID;		// Current display type
 rgb_color mac_pal[256];
 uint8 remap_mac_be[256];
 uint8 MacCursor[68] = {16, 1};	// Mac cursor image
+void (*video_damage_hook)(void) = NULL;	// Wakes the display refresh, set by the video driver
 
 
 bool keyfile_valid;		// Flag: Keyfile is valid, enable full-screen modes
@@ -102,6 +104,48 @@ void NQDMisc(uint32 arg1, uintptr arg2)
 	CallMacOS2(nqdmisc_ptr, nqdmisc_tvect, arg1, (void *)arg2);
 }
 
+/*
+ *  Save and restore driver state in snapshots
+ */
+
+static struct {
+	uint32 open;
+	VidLocals locals;
+} video_snapshot_data;
+
+static bool video_snapshot_prepare(void)
+{
+	video_snapshot_data.open = private_data != NULL;
+	if (private_data)
+		video_snapshot_data.locals = *private_data;
+	return true;
+}
+
+static void video_snapshot_restored(void)
+{
+	delete private_data;
+	private_data = NULL;
+	if (video_snapshot_data.open) {
+		private_data = new VidLocals;
+		*private_data = video_snapshot_data.locals;
+	}
+}
+
+void VideoSnapshotRegister(void)
+{
+	// The display was opened with the mode from the prefs, which must be the current one
+	SnapshotAddState("video_mode", &cur_mode, sizeof(cur_mode), SNAPSHOT_CHECK);
+	SnapshotAddState("video_locals", &video_snapshot_data, sizeof(video_snapshot_data), SNAPSHOT_STATE,
+		video_snapshot_prepare, video_snapshot_restored);
+	SnapshotAddState("video_conf_id", &save_conf_id, sizeof(save_conf_id));
+	SnapshotAddState("video_conf_mode", &save_conf_mode, sizeof(save_conf_mode));
+	SnapshotAddState("video_iocic_tvect", &iocic_tvect, sizeof(iocic_tvect));
+	SnapshotAddState("vslnewis_tvect", &vslnewis_tvect, sizeof(vslnewis_tvect));
+	SnapshotAddState("vsldisposeis_tvect", &vsldisposeis_tvect, sizeof(vsldisposeis_tvect));
+	SnapshotAddState("vsldois_tvect", &vsldois_tvect, sizeof(vsldois_tvect));
+	SnapshotAddState("nqdmisc_tvect", &nqdmisc_tvect, sizeof(nqdmisc_tvect));
+}
+
 
 // Prototypes
 static int16 set_gamma(VidLocals *csSave, uint32 gamma);
@@ -121,23 +165,50 @@ bool VideoActivated(void)
  *  Create RGB snapshot of current screen
  */
 
+// Convert pixel x of a frame buffer line (big-endian) to RGB
+static void snapshot_pixel(const uint8 *line, uint32 x, uint32 mode, uint8 *p)
+{
+	switch (mode) {
+		case APPLE_16_BIT: {		// 1-5-5-5
+			uint32 pixel = (line[x * 2] << 8) | line[x * 2 + 1];
+			uint32 r = (pixel >> 10) & 0x1f, g = (pixel >> 5) & 0x1f, b = pixel & 0x1f;
+			p[0] = (r << 3) | (r >> 2);
+			p[1] = (g << 3) | (g >> 2);
+			p[2] = (b << 3) | (b >> 2);
+			break;
+		}
+		case APPLE_32_BIT:			// x-8-8-8
+			p[0] = line[x * 4 + 1];
+			p[1] = line[x * 4 + 2];
+			p[2] = line[x * 4 + 3];
+			break;
+		default: {					// Indexed, 1..8 bits
+			uint32 bits = 1 << (mode - APPLE_1_BIT);
+			uint32 bit = x * bits;
+			uint8 index = (line[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+			p[0] = mac_pal[index].red;
+			p[1] = mac_pal[index].green;
+			p[2] = mac_pal[index].blue;
+			break;
+		}
+	}
+}
+
 bool VideoSnapshot(int xsize, int ysize, uint8 *p)
 {
-	if (display_type == DIS_WINDOW) {
-		uint8 *screen = (uint8 *)private_data->saveBaseAddr;
-		uint32 row_bytes = VModes[cur_mode].viRowBytes;	
-		uint32 y2size = VModes[cur_mode].viYsize;
-		uint32 x2size = VModes[cur_mode].viXsize;
-		for (int j=0;j<ysize;j++) {
-			for (int i=0;i<xsize;i++) {
-				*p++ = mac_pal[screen[uint32(float(j)*float(y2size)/float(ysize))*row_bytes+uint32(float(i)*float(x2size)/float(xsize))]].red;
-				*p++ = mac_pal[screen[uint32(float(j)*float(y2size)/float(ysize))*row_bytes+uint32(float(i)*float(x2size)/float(xsize))]].green;
-				*p++ = mac_pal[screen[uint32(float(j)*float(y2size)/float(ysize))*row_bytes+uint32(float(i)*float(x2size)/float(xsize))]].blue;
-			}
+	if (display_type != DIS_WINDOW || private_data == NULL)
+		return false;
+
+	const uint8 *screen = Mac2HostAddr(private_data->saveBaseAddr);
+	const VideoInfo &mode = VModes[cur_mode];
+	for (int j=0;j<ysize;j++) {
+		const uint8 *line = screen + uint32(float(j)*float(mode.viYsize)/float(ysize)) * mode.viRowBytes;
+		for (int i=0;i<xsize;i++) {
+			snapshot_pixel(line, uint32(float(i)*float(mode.viXsize)/float(xsize)), mode.viAppleMode, p);
+			p += 3;
 		}
-		return true;
 	}
-	return false;
+	return true;
 }
 
 